@@ -0,0 +1,152 @@
+/* Copyright (c) Victor Roemer, 2013. All rights reserved.
+ * See LICENSE in the root source directory for details. */
+
+/* bench-batch.c
+ *
+ * Lookups in a table larger than the last level cache, one hash_get() at a
+ * time against hash_get_batch() over batches of a few sizes. Half the keys
+ * looked up are in the table. Batches load the home buckets of all their
+ * keys before resolving any, so their cache misses overlap.
+ *
+ *      BENCH_ENTRIES=n BENCH_LOOKUPS=n bench-batch
+ */
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "hashtable.h"
+#include "hashdigest.h"
+#include "bench.h"
+
+static const size_t batches[] = { 4, 8, 16, 32, 64 };
+
+static void
+fill(Hash *table, unsigned long entries)
+{
+    struct bench_key key;
+
+    for (unsigned long i = 0; i < entries; i++) {
+        bench_key(&key, i);
+        if (hash_insert(table, (void *)(uintptr_t)(i + 1), &key) < 0) {
+            fprintf(stderr, "hash_insert: table full at %lu\n", i);
+            exit(1);
+        }
+    }
+
+    /* Lookups carry on a resize, finish it before timing them */
+    for (unsigned long i = 0; i < entries; i++) {
+        bench_key(&key, i);
+        hash_get(table, &key);
+    }
+}
+
+static double
+one_at_a_time(Hash *table, const struct bench_key *keys, unsigned long count,
+    unsigned long *found)
+{
+    uint64_t start = bench_ns();
+
+    for (unsigned long i = 0; i < count; i++)
+        *found += hash_get(table, &keys[i]) != NULL;
+
+    return (double)(bench_ns() - start) / count;
+}
+
+static double
+batched(Hash *table, const struct bench_key *keys, const uint32_t *digests,
+    unsigned long count, size_t batch, unsigned long *found)
+{
+    const void *batch_keys[64];
+    void *values[64];
+
+    uint64_t start = bench_ns();
+
+    for (unsigned long i = 0; i + batch <= count; i += batch) {
+        for (size_t j = 0; j < batch; j++)
+            batch_keys[j] = &keys[i + j];
+
+        hash_get_batch(table, batch_keys, digests ? digests + i : NULL,
+            values, batch);
+
+        for (size_t j = 0; j < batch; j++)
+            *found += values[j] != NULL;
+    }
+
+    return (double)(bench_ns() - start) / (count - count % batch);
+}
+
+int
+main(void)
+{
+    unsigned long entries = bench_param("BENCH_ENTRIES", 8000000);
+    unsigned long count = bench_param("BENCH_LOOKUPS", 4000000);
+    struct hash_stats stats = { 0 };
+    struct bench_key *keys;
+    uint32_t *digests;
+    uint64_t seed = 1;
+    Hash *table;
+
+    digest_init();
+
+    if ((table = hash_create(entries * 2, sizeof *keys)) == NULL ||
+        (keys = malloc(count * sizeof *keys)) == NULL ||
+        (digests = malloc(count * sizeof *digests)) == NULL) {
+        fprintf(stderr, "bench-batch: out of memory\n");
+        return 1;
+    }
+
+    fill(table, entries);
+    hash_stats(table, &stats);
+
+    for (unsigned long i = 0; i < count; i++) {
+        bench_key(&keys[i], bench_rand(&seed) % (entries * 2));
+        digests[i] = key_digest(&keys[i], sizeof *keys);
+    }
+
+    long llc = -1;
+#ifdef _SC_LEVEL3_CACHE_SIZE
+    llc = sysconf(_SC_LEVEL3_CACHE_SIZE);
+#endif
+
+    printf("%lu entries, %.0f MB table, %.0f MB last level cache\n",
+        entries, stats.memory / 1e6, llc > 0 ? llc / 1e6 : 0.0);
+
+    unsigned long single = 0;
+    double base = one_at_a_time(table, keys, count, &single);
+
+    printf("hash_get             %6.1f ns/key\n", base);
+
+    for (size_t i = 0; i < sizeof batches / sizeof *batches; i++) {
+        unsigned long found = 0, hashed = 0;
+        size_t batch = batches[i];
+
+        double ns = batched(table, keys, NULL, count, batch, &found);
+        double given = batched(table, keys, digests, count, batch, &hashed);
+
+        printf("hash_get_batch %3zu   %6.1f ns/key  %.2fx   "
+            "with digests %6.1f ns/key  %.2fx\n", batch, ns, base / ns,
+            given, base / given);
+
+        if (found != hashed || (count % batch == 0 && found != single)) {
+            fprintf(stderr, "batches found %lu and %lu keys, not %lu\n",
+                found, hashed, single);
+            return 1;
+        }
+    }
+
+    for (unsigned long i = 0; i < entries; i++) {
+        struct bench_key key;
+
+        bench_key(&key, i);
+        hash_remove(table, &key);
+    }
+
+    hash_destroy(table);
+    free(keys);
+    free(digests);
+
+    return 0;
+}
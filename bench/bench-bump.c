@@ -0,0 +1,192 @@
+/* Copyright (c) Victor Roemer, 2013. All rights reserved.
+ * See LICENSE in the root source directory for details. */
+
+/* bench-bump.c
+ *
+ * Cost of refreshing the timeout of the entry a packet hit, against how
+ * many entries are live. The trackers keep the queue element with their
+ * entry and tmq_bump() it. Before, they searched the queue for the
+ * element of the key the way tmq_find() did, then moved it to the head of
+ * the list; a copy of that queue is timed alongside, over fewer packets
+ * the more entries are live.
+ *
+ *      BENCH_LIVE=n BENCH_OPS=n bench-bump
+ *
+ * Populations of a thousand up to BENCH_LIVE entries are run.
+ */
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "timequeue.h"
+#include "bench.h"
+
+/* Entries the list queue walks per population, in all */
+#define LIST_WALK 20000000UL
+
+struct list_element
+{
+    struct list_element *prev;
+    struct list_element *next;
+    struct timeval time;
+    void *key;
+};
+
+/* The timeout queue as it was, a list in the order entries were used */
+struct list_queue
+{
+    struct list_element *head;
+    struct list_element *tail;
+    size_t keysize;
+};
+
+static void
+list_push(struct list_queue *queue, struct list_element *elem)
+{
+    elem->prev = NULL;
+    elem->next = queue->head;
+
+    if (queue->head)
+        queue->head->prev = elem;
+    else
+        queue->tail = elem;
+
+    queue->head = elem;
+    gettimeofday(&elem->time, NULL);
+}
+
+static struct list_element *
+list_find(struct list_queue *queue, const void *key)
+{
+    for (struct list_element *it = queue->head; it; it = it->next)
+        if (memcmp(key, it->key, queue->keysize) == 0)
+            return it;
+
+    return NULL;
+}
+
+static void
+list_bump(struct list_queue *queue, struct list_element *elem)
+{
+    if (elem->prev)
+        elem->prev->next = elem->next;
+    else
+        queue->head = elem->next;
+
+    if (elem->next)
+        elem->next->prev = elem->prev;
+    else
+        queue->tail = elem->prev;
+
+    list_push(queue, elem);
+}
+
+static double
+bump_wheel(unsigned long live, unsigned long ops)
+{
+    struct tmq_element **elems;
+    struct bench_key key;
+    uint64_t seed = 1;
+    struct tmq *tmq;
+
+    if ((tmq = tmq_create(60)) == NULL ||
+        (elems = malloc(live * sizeof *elems)) == NULL) {
+        fprintf(stderr, "bench-bump: out of memory\n");
+        exit(1);
+    }
+
+    for (unsigned long i = 0; i < live; i++) {
+        bench_key(&key, i);
+        if ((elems[i] = tmq_element_create(&key, sizeof key)) == NULL ||
+            tmq_insert(tmq, elems[i]) < 0) {
+            fprintf(stderr, "bench-bump: out of memory\n");
+            exit(1);
+        }
+    }
+
+    uint64_t start = bench_ns();
+
+    for (unsigned long i = 0; i < ops; i++)
+        tmq_bump(tmq, elems[bench_rand(&seed) % live]);
+
+    double ns = (double)(bench_ns() - start) / ops;
+
+    tmq_destroy(tmq);
+    free(elems);
+
+    return ns;
+}
+
+static double
+bump_list(unsigned long live, unsigned long ops)
+{
+    struct list_queue queue = { NULL, NULL, sizeof(struct bench_key) };
+    struct list_element *elems;
+    struct bench_key *keys;
+    uint64_t seed = 1;
+
+    if ((elems = calloc(live, sizeof *elems)) == NULL ||
+        (keys = malloc(live * sizeof *keys)) == NULL) {
+        fprintf(stderr, "bench-bump: out of memory\n");
+        exit(1);
+    }
+
+    for (unsigned long i = 0; i < live; i++) {
+        bench_key(&keys[i], i);
+        elems[i].key = &keys[i];
+        list_push(&queue, &elems[i]);
+    }
+
+    uint64_t start = bench_ns();
+
+    for (unsigned long i = 0; i < ops; i++) {
+        struct bench_key key;
+        struct list_element *elem;
+
+        bench_key(&key, bench_rand(&seed) % live);
+        if ((elem = list_find(&queue, &key)) == NULL) {
+            fprintf(stderr, "bench-bump: lost an element\n");
+            exit(1);
+        }
+        list_bump(&queue, elem);
+    }
+
+    double ns = (double)(bench_ns() - start) / ops;
+
+    free(elems);
+    free(keys);
+
+    return ns;
+}
+
+int
+main(void)
+{
+    unsigned long max = bench_param("BENCH_LIVE", 1000000);
+    unsigned long ops = bench_param("BENCH_OPS", 2000000);
+
+    if (ops == 0) {
+        fprintf(stderr, "bench-bump: no packets\n");
+        return 1;
+    }
+
+    for (unsigned long live = 1000; live <= max; live *= 10) {
+        unsigned long searches = LIST_WALK / live;
+
+        if (searches < 10)
+            searches = 10;
+
+        double wheel = bump_wheel(live, ops);
+        double list = bump_list(live, searches);
+
+        printf("%8lu live  tmq_bump %7.1f ns  find and bump %12.1f ns  "
+            "(%lu packets)\n", live, wheel, list, searches);
+        fflush(stdout);
+    }
+
+    return 0;
+}
@@ -0,0 +1,227 @@
+/* Copyright (c) Victor Roemer, 2013. All rights reserved.
+ * See LICENSE in the root source directory for details. */
+
+/* bench-churn.c
+ *
+ * Lookup cost under flow churn, the hash table against the bucket table it
+ * replaced. Both hold a fixed live population of flows. Every flow setup
+ * removes a live flow at random, inserts a new one and looks up LOOKUPS
+ * live flows. The bucket table leaves a tombstone behind each removal, the
+ * hash table shifts the entries after it back.
+ *
+ *      BENCH_LIVE=flows BENCH_RATE=setups BENCH_MINUTES=minutes bench-churn
+ *
+ * BENCH_RATE flows are set up per simulated minute, the cost per setup and
+ * how far the lookups had to probe are printed every ten minutes.
+ */
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "hashtable.h"
+#include "hashdigest.h"
+#include "hash-buckets.h"
+#include "bench.h"
+
+#define LOOKUPS 4
+
+#define REPORT_MINUTES 10
+
+struct churn
+{
+    unsigned long live;
+    unsigned long rate;
+    unsigned long minutes;
+    uint64_t *flows;            /* key index of every live flow */
+    uint64_t next;              /* key index of the next new flow */
+    uint64_t seed;
+};
+
+static void
+churn_reset(struct churn *churn)
+{
+    for (unsigned long i = 0; i < churn->live; i++)
+        churn->flows[i] = i;
+
+    churn->next = churn->live;
+    churn->seed = 1;
+}
+
+static void
+lost(const char *table, uint64_t flow)
+{
+    fprintf(stderr, "%s: lost flow %llu\n", table, (unsigned long long)flow);
+    exit(1);
+}
+
+static void
+churn_hash(struct churn *churn)
+{
+    struct hash_stats last = { 0 };
+    struct bench_key key;
+    Hash *table;
+
+    if ((table = hash_create(churn->live + churn->live / 3,
+        sizeof key)) == NULL) {
+        fprintf(stderr, "hash_create: out of memory\n");
+        exit(1);
+    }
+
+    churn_reset(churn);
+
+    for (unsigned long i = 0; i < churn->live; i++) {
+        bench_key(&key, i);
+        if (hash_insert(table, (void *)1, &key) < 0)
+            lost("hash", i);
+    }
+
+    hash_stats(table, &last);
+
+    for (unsigned long minute = 1; minute <= churn->minutes; minute++) {
+        uint64_t start = bench_ns();
+
+        for (unsigned long setup = 0; setup < churn->rate; setup++) {
+            uint64_t *flow = &churn->flows[bench_rand(&churn->seed) %
+                churn->live];
+
+            bench_key(&key, *flow);
+            if (hash_remove(table, &key) == NULL)
+                lost("hash", *flow);
+
+            *flow = churn->next++;
+            bench_key(&key, *flow);
+            if (hash_insert(table, (void *)1, &key) < 0)
+                lost("hash", *flow);
+
+            for (int i = 0; i < LOOKUPS; i++) {
+                flow = &churn->flows[bench_rand(&churn->seed) % churn->live];
+                bench_key(&key, *flow);
+                if (hash_get(table, &key) == NULL)
+                    lost("hash", *flow);
+            }
+        }
+
+        uint64_t ns = bench_ns() - start;
+
+        if (minute % REPORT_MINUTES && minute != churn->minutes)
+            continue;
+
+        struct hash_stats stats = { 0 };
+        hash_stats(table, &stats);
+
+        uint64_t lookups = stats.lookups - last.lookups;
+        uint64_t home = stats.probes[0] - last.probes[0];
+
+        printf("hash     minute %4lu  %7.1f ns/setup  %5.1f%% at home  "
+            "max probe %llu\n", minute, (double)ns / churn->rate,
+            100.0 * home / lookups, (unsigned long long)stats.max_probe);
+        fflush(stdout);
+
+        last = stats;
+    }
+
+    for (unsigned long i = 0; i < churn->live; i++) {
+        bench_key(&key, churn->flows[i]);
+        hash_remove(table, &key);
+    }
+
+    hash_destroy(table);
+}
+
+static void
+churn_buckets(struct churn *churn)
+{
+    unsigned long last_probes, lookups = 0;
+    struct bench_key key;
+    BucketHash *table;
+
+    if ((table = bucket_hash_create(churn->live + churn->live / 3)) ==
+        NULL) {
+        fprintf(stderr, "bucket_hash_create: out of memory\n");
+        exit(1);
+    }
+
+    churn_reset(churn);
+
+    for (unsigned long i = 0; i < churn->live; i++) {
+        bench_key(&key, i);
+        if (bucket_hash_insert(table, (void *)1, &key, sizeof key) < 0)
+            lost("buckets", i);
+    }
+
+    last_probes = bucket_hash_probes(table);
+
+    for (unsigned long minute = 1; minute <= churn->minutes; minute++) {
+        uint64_t start = bench_ns();
+
+        for (unsigned long setup = 0; setup < churn->rate; setup++) {
+            uint64_t *flow = &churn->flows[bench_rand(&churn->seed) %
+                churn->live];
+
+            bench_key(&key, *flow);
+            if (bucket_hash_remove(table, &key, sizeof key) == NULL)
+                lost("buckets", *flow);
+
+            *flow = churn->next++;
+            bench_key(&key, *flow);
+            if (bucket_hash_insert(table, (void *)1, &key, sizeof key) < 0)
+                lost("buckets", *flow);
+
+            for (int i = 0; i < LOOKUPS; i++) {
+                flow = &churn->flows[bench_rand(&churn->seed) % churn->live];
+                bench_key(&key, *flow);
+                if (bucket_hash_get(table, &key, sizeof key) == NULL)
+                    lost("buckets", *flow);
+            }
+        }
+
+        uint64_t ns = bench_ns() - start;
+
+        lookups += churn->rate * (LOOKUPS + 1);
+
+        if (minute % REPORT_MINUTES && minute != churn->minutes)
+            continue;
+
+        unsigned long probes = bucket_hash_probes(table);
+
+        printf("buckets  minute %4lu  %7.1f ns/setup  %5.2f buckets walked "
+            "per lookup\n", minute, (double)ns / churn->rate,
+            (double)(probes - last_probes) / lookups);
+        fflush(stdout);
+
+        last_probes = probes;
+        lookups = 0;
+    }
+
+    bucket_hash_destroy(table);
+}
+
+int
+main(void)
+{
+    struct churn churn;
+
+    churn.live = bench_param("BENCH_LIVE", 500000);
+    churn.rate = bench_param("BENCH_RATE", 1000000);
+    churn.minutes = bench_param("BENCH_MINUTES", 60);
+
+    if (churn.live == 0 || (churn.flows = calloc(churn.live,
+        sizeof *churn.flows)) == NULL) {
+        fprintf(stderr, "bench-churn: no flows\n");
+        return 1;
+    }
+
+    digest_init();
+
+    printf("%lu live flows, %lu setups a minute for %lu minutes\n",
+        churn.live, churn.rate, churn.minutes);
+
+    churn_hash(&churn);
+    churn_buckets(&churn);
+
+    free(churn.flows);
+
+    return 0;
+}
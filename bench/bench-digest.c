@@ -0,0 +1,138 @@
+/* Copyright (c) Victor Roemer, 2013. All rights reserved.
+ * See LICENSE in the root source directory for details. */
+
+/* bench-digest.c
+ *
+ * Cycles to digest a key, byte-wise FNV-1a against key_digest() in either
+ * mode, over the key sizes of the trackers. The best of PASSES passes over
+ * KEYS different keys is kept. The digest mode is picked once per process,
+ * so each mode runs in a process of its own.
+ *
+ * Cycles are read from the time stamp counter, where there is none they
+ * are nanoseconds.
+ */
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "hashdigest.h"
+#include "bench.h"
+
+#define KEYS 1024
+#define PASSES 200
+#define KEY_MAX 64
+
+static const size_t sizes[] = { 16, 24, 40, 48 };
+
+static uint8_t keys[KEYS][KEY_MAX];
+
+static volatile uint64_t sink;
+
+static inline uint64_t
+cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return bench_ns();
+#endif
+}
+
+static uint32_t
+fnv1a(const void *key, size_t size)
+{
+    return fnv1a_digest(key, size, 0x811c9dc5);
+}
+
+static double
+cycles_per_key(uint32_t (*digest)(const void *, size_t), size_t size)
+{
+    uint64_t best = UINT64_MAX;
+
+    for (int pass = 0; pass < PASSES; pass++) {
+        uint64_t sum = 0;
+        uint64_t start = cycles();
+
+        for (int i = 0; i < KEYS; i++)
+            sum += digest(keys[i], size);
+
+        uint64_t taken = cycles() - start;
+        if (taken < best)
+            best = taken;
+        sink += sum;
+    }
+
+    return (double)best / KEYS;
+}
+
+static void
+report(const char *name, uint32_t (*digest)(const void *, size_t))
+{
+    printf("%-8s", name);
+    for (size_t i = 0; i < sizeof sizes / sizeof *sizes; i++)
+        printf("  %6.1f", cycles_per_key(digest, sizes[i]));
+    printf("\n");
+    fflush(stdout);
+}
+
+/* Report key_digest() in mode, from a process of its own */
+static int
+report_mode(const char *name, DigestMode mode)
+{
+    int status;
+    pid_t pid;
+
+    if ((pid = fork()) < 0)
+        return -1;
+
+    if (pid == 0) {
+        digest_init();
+        if (digest_set_mode(mode) < 0)
+            _exit(1);
+        report(name, key_digest);
+        _exit(0);
+    }
+
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0)
+        return -1;
+
+    return 0;
+}
+
+int
+main(void)
+{
+    uint64_t seed = 1;
+
+    for (int i = 0; i < KEYS; i++)
+        for (int j = 0; j < KEY_MAX; j++)
+            keys[i][j] = (uint8_t)bench_rand(&seed);
+
+    const char *fast = "mix";
+#if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        fast = "crc32c";
+#endif
+
+    printf("cycles per key, fast mode is %s\n", fast);
+    printf("%-8s", "bytes");
+    for (size_t i = 0; i < sizeof sizes / sizeof *sizes; i++)
+        printf("  %6zu", sizes[i]);
+    printf("\n");
+
+    report("fnv1a", fnv1a);
+
+    if (report_mode(fast, DIGEST_FAST) < 0 ||
+        report_mode("siphash", DIGEST_KEYED) < 0) {
+        fprintf(stderr, "bench-digest: a digest mode did not run\n");
+        return 1;
+    }
+
+    return 0;
+}
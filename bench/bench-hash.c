@@ -0,0 +1,159 @@
+/* Copyright (c) Victor Roemer, 2013. All rights reserved.
+ * See LICENSE in the root source directory for details. */
+
+/* bench-hash.c
+ *
+ * Lookup cost of the hash table against the bucket table it replaced. Each
+ * table is filled with n flow keys, then looked up n times at random for
+ * keys it holds and n times for keys it does not. The bucket table is made
+ * n * 4 / 3 buckets up front, the hash table grows up to as many.
+ *
+ *      BENCH_ENTRIES=n bench-hash
+ *
+ * Without BENCH_ENTRIES one and ten million entries are run.
+ */
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "hashtable.h"
+#include "hashdigest.h"
+#include "hash-buckets.h"
+#include "bench.h"
+
+struct timing
+{
+    double insert;
+    double hit;
+    double miss;
+    unsigned long found;
+};
+
+static void
+run_hash(unsigned long n, struct timing *timing)
+{
+    struct bench_key key;
+    uint64_t seed = 1;
+    Hash *table;
+
+    if ((table = hash_create(n + n / 3, sizeof key)) == NULL) {
+        fprintf(stderr, "hash_create: out of memory\n");
+        exit(1);
+    }
+
+    uint64_t start = bench_ns();
+    for (unsigned long i = 0; i < n; i++) {
+        bench_key(&key, i);
+        if (hash_insert(table, (void *)(uintptr_t)(i + 1), &key) < 0) {
+            fprintf(stderr, "hash_insert: table full at %lu\n", i);
+            exit(1);
+        }
+    }
+    uint64_t filled = bench_ns();
+    for (unsigned long i = 0; i < n; i++) {
+        bench_key(&key, bench_rand(&seed) % n);
+        timing->found += hash_get(table, &key) != NULL;
+    }
+    uint64_t hit = bench_ns();
+    for (unsigned long i = 0; i < n; i++) {
+        bench_key(&key, n + i);
+        timing->found += hash_get(table, &key) != NULL;
+    }
+    uint64_t miss = bench_ns();
+
+    timing->insert = (double)(filled - start) / n;
+    timing->hit = (double)(hit - filled) / n;
+    timing->miss = (double)(miss - hit) / n;
+
+    for (unsigned long i = 0; i < n; i++) {
+        bench_key(&key, i);
+        hash_remove(table, &key);
+    }
+
+    hash_destroy(table);
+}
+
+static void
+run_buckets(unsigned long n, struct timing *timing)
+{
+    struct bench_key key;
+    uint64_t seed = 1;
+    BucketHash *table;
+
+    if ((table = bucket_hash_create(n + n / 3)) == NULL) {
+        fprintf(stderr, "bucket_hash_create: out of memory\n");
+        exit(1);
+    }
+
+    uint64_t start = bench_ns();
+    for (unsigned long i = 0; i < n; i++) {
+        bench_key(&key, i);
+        if (bucket_hash_insert(table, (void *)(uintptr_t)(i + 1), &key,
+            sizeof key) < 0) {
+            fprintf(stderr, "bucket_hash_insert: table full at %lu\n", i);
+            exit(1);
+        }
+    }
+    uint64_t filled = bench_ns();
+    for (unsigned long i = 0; i < n; i++) {
+        bench_key(&key, bench_rand(&seed) % n);
+        timing->found += bucket_hash_get(table, &key, sizeof key) != NULL;
+    }
+    uint64_t hit = bench_ns();
+    for (unsigned long i = 0; i < n; i++) {
+        bench_key(&key, n + i);
+        timing->found += bucket_hash_get(table, &key, sizeof key) != NULL;
+    }
+    uint64_t miss = bench_ns();
+
+    timing->insert = (double)(filled - start) / n;
+    timing->hit = (double)(hit - filled) / n;
+    timing->miss = (double)(miss - hit) / n;
+
+    bucket_hash_destroy(table);
+}
+
+static void
+report(const char *name, unsigned long n, const struct timing *timing)
+{
+    printf("%-8s %9lu entries  insert %6.1f ns  hit %6.1f ns  "
+        "miss %6.1f ns\n", name, n, timing->insert, timing->hit,
+        timing->miss);
+}
+
+static int
+bench(unsigned long n)
+{
+    struct timing hash = { 0 }, buckets = { 0 };
+
+    run_hash(n, &hash);
+    run_buckets(n, &buckets);
+
+    if (hash.found != n || buckets.found != n) {
+        fprintf(stderr, "tables disagree: %lu and %lu of %lu found\n",
+            hash.found, buckets.found, n);
+        return 1;
+    }
+
+    report("hash", n, &hash);
+    report("buckets", n, &buckets);
+    printf("hits take %.2fx, misses %.2fx the time of the bucket table\n",
+        hash.hit / buckets.hit, hash.miss / buckets.miss);
+
+    return 0;
+}
+
+int
+main(void)
+{
+    unsigned long entries = bench_param("BENCH_ENTRIES", 0);
+
+    digest_init();
+
+    if (entries)
+        return bench(entries);
+
+    return bench(1000000) || bench(10000000);
+}
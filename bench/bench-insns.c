@@ -0,0 +1,63 @@
+/* Copyright (c) Victor Roemer, 2013. All rights reserved.
+ * See LICENSE in the root source directory for details. */
+
+/* bench-insns.c
+ *
+ * Instructions a command retires in user space, counted by single-stepping
+ * it where there are no performance counters to ask.
+ *
+ *      bench-insns command [argument ...]
+ *
+ * Only the thread the command starts with is stepped, run pcapstats
+ * without --threads. Start up and shut down are counted too: the cost of a
+ * packet is the difference to a run over a savefile with no packets,
+ * divided by the packets, e.g.
+ *
+ *      bench-insns ../src/pcapstats -q -c pcapstats.conf -r trace.pcap
+ */
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+int
+main(int argc, char *argv[])
+{
+    long insns;
+    pid_t pid;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: bench-insns command [argument ...]\n");
+        return 1;
+    }
+
+    fflush(NULL);
+
+    if ((pid = fork()) < 0) {
+        perror("fork");
+        return 1;
+    }
+
+    if (pid == 0) {
+#ifdef __linux__
+        /* Stops with SIGTRAP once the command is loaded */
+        if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) == 0)
+            execvp(argv[1], &argv[1]);
+#endif
+        perror(argv[1]);
+        _exit(127);
+    }
+
+    if ((insns = bench_steps(pid)) < 0) {
+        fprintf(stderr, "bench-insns: %s could not be traced or failed\n",
+            argv[1]);
+        return 1;
+    }
+
+    fprintf(stderr, "%ld instructions\n", insns);
+
+    return 0;
+}
@@ -0,0 +1,185 @@
+/* Copyright (c) Victor Roemer, 2013. All rights reserved.
+ * See LICENSE in the root source directory for details. */
+
+/* bench-read.c
+ *
+ * Savefile read throughput of the mmap reader against libpcap. Both hand
+ * every record to a callback that touches its first and last byte, the
+ * best of a few passes over a file already in the page cache is kept.
+ *
+ *      bench-read [savefile]
+ *
+ * Without a savefile one of BENCH_RECORDS Ethernet frames, sized like a
+ * mix of ACKs, DNS and full frames, is written to a temporary file.
+ */
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <pcap.h>
+
+#include "capture-mmap.h"
+#include "bench.h"
+
+#define PASSES 5
+
+const char *progname = "bench-read";
+
+struct tally
+{
+    uint64_t records;
+    uint64_t bytes;
+    uint64_t sum;
+};
+
+static void
+count_record(uint8_t *user, const struct pcap_pkthdr *pkthdr,
+    const uint8_t *pkt)
+{
+    struct tally *tally = (struct tally *)user;
+
+    tally->records++;
+    tally->bytes += pkthdr->caplen;
+    if (pkthdr->caplen)
+        tally->sum += pkt[0] + pkt[pkthdr->caplen - 1];
+}
+
+static char *
+write_savefile(unsigned long records)
+{
+    static const uint32_t sizes[] = { 60, 60, 60, 90, 576, 1514, 1514 };
+    static char path[] = "/tmp/bench-read.XXXXXX";
+    uint8_t frame[1514];
+    uint64_t seed = 1;
+    FILE *fp;
+    int fd;
+
+    if ((fd = mkstemp(path)) < 0 || (fp = fdopen(fd, "wb")) == NULL) {
+        perror(path);
+        exit(1);
+    }
+
+    uint32_t fh[6] = { 0xa1b2c3d4, 2 | 4 << 16, 0, 0, 65535, 1 };
+    fwrite(fh, sizeof fh, 1, fp);
+
+    memset(frame, 0xab, sizeof frame);
+
+    for (unsigned long i = 0; i < records; i++) {
+        uint32_t size = sizes[bench_rand(&seed) % 7];
+        uint32_t rh[4] = { 1000000 + i / 1000, i % 1000 * 1000, size, size };
+
+        fwrite(rh, sizeof rh, 1, fp);
+        fwrite(frame, size, 1, fp);
+    }
+
+    if (fclose(fp) != 0) {
+        perror(path);
+        exit(1);
+    }
+
+    return path;
+}
+
+static double
+read_mmap(const char *file, struct tally *tally)
+{
+    char errbuf[PCAP_ERRBUF_SIZE];
+    Pcapmap *pm;
+
+    if ((pm = pcapmap_open(file, errbuf)) == NULL) {
+        fprintf(stderr, "%s: %s\n", file, errbuf);
+        exit(1);
+    }
+
+    uint64_t start = bench_ns();
+    pcapmap_loop(pm, count_record, (uint8_t *)tally);
+    uint64_t ns = bench_ns() - start;
+
+    pcapmap_close(pm);
+
+    return ns / 1e9;
+}
+
+static double
+read_pcap(const char *file, struct tally *tally)
+{
+    char errbuf[PCAP_ERRBUF_SIZE];
+    pcap_t *pcap;
+
+    if ((pcap = pcap_open_offline(file, errbuf)) == NULL) {
+        fprintf(stderr, "%s: %s\n", file, errbuf);
+        exit(1);
+    }
+
+    uint64_t start = bench_ns();
+    pcap_loop(pcap, -1, count_record, (uint8_t *)tally);
+    uint64_t ns = bench_ns() - start;
+
+    pcap_close(pcap);
+
+    return ns / 1e9;
+}
+
+static double
+best_of(double (*reader)(const char *, struct tally *), const char *file,
+    struct tally *tally)
+{
+    double best = 0;
+
+    for (int pass = 0; pass < PASSES; pass++) {
+        memset(tally, 0, sizeof *tally);
+
+        double secs = reader(file, tally);
+        if (pass == 0 || secs < best)
+            best = secs;
+    }
+
+    return best;
+}
+
+static void
+report(const char *name, double secs, const struct tally *tally)
+{
+    printf("%-6s %10llu records %8.1f MB  %8.3f s  %7.2f Mpps  %8.1f MB/s\n",
+        name, (unsigned long long)tally->records, tally->bytes / 1e6, secs,
+        tally->records / secs / 1e6, tally->bytes / secs / 1e6);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct tally mapped, buffered;
+    const char *file;
+    char *tmp = NULL;
+
+    if (argc > 1)
+        file = argv[1];
+    else
+        file = tmp = write_savefile(bench_param("BENCH_RECORDS", 1000000));
+
+    /* Warm the page cache */
+    read_mmap(file, &mapped);
+
+    double mmap_secs = best_of(read_mmap, file, &mapped);
+    double pcap_secs = best_of(read_pcap, file, &buffered);
+
+    if (mapped.records != buffered.records || mapped.sum != buffered.sum) {
+        fprintf(stderr, "readers disagree: %llu and %llu records\n",
+            (unsigned long long)mapped.records,
+            (unsigned long long)buffered.records);
+        return 1;
+    }
+
+    report("mmap", mmap_secs, &mapped);
+    report("pcap", pcap_secs, &buffered);
+    printf("mmap is %.2fx the throughput of %s\n", pcap_secs / mmap_secs,
+        pcap_lib_version());
+
+    if (tmp)
+        unlink(tmp);
+
+    return 0;
+}
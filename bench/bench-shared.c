@@ -0,0 +1,207 @@
+/* Copyright (c) Victor Roemer, 2013. All rights reserved.
+ * See LICENSE in the root source directory for details. */
+
+/* bench-shared.c
+ *
+ * Throughput of the shared hash table from one to MAX_THREADS threads.
+ * Keys are drawn from a Zipf distribution over BENCH_KEYS keys, like hosts
+ * of real traffic where a few talk the most. Every tenth operation counts
+ * into a key, the others read one.
+ *
+ *      BENCH_KEYS=n BENCH_OPS=n bench-shared
+ *
+ * BENCH_OPS is the operations of each thread. Threads beyond the CPUs
+ * online only take turns, the scaling past those says nothing.
+ */
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "hashdigest.h"
+#include "shared-hash.h"
+#include "bench.h"
+
+#define MAX_THREADS 32
+
+/* One operation in UPSERT_EVERY counts into its key */
+#define UPSERT_EVERY 10
+
+static SharedHash *table;
+static struct bench_key *keys;
+static uint32_t *digests;
+static uint32_t *draws;         /* key of every operation */
+static unsigned long ops;
+
+static int
+count(void **value, bool inserted, void *arg)
+{
+    (void)arg;
+
+    if (inserted && (*value = calloc(1, sizeof(uint64_t))) == NULL)
+        return -1;
+
+    ++*(uint64_t *)*value;
+
+    return 0;
+}
+
+static void *
+run(void *arg)
+{
+    unsigned long start = (uintptr_t)arg * 7919;
+    uint64_t copy;
+
+    for (unsigned long i = 0; i < ops; i++) {
+        uint32_t k = draws[(start + i) % ops];
+
+        if (i % UPSERT_EVERY == 0)
+            shared_hash_upsert(table, &keys[k], digests[k], count, NULL);
+        else
+            shared_hash_get(table, &keys[k], digests[k], &copy,
+                sizeof copy);
+    }
+
+    return NULL;
+}
+
+static void
+sum(const void *key, void *value, void *arg)
+{
+    (void)key;
+    *(uint64_t *)arg += *(uint64_t *)value;
+}
+
+/* Zipf draws with exponent 1 over n keys, by inverting its distribution */
+static void
+draw_zipf(uint32_t *draws, unsigned long count, unsigned long n)
+{
+    double *cdf, total = 0;
+    uint64_t seed = 1;
+
+    if ((cdf = malloc(n * sizeof *cdf)) == NULL) {
+        fprintf(stderr, "bench-shared: out of memory\n");
+        exit(1);
+    }
+
+    for (unsigned long i = 0; i < n; i++)
+        cdf[i] = total += 1.0 / (i + 1);
+
+    for (unsigned long i = 0; i < count; i++) {
+        double u = (double)(bench_rand(&seed) >> 11) / (1ULL << 53) * total;
+        unsigned long lo = 0, hi = n - 1;
+
+        while (lo < hi) {
+            unsigned long mid = (lo + hi) / 2;
+
+            if (cdf[mid] < u)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        draws[i] = lo;
+    }
+
+    free(cdf);
+}
+
+static void
+collect(const void *key, void *value, void *arg)
+{
+    struct bench_key **next = arg;
+
+    (void)value;
+    memcpy((*next)++, key, sizeof **next);
+}
+
+int
+main(void)
+{
+    unsigned long nkeys = bench_param("BENCH_KEYS", 1000000);
+    uint64_t upserts = 0, counted = 0;
+    pthread_t threads[MAX_THREADS];
+    double single = 0;
+
+    ops = bench_param("BENCH_OPS", 2000000);
+
+    digest_init();
+
+    if (nkeys == 0 || ops == 0 ||
+        (keys = malloc(nkeys * sizeof *keys)) == NULL ||
+        (digests = malloc(nkeys * sizeof *digests)) == NULL ||
+        (draws = malloc(ops * sizeof *draws)) == NULL ||
+        (table = shared_hash_create(nkeys * 2, sizeof *keys)) == NULL) {
+        fprintf(stderr, "bench-shared: out of memory\n");
+        return 1;
+    }
+
+    for (unsigned long i = 0; i < nkeys; i++) {
+        bench_key(&keys[i], i);
+        digests[i] = key_digest(&keys[i], sizeof *keys);
+    }
+
+    draw_zipf(draws, ops, nkeys);
+
+    printf("%lu keys, %lu operations a thread, %ld CPUs online\n", nkeys,
+        ops, sysconf(_SC_NPROCESSORS_ONLN));
+
+    for (int n = 1; n <= MAX_THREADS; n *= 2) {
+        uint64_t start = bench_ns();
+
+        for (int i = 0; i < n; i++)
+            if (pthread_create(&threads[i], NULL, run,
+                (void *)(uintptr_t)i)) {
+                fprintf(stderr, "bench-shared: no thread %d\n", i);
+                return 1;
+            }
+
+        for (int i = 0; i < n; i++)
+            pthread_join(threads[i], NULL);
+
+        double secs = (bench_ns() - start) / 1e9;
+        double mops = n * ops / secs / 1e6;
+
+        if (n == 1)
+            single = mops;
+
+        upserts += n * ((ops + UPSERT_EVERY - 1) / UPSERT_EVERY);
+
+        printf("threads %2d  %7.2f Mops/s  %.2fx one thread\n", n, mops,
+            mops / single);
+        fflush(stdout);
+    }
+
+    size_t left = shared_hash_snapshot(table, sum, &counted);
+
+    if (counted != upserts) {
+        fprintf(stderr, "bench-shared: counted %llu of %llu upserts\n",
+            (unsigned long long)counted, (unsigned long long)upserts);
+        return 1;
+    }
+
+    struct bench_key *all, *next;
+
+    if ((all = next = malloc(left * sizeof *all)) == NULL) {
+        fprintf(stderr, "bench-shared: out of memory\n");
+        return 1;
+    }
+
+    shared_hash_snapshot(table, collect, &next);
+
+    while (next-- > all)
+        free(shared_hash_remove(table, next,
+            key_digest(next, sizeof *next)));
+
+    shared_hash_destroy(table);
+    free(all);
+    free(keys);
+    free(digests);
+    free(draws);
+
+    return 0;
+}
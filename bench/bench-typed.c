@@ -0,0 +1,180 @@
+/* Copyright (c) Victor Roemer, 2013. All rights reserved.
+ * See LICENSE in the root source directory for details. */
+
+/* bench-typed.c
+ *
+ * Generic hash table calls against those of a table declared with
+ * HASH_TABLE_DECLARE() for the same key, both given the digest of the key.
+ * Each is timed over random hits in a table small enough to stay in cache,
+ * where the cost is in the instructions rather than the misses, and the
+ * instructions of a lookup are counted by single-stepping COUNTED of them.
+ *
+ *      BENCH_ENTRIES=n BENCH_LOOKUPS=n bench-typed
+ */
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "hashtable.h"
+#include "hashtable-typed.h"
+#include "hashdigest.h"
+#include "bench.h"
+
+#define COUNTED 1000
+
+struct bench_value
+{
+    uint64_t packets;
+};
+
+HASH_TABLE_DECLARE(bench_table, struct bench_key, struct bench_value);
+
+struct lookups
+{
+    Hash *generic;
+    bench_table *typed;
+    const struct bench_key *keys;
+    const uint32_t *digests;
+    unsigned long count;
+    unsigned long found;
+};
+
+static void
+get_generic(void *arg)
+{
+    struct lookups *l = arg;
+
+    for (unsigned long i = 0; i < l->count; i++)
+        l->found += hash_get_hashed(l->generic, &l->keys[i],
+            l->digests[i]) != NULL;
+}
+
+static void
+get_typed(void *arg)
+{
+    struct lookups *l = arg;
+
+    for (unsigned long i = 0; i < l->count; i++)
+        l->found += bench_table_get(l->typed, &l->keys[i],
+            l->digests[i]) != NULL;
+}
+
+static void
+upsert_generic(void *arg)
+{
+    struct lookups *l = arg;
+    bool inserted;
+
+    for (unsigned long i = 0; i < l->count; i++)
+        l->found += hash_find_or_insert_hashed(l->generic, &l->keys[i],
+            l->digests[i], &inserted) != NULL;
+}
+
+static void
+upsert_typed(void *arg)
+{
+    struct lookups *l = arg;
+    bool inserted;
+
+    for (unsigned long i = 0; i < l->count; i++)
+        l->found += bench_table_find_or_insert(l->typed, &l->keys[i],
+            l->digests[i], &inserted) != NULL;
+}
+
+static void
+report(const char *name, void (*fn)(void *), struct lookups *l,
+    unsigned long count)
+{
+    l->count = count;
+    l->found = 0;
+
+    uint64_t start = bench_ns();
+    fn(l);
+    double ns = (double)(bench_ns() - start) / count;
+
+    if (l->found != count) {
+        fprintf(stderr, "%s: found %lu of %lu keys\n", name, l->found,
+            count);
+        exit(1);
+    }
+
+    l->count = COUNTED;
+    long insns = bench_insns(fn, l);
+
+    if (insns < 0)
+        printf("%-28s %6.1f ns\n", name, ns);
+    else
+        printf("%-28s %6.1f ns  %6.1f instructions\n", name, ns,
+            (double)insns / COUNTED);
+}
+
+int
+main(void)
+{
+    unsigned long entries = bench_param("BENCH_ENTRIES", 100000);
+    unsigned long count = bench_param("BENCH_LOOKUPS", 10000000);
+    struct bench_value value = { 0 };
+    struct bench_key key, *keys;
+    struct lookups l;
+    uint32_t *digests;
+    uint64_t seed = 1;
+
+    digest_init();
+
+    if (count < COUNTED)
+        count = COUNTED;
+
+    if ((l.generic = hash_create(entries * 2, sizeof key)) == NULL ||
+        (l.typed = bench_table_create(entries * 2)) == NULL ||
+        (keys = malloc(count * sizeof *keys)) == NULL ||
+        (digests = malloc(count * sizeof *digests)) == NULL) {
+        fprintf(stderr, "bench-typed: out of memory\n");
+        return 1;
+    }
+
+    for (unsigned long i = 0; i < entries; i++) {
+        bench_key(&key, i);
+        uint32_t digest = bench_table_digest(&key);
+
+        if (hash_insert_hashed(l.generic, &value, &key, digest) < 0 ||
+            bench_table_insert(l.typed, &value, &key, digest) < 0) {
+            fprintf(stderr, "bench-typed: table full at %lu\n", i);
+            return 1;
+        }
+    }
+
+    for (unsigned long i = 0; i < count; i++) {
+        bench_key(&keys[i], bench_rand(&seed) % entries);
+        digests[i] = bench_table_digest(&keys[i]);
+    }
+
+    l.keys = keys;
+    l.digests = digests;
+
+    /* Settle any resize left by the inserts */
+    l.count = count;
+    get_generic(&l);
+    get_typed(&l);
+
+    printf("%lu entries, %zu byte keys\n", entries, sizeof key);
+    report("hash_get_hashed", get_generic, &l, count);
+    report("typed get", get_typed, &l, count);
+    report("hash_find_or_insert_hashed", upsert_generic, &l, count);
+    report("typed find_or_insert", upsert_typed, &l, count);
+
+    for (unsigned long i = 0; i < entries; i++) {
+        bench_key(&key, i);
+        hash_remove(l.generic, &key);
+        bench_table_remove(l.typed, &key, bench_table_digest(&key));
+    }
+
+    hash_destroy(l.generic);
+    bench_table_destroy(l.typed);
+    free(keys);
+    free(digests);
+
+    return 0;
+}
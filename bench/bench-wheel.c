@@ -0,0 +1,125 @@
+/* Copyright (c) Victor Roemer, 2013. All rights reserved.
+ * See LICENSE in the root source directory for details. */
+
+/* bench-wheel.c
+ *
+ * The timing wheel under BENCH_TIMERS timers, each due a random one to
+ * 3600 seconds out. For SECONDS simulated seconds random timers are
+ * rescheduled the same way and whatever comes due is expired. Then every
+ * other timer is cancelled, and the rest expired at once.
+ *
+ *      BENCH_TIMERS=n BENCH_RESCHEDULES=n bench-wheel
+ *
+ * BENCH_RESCHEDULES is spread evenly over the seconds.
+ */
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#include "timequeue.h"
+#include "bench.h"
+
+#define SECONDS 100
+#define MAX_TIMEOUT 3600
+
+static struct tmq_element **timers;
+static unsigned long expired;
+
+/* Forget the timer, the wheel frees it */
+static int
+expire(const struct tmq_element *elem)
+{
+    timers[*(uint64_t *)elem->key] = NULL;
+    expired++;
+
+    return 0;
+}
+
+int
+main(void)
+{
+    unsigned long count = bench_param("BENCH_TIMERS", 10000000);
+    unsigned long reschedules = bench_param("BENCH_RESCHEDULES", 10000000);
+    struct timeval now = { 1000000000, 0 };
+    unsigned long done = 0, cancelled = 0;
+    uint64_t seed = 1;
+    struct tmq *tmq;
+
+    if (count == 0 || (tmq = tmq_create(MAX_TIMEOUT)) == NULL ||
+        (timers = malloc(count * sizeof *timers)) == NULL) {
+        fprintf(stderr, "bench-wheel: out of memory\n");
+        return 1;
+    }
+
+    tmq->task = expire;
+
+    for (uint64_t i = 0; i < count; i++)
+        if ((timers[i] = tmq_element_create(&i, sizeof i)) == NULL) {
+            fprintf(stderr, "bench-wheel: out of memory\n");
+            return 1;
+        }
+
+    uint64_t start = bench_ns();
+
+    for (unsigned long i = 0; i < count; i++)
+        tmq_schedule(tmq, timers[i], &now,
+            1 + bench_rand(&seed) % MAX_TIMEOUT);
+
+    printf("schedule           %6.1f ns/timer, %lu timers\n",
+        (double)(bench_ns() - start) / count, count);
+
+    start = bench_ns();
+
+    for (int second = 0; second < SECONDS; second++) {
+        for (unsigned long i = 0; i < reschedules / SECONDS; i++) {
+            struct tmq_element *timer = timers[bench_rand(&seed) % count];
+
+            if (timer == NULL)
+                continue;
+
+            tmq_schedule(tmq, timer, &now,
+                1 + bench_rand(&seed) % MAX_TIMEOUT);
+            done++;
+        }
+
+        now.tv_sec++;
+        tmq_expire(tmq, &now);
+    }
+
+    printf("reschedule, expire %6.1f ns/op, %lu rescheduled and %lu "
+        "expired over %d s\n", (double)(bench_ns() - start) /
+        (done + expired), done, expired, SECONDS);
+
+    start = bench_ns();
+
+    for (unsigned long i = 0; i < count; i += 2)
+        if (timers[i] && tmq_delete(tmq, timers[i]) == 0) {
+            timers[i] = NULL;
+            cancelled++;
+        }
+
+    printf("cancel             %6.1f ns/timer, %lu timers\n",
+        (double)(bench_ns() - start) / cancelled, cancelled);
+
+    unsigned long before = expired;
+    now.tv_sec += MAX_TIMEOUT + 1;
+    start = bench_ns();
+
+    tmq_expire(tmq, &now);
+
+    printf("expire all         %6.1f ns/timer, %lu timers\n",
+        (double)(bench_ns() - start) / (expired - before), expired - before);
+
+    if (tmq->size != 0) {
+        fprintf(stderr, "bench-wheel: %d timers never expired\n", tmq->size);
+        return 1;
+    }
+
+    tmq_destroy(tmq);
+    free(timers);
+
+    return 0;
+}
@@ -0,0 +1,152 @@
+/* Copyright (c) Victor Roemer, 2013. All rights reserved.
+ * See LICENSE in the root source directory for details. */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/ptrace.h>
+#endif
+
+/* Monotonic time in nanoseconds */
+static inline uint64_t
+bench_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* Uniform 64 bit numbers from a fixed seed, so every run sees the same
+ * keys */
+static inline uint64_t
+bench_rand(uint64_t *state)
+{
+    uint64_t x = *state += 0x9e3779b97f4a7c15ULL;
+
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+
+    return x ^ (x >> 31);
+}
+
+/* Count taken from the environment, or dflt */
+static inline unsigned long
+bench_param(const char *name, unsigned long dflt)
+{
+    const char *value = getenv(name);
+
+    return value ? strtoul(value, NULL, 0) : dflt;
+}
+
+/* Key shaped like those of the flow and TCP tables: two addresses, two
+ * ports and a protocol */
+struct bench_key
+{
+    uint32_t addr_a[4];
+    uint32_t addr_b[4];
+    uint16_t port_a;
+    uint16_t port_b;
+    uint8_t protocol;
+    uint8_t pad[3];
+};
+
+/* The i-th key of a benchmark, every i gives a different key */
+static inline void
+bench_key(struct bench_key *key, uint64_t i)
+{
+    memset(key, 0, sizeof *key);
+    key->addr_a[0] = 0x0a000000 | (uint32_t)(i & 0xffffff);
+    key->addr_b[0] = 0xc0a80001;
+    key->port_a = (uint16_t)(i >> 24) | 1024;
+    key->port_b = 80;
+    key->protocol = 6;
+}
+
+/* Instructions a traced child retires from where it stopped until it
+ * exits, counted by single-stepping it. Slow, a few microseconds an
+ * instruction, but it needs no performance counters. -1 if the child could
+ * not be traced. */
+static inline long
+bench_steps(pid_t pid)
+{
+    long steps = 0;
+    int status;
+
+    if (waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status))
+        return -1;
+
+#ifdef __linux__
+    for (;;) {
+        if (ptrace(PTRACE_SINGLESTEP, pid, NULL, NULL) < 0 ||
+            waitpid(pid, &status, 0) < 0)
+            break;
+        if (WIFEXITED(status))
+            return WEXITSTATUS(status) == 0 ? steps : -1;
+        if (WIFSIGNALED(status))
+            return -1;
+        steps++;
+    }
+#endif
+
+    kill(pid, SIGKILL);
+    waitpid(pid, &status, 0);
+
+    return -1;
+}
+
+static inline void
+bench_nothing(void *arg)
+{
+    (void)arg;
+}
+
+/* Instructions fn(arg) retires, run in a child process. The steps of
+ * stopping and exiting the child are taken off. -1 where processes can
+ * not be traced. */
+static inline long
+bench_insns(void (*fn)(void *), void *arg)
+{
+    long steps, empty;
+    pid_t pid;
+
+    fflush(NULL);
+
+    if ((pid = fork()) < 0)
+        return -1;
+
+    if (pid == 0) {
+#ifdef __linux__
+        if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) == 0) {
+            raise(SIGSTOP);
+            fn(arg);
+            _exit(0);
+        }
+#endif
+        _exit(1);
+    }
+
+    if ((steps = bench_steps(pid)) < 0)
+        return -1;
+
+    if (fn == bench_nothing)
+        return steps;
+
+    if ((empty = bench_insns(bench_nothing, NULL)) < 0)
+        return -1;
+
+    return steps - empty;
+}
+
+#endif /* BENCH_H */
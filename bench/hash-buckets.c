@@ -0,0 +1,158 @@
+/* Copyright (c) Victor Roemer, 2013. All rights reserved.
+ * See LICENSE in the root source directory for details. */
+
+/* hash-buckets.c
+ *
+ * The hash table of pcapstats 1.33, as it was but for hash_get: it did not
+ * step past a tombstone and spun on it, here it probes on like
+ * hash_remove does.
+ */
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashdigest.h"
+#include "hash-buckets.h"
+
+typedef struct
+{
+    bool filled;
+    void *value;
+    size_t keysize;
+    char key[];
+} Bucket;
+
+struct bucket_hash
+{
+    size_t buckets;
+    size_t size;
+    Bucket **table;
+    unsigned long probes;
+};
+
+BucketHash *
+bucket_hash_create(size_t buckets)
+{
+    BucketHash *this = calloc(1, sizeof(*this));
+    if (this == NULL)
+        return NULL;
+
+    this->table = calloc(buckets, sizeof(*(this->table)));
+    if (this->table == NULL) {
+        free(this);
+        return NULL;
+    }
+
+    this->buckets = buckets;
+
+    return this;
+}
+
+void
+bucket_hash_destroy(BucketHash *this)
+{
+    for (size_t i = 0; i < this->buckets; ++i)
+        free(this->table[i]);
+
+    free(this->table);
+    free(this);
+}
+
+static Bucket *
+bucket_create(void *value, const void *key, size_t keysize)
+{
+    Bucket *bucket;
+
+    if ((bucket = malloc(keysize + sizeof(*bucket))) == NULL)
+        return NULL;
+
+    bucket->keysize = keysize;
+    bucket->value = value;
+    bucket->filled = true;
+    memcpy(bucket->key, key, keysize);
+
+    return bucket;
+}
+
+int
+bucket_hash_insert(BucketHash *this, void *value, const void *key,
+    size_t keysize)
+{
+    unsigned long idx = fnv1a_digest(key, keysize, 0x811c9dc5) % this->buckets;
+
+    for (size_t i = 1; i < this->buckets; ++i) {
+        if (this->table[idx] == NULL) {
+            if ((this->table[idx] = bucket_create(value, key, keysize)) ==
+                NULL)
+                return -1;
+            this->size++;
+            return 0;
+        }
+        else if (this->table[idx]->filled == false) {
+            this->table[idx]->filled = true;
+            memcpy(this->table[idx]->key, key, keysize);
+            this->table[idx]->keysize = keysize;
+            this->table[idx]->value = value;
+            this->size++;
+            return 0;
+        }
+
+        idx = (idx + i*i) % this->buckets;
+    }
+
+    return -1;
+}
+
+void *
+bucket_hash_remove(BucketHash *this, const void *key, size_t keysize)
+{
+    unsigned long idx = fnv1a_digest(key, keysize, 0x811c9dc5) % this->buckets;
+
+    for (size_t i = 0; i < this->buckets; i++) {
+        this->probes++;
+
+        if (this->table[idx] == NULL)
+            return NULL;
+
+        if (this->table[idx]->filled &&
+            memcmp(key, this->table[idx]->key,
+            this->table[idx]->keysize) == 0) {
+            this->table[idx]->filled = false;
+            this->size--;
+            return this->table[idx]->value;
+        }
+
+        idx = (idx + i*i) % this->buckets;
+    }
+
+    return NULL;
+}
+
+void *
+bucket_hash_get(BucketHash *this, const void *key, size_t keysize)
+{
+    unsigned long idx = fnv1a_digest(key, keysize, 0x811c9dc5) % this->buckets;
+
+    for (size_t i = 0; i < this->buckets; i++) {
+        this->probes++;
+
+        if (this->table[idx] == NULL)
+            return NULL;
+
+        if (this->table[idx]->filled &&
+            memcmp(key, this->table[idx]->key,
+            this->table[idx]->keysize) == 0)
+            return this->table[idx]->value;
+
+        idx = (idx + i*i) % this->buckets;
+    }
+
+    return NULL;
+}
+
+unsigned long
+bucket_hash_probes(BucketHash *this)
+{
+    return this->probes;
+}
@@ -0,0 +1,27 @@
+/* Copyright (c) Victor Roemer, 2013. All rights reserved.
+ * See LICENSE in the root source directory for details. */
+
+#ifndef HASH_BUCKETS_H
+#define HASH_BUCKETS_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+/* The table pcapstats used before entries were stored inline, kept for the
+ * benchmarks to measure against. An array of pointers to buckets malloc'ed
+ * one at a time, probed quadratically from the byte-wise FNV-1a digest of
+ * the key. Removing a key leaves a tombstone behind. It never grows. */
+typedef struct bucket_hash BucketHash;
+
+BucketHash *bucket_hash_create(size_t buckets);
+void bucket_hash_destroy(BucketHash *table);
+
+int bucket_hash_insert(BucketHash *table, void *value, const void *key,
+    size_t keysize);
+void *bucket_hash_remove(BucketHash *table, const void *key, size_t keysize);
+void *bucket_hash_get(BucketHash *table, const void *key, size_t keysize);
+
+/* Buckets a lookup walked, tombstones included */
+unsigned long bucket_hash_probes(BucketHash *table);
+
+#endif /* HASH_BUCKETS_H */
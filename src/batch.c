@@ -0,0 +1,83 @@
+/* Copyright (c) Victor Roemer, 2013. All rights reserved.
+ * See LICENSE in the root source directory for details. */
+
+/* batch.c
+ *
+ * Analyze packets a batch at a time. Every packet of the batch is decoded
+ * first and the table entries they need are prefetched in one pass, so by
+ * the time the trackers run the lookups no longer start with a cache miss.
+ */
+#include <config.h>
+
+#include "batch.h"
+#include "clock.h"
+
+/* Batch Init
+ *
+ * @return  -1 on failure
+ *          0 on success
+ */
+int
+batch_init(struct batch *batch, unsigned size, const struct worker_ops *ops)
+{
+    if (size == 0 || size > BATCH_MAX)
+        return -1;
+
+    batch->ops = ops;
+    batch->count = 0;
+    batch->size = size;
+    batch->mapped = false;
+
+    if ((batch->pool = packet_pool_create(size)) == NULL)
+        return -1;
+
+    return 0;
+}
+
+void
+batch_destroy(struct batch *batch)
+{
+    packet_pool_destroy(batch->pool);
+}
+
+int
+batch_add(struct batch *batch, const struct pcap_pkthdr *pkthdr,
+    const uint8_t *pkt)
+{
+    Packet *packet = packet_pool_get(batch->pool);
+
+    if (packet_decode(packet, pkt, pkthdr->caplen)) {
+        packet_pool_put(batch->pool, packet);
+        return -1;
+    }
+
+    batch->ts[batch->count] = pkthdr->ts;
+    batch->packets[batch->count].packet = packet;
+    batch->packets[batch->count].frame = batch->mapped ? pkt : NULL;
+    batch->packets[batch->count].frame_size = pkthdr->caplen;
+    packet_context_init(&batch->packets[batch->count++]);
+
+    if (batch->count < batch->size)
+        return 0;
+
+    return batch_flush(batch);
+}
+
+unsigned
+batch_flush(struct batch *batch)
+{
+    unsigned count = batch->count;
+
+    for (unsigned i = 0; i < count; i++)
+        batch->ops->prefetch(&batch->packets[i]);
+
+    for (unsigned i = 0; i < count; i++) {
+        clock_advance(&batch->ts[i]);
+        batch->ops->process(&batch->packets[i]);
+        packet_pool_put(batch->pool, batch->packets[i].packet);
+    }
+
+    batch->count = 0;
+
+    return count;
+}
@@ -0,0 +1,52 @@
+/* Copyright (c) Victor Roemer, 2013. All rights reserved.
+ * See LICENSE in the root source directory for details. */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <pcap.h>
+#include <packet.h>
+
+#include "worker.h"
+#include "packet-pool.h"
+
+/* Largest number of packets analyzed together */
+#define BATCH_MAX 64
+
+/* Packets decoded but not yet analyzed. Their data still points into the
+ * capture buffer so a batch must be flushed before the reader reuses it.
+ */
+struct batch
+{
+    const struct worker_ops *ops;
+    PacketPool *pool;
+
+    struct packet_context packets[BATCH_MAX];
+    struct timeval ts[BATCH_MAX];
+    unsigned count;
+    unsigned size;
+
+    bool mapped;    /* packet data outlives the batch */
+};
+
+int batch_init(struct batch *batch, unsigned size,
+    const struct worker_ops *ops);
+
+void batch_destroy(struct batch *batch);
+
+/* Decode a packet into the batch, flushing it once full
+ *
+ * @return  -1 if the packet failed to decode
+ *          number of packets analyzed otherwise
+ */
+int batch_add(struct batch *batch, const struct pcap_pkthdr *pkthdr,
+    const uint8_t *pkt);
+
+/* Prefetch the table entries of every packet in the batch, then analyze
+ * them in order.
+ *
+ * @return  number of packets analyzed
+ */
+unsigned batch_flush(struct batch *batch);
+
+#endif /* BATCH_H */
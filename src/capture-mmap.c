@@ -0,0 +1,355 @@
+/* Copyright (c) Victor Roemer, 2013. All rights reserved.
+ * See LICENSE in the root source directory for details. */
+
+/* capture-mmap.c
+ *
+ * Savefile reader for offline analysis. The whole capture is mapped
+ * read-only and walked record by record; packets are decoded straight out
+ * of the mapping, nothing is copied through stdio buffers.
+ *
+ * The file can also be cut into byte ranges so several threads can walk it
+ * at once. Savefiles have no index, so the start of a range is found by
+ * looking for a run of record headers that chain together.
+ */
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "capture-mmap.h"
+#include "mesg.h"
+
+#define PCAP_MAGIC          0xa1b2c3d4
+#define PCAP_MAGIC_NSEC     0xa1b23c4d
+
+/* The upper bits of the link type carry FCS information */
+#define PCAP_LINKTYPE_MASK  0x03ffffff
+
+/* Savefiles carry LINKTYPE_ values, which only differ from the DLT_ values
+ * of the platform for these */
+#define LINKTYPE_ATM_RFC1483    100
+#define LINKTYPE_RAW            101
+#define LINKTYPE_SLIP_BSDOS     102
+#define LINKTYPE_PPP_BSDOS      103
+#define LINKTYPE_ATM_CLIP       106
+#define LINKTYPE_PFSYNC         246
+#define LINKTYPE_PKTAP          258
+
+/* Largest packet any sane capture holds */
+#define PCAP_MAX_SNAPLEN    262144
+
+/* Consecutive headers that must chain together to trust a boundary */
+#define RESYNC_RECORDS      8
+
+/* Largest gap between the timestamps of neighbouring records (s) */
+#define RESYNC_MAX_GAP      3600
+
+struct file_header
+{
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+};
+
+struct record_header
+{
+    uint32_t ts_sec;
+    uint32_t ts_subsec;
+    uint32_t caplen;
+    uint32_t len;
+};
+
+struct _Pcapmap
+{
+    const uint8_t *map;
+    size_t size;
+
+    int datalink;
+    int swapped;
+    int nsec;
+    uint32_t snaplen;
+
+    volatile int breakloop;
+};
+
+static inline uint32_t
+pcapmap_u32(const Pcapmap *pm, uint32_t value)
+{
+    return pm->swapped ? __builtin_bswap32(value) : value;
+}
+
+/* Datalink type of a LINKTYPE_ value, as libpcap maps it when it reads
+ * the same file */
+static int
+linktype_to_dlt(uint32_t linktype)
+{
+    switch (linktype) {
+        case LINKTYPE_ATM_RFC1483:
+            return DLT_ATM_RFC1483;
+        case LINKTYPE_RAW:
+            return DLT_RAW;
+        case LINKTYPE_SLIP_BSDOS:
+            return DLT_SLIP_BSDOS;
+        case LINKTYPE_PPP_BSDOS:
+            return DLT_PPP_BSDOS;
+#ifdef DLT_ATM_CLIP
+        case LINKTYPE_ATM_CLIP:
+            return DLT_ATM_CLIP;
+#endif
+#ifdef DLT_PFSYNC
+        case LINKTYPE_PFSYNC:
+            return DLT_PFSYNC;
+#endif
+#ifdef DLT_PKTAP
+        case LINKTYPE_PKTAP:
+            return DLT_PKTAP;
+#endif
+        default:
+            return linktype;
+    }
+}
+
+/* Pcapmap Open
+ *
+ * @return  NULL on failure
+ *          Pcapmap * on success
+ */
+Pcapmap *
+pcapmap_open(const char *filename, char *errbuf)
+{
+    Pcapmap *pm;
+    struct file_header fh;
+    struct stat st;
+    int fd;
+
+    if ((fd = open(filename, O_RDONLY)) < 0) {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "%s", strerror(errno));
+        return NULL;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "fstat: %s", strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    if (!S_ISREG(st.st_mode) || (size_t)st.st_size < sizeof fh ||
+        (uint64_t)st.st_size > SIZE_MAX) {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "not a mappable pcap file");
+        close(fd);
+        return NULL;
+    }
+
+    if ((pm = calloc(1, sizeof *pm)) == NULL) {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "out of memory");
+        close(fd);
+        return NULL;
+    }
+
+    pm->size = st.st_size;
+    pm->map = mmap(NULL, pm->size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    /* The mapping holds its own reference to the file */
+    close(fd);
+
+    if (pm->map == MAP_FAILED) {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "mmap: %s", strerror(errno));
+        free(pm);
+        return NULL;
+    }
+
+    madvise((void *)pm->map, pm->size, MADV_SEQUENTIAL);
+
+    memcpy(&fh, pm->map, sizeof fh);
+
+    switch (fh.magic) {
+        case PCAP_MAGIC:
+            break;
+        case PCAP_MAGIC_NSEC:
+            pm->nsec = 1;
+            break;
+        case __builtin_bswap32(PCAP_MAGIC):
+            pm->swapped = 1;
+            break;
+        case __builtin_bswap32(PCAP_MAGIC_NSEC):
+            pm->swapped = 1;
+            pm->nsec = 1;
+            break;
+        default:
+            snprintf(errbuf, PCAP_ERRBUF_SIZE, "unsupported file format");
+            pcapmap_close(pm);
+            return NULL;
+    }
+
+    pm->datalink = linktype_to_dlt(pcapmap_u32(pm, fh.linktype) &
+        PCAP_LINKTYPE_MASK);
+
+    pm->snaplen = pcapmap_u32(pm, fh.snaplen);
+    if (pm->snaplen == 0 || pm->snaplen > PCAP_MAX_SNAPLEN)
+        pm->snaplen = PCAP_MAX_SNAPLEN;
+
+    return pm;
+}
+
+void
+pcapmap_close(Pcapmap *pm)
+{
+    munmap((void *)pm->map, pm->size);
+    free(pm);
+}
+
+int
+pcapmap_datalink(Pcapmap *pm)
+{
+    return pm->datalink;
+}
+
+/* Could a record header start at offset? On success next is set to the
+ * offset of the following record.
+ */
+static bool
+record_plausible(const Pcapmap *pm, size_t offset, size_t *next,
+    uint32_t *ts_sec)
+{
+    struct record_header rh;
+
+    if (pm->size - offset < sizeof rh)
+        return false;
+
+    memcpy(&rh, pm->map + offset, sizeof rh);
+
+    uint32_t caplen = pcapmap_u32(pm, rh.caplen);
+    uint32_t len = pcapmap_u32(pm, rh.len);
+    uint32_t subsec = pcapmap_u32(pm, rh.ts_subsec);
+
+    if (caplen > pm->snaplen || caplen > len || len > PCAP_MAX_SNAPLEN ||
+        subsec >= (pm->nsec ? 1000000000u : 1000000u))
+        return false;
+
+    if (pm->size - offset - sizeof rh < caplen)
+        return false;
+
+    *next = offset + sizeof rh + caplen;
+    *ts_sec = pcapmap_u32(pm, rh.ts_sec);
+
+    return true;
+}
+
+/* Find the first record boundary at or after offset
+ *
+ * @return  offset of the record
+ *          size of the file if there is none
+ */
+static size_t
+pcapmap_resync(const Pcapmap *pm, size_t offset)
+{
+    for (; offset < pm->size; offset++) {
+        size_t next = offset;
+        uint32_t ts, prev_ts = 0;
+        unsigned run;
+
+        for (run = 0; run < RESYNC_RECORDS && next < pm->size; run++) {
+            if (!record_plausible(pm, next, &next, &ts))
+                break;
+
+            if (run && (ts > prev_ts ? ts - prev_ts : prev_ts - ts) >
+                RESYNC_MAX_GAP)
+                break;
+
+            prev_ts = ts;
+        }
+
+        /* A run that ends exactly at the end of the file counts */
+        if (run == RESYNC_RECORDS || (run && next == pm->size))
+            return offset;
+    }
+
+    return pm->size;
+}
+
+void
+pcapmap_split(Pcapmap *pm, unsigned count, size_t *bounds)
+{
+    size_t start = sizeof(struct file_header);
+    size_t chunk = (pm->size - start) / count;
+
+    bounds[0] = start;
+    bounds[count] = pm->size;
+
+    for (unsigned i = 1; i < count; i++) {
+        size_t offset = start + chunk * i;
+
+        if (offset < bounds[i - 1])
+            offset = bounds[i - 1];
+
+        bounds[i] = pcapmap_resync(pm, offset);
+    }
+}
+
+int
+pcapmap_loop(Pcapmap *pm, pcap_handler callback, uint8_t *user)
+{
+    return pcapmap_loop_range(pm, sizeof(struct file_header), pm->size,
+        callback, user);
+}
+
+/* Pcapmap Loop Range
+ *
+ * @return  -1 if the range ends in a truncated record
+ *          0 on success
+ */
+int
+pcapmap_loop_range(Pcapmap *pm, size_t start, size_t end,
+    pcap_handler callback, uint8_t *user)
+{
+    struct record_header rh;
+    struct pcap_pkthdr pkthdr;
+    size_t offset = start;
+
+    while (!pm->breakloop && offset < end) {
+        if (pm->size - offset < sizeof rh) {
+            warn("truncated record header at offset %zu", offset);
+            return -1;
+        }
+
+        /* Records are not aligned */
+        memcpy(&rh, pm->map + offset, sizeof rh);
+        offset += sizeof rh;
+
+        pkthdr.caplen = pcapmap_u32(pm, rh.caplen);
+        pkthdr.len = pcapmap_u32(pm, rh.len);
+        pkthdr.ts.tv_sec = pcapmap_u32(pm, rh.ts_sec);
+        pkthdr.ts.tv_usec = pcapmap_u32(pm, rh.ts_subsec);
+        if (pm->nsec)
+            pkthdr.ts.tv_usec /= 1000;
+
+        if (pkthdr.caplen > pm->size - offset) {
+            warn("truncated record at offset %zu", offset - sizeof rh);
+            return -1;
+        }
+
+        callback(user, &pkthdr, pm->map + offset);
+
+        offset += pkthdr.caplen;
+    }
+
+    return 0;
+}
+
+void
+pcapmap_breakloop(Pcapmap *pm)
+{
+    pm->breakloop = 1;
+}
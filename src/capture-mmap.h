@@ -0,0 +1,41 @@
+/* Copyright (c) Victor Roemer, 2013. All rights reserved.
+ * See LICENSE in the root source directory for details. */
+
+#ifndef CAPTURE_MMAP_H
+#define CAPTURE_MMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pcap.h>
+
+typedef struct _Pcapmap Pcapmap;
+
+/* Map a pcap (microsecond or nanosecond) savefile. errbuf receives the
+ * reason on failure, including files in a format we do not read.
+ */
+Pcapmap *pcapmap_open(const char *filename, char *errbuf);
+
+void pcapmap_close(Pcapmap *pm);
+
+/* Datalink type of the records in the file */
+int pcapmap_datalink(Pcapmap *pm);
+
+/* Hand every record, in place, to callback until the end of the file or
+ * pcapmap_breakloop is called.
+ */
+int pcapmap_loop(Pcapmap *pm, pcap_handler callback, uint8_t *user);
+
+/* Same as pcapmap_loop but only for the records whose header starts in
+ * [start, end).
+ */
+int pcapmap_loop_range(Pcapmap *pm, size_t start, size_t end,
+    pcap_handler callback, uint8_t *user);
+
+/* Cut the file into count ranges of about the same size that start on
+ * record boundaries. bounds receives count + 1 offsets.
+ */
+void pcapmap_split(Pcapmap *pm, unsigned count, size_t *bounds);
+
+void pcapmap_breakloop(Pcapmap *pm);
+
+#endif /* CAPTURE_MMAP_H */
@@ -0,0 +1,389 @@
+/* Copyright (c) Victor Roemer, 2013. All rights reserved.
+ * See LICENSE in the root source directory for details. */
+
+/* capture-tpacket.c
+ *
+ * Native AF_PACKET capture using a TPACKET_V3 memory mapped block ring.
+ * The kernel fills whole blocks of frames; a block is handed back only
+ * after every frame in it has been analyzed, so frames are decoded where
+ * the kernel wrote them.
+ */
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "capture-tpacket.h"
+#include "cdefs.h"
+
+#ifdef LINUX
+
+#include <poll.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/if_arp.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+/* Frames are variable sized in V3, the frame size only has to divide the
+ * block size */
+#define TPACKET_FRAME_SIZE (TPACKET_ALIGNMENT << 7)
+
+/* How long the kernel may hold a partially filled block (ms) */
+#define TPACKET_BLOCK_TIMEOUT 64
+
+struct _Tpacket
+{
+    int fd;
+    int datalink;
+
+    uint8_t *map;
+    size_t map_size;
+
+    unsigned block_size;
+    unsigned block_count;
+    unsigned block;
+
+    volatile int breakloop;
+
+    uint64_t packets;
+    uint64_t drops;
+};
+
+static int
+tpacket_datalink_of(int fd, const char *interface, char *errbuf)
+{
+    struct ifreq ifr;
+
+    memset(&ifr, 0, sizeof ifr);
+    strncpy(ifr.ifr_name, interface, sizeof ifr.ifr_name - 1);
+
+    if (ioctl(fd, SIOCGIFHWADDR, &ifr) < 0) {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "SIOCGIFHWADDR: %s",
+            strerror(errno));
+        return -1;
+    }
+
+    switch (ifr.ifr_hwaddr.sa_family) {
+        case ARPHRD_ETHER:
+        case ARPHRD_LOOPBACK:
+            return DLT_EN10MB;
+    }
+
+    snprintf(errbuf, PCAP_ERRBUF_SIZE, "unsupported link type %u",
+        ifr.ifr_hwaddr.sa_family);
+
+    return -1;
+}
+
+/* Tpacket Open
+ *
+ * @return  NULL on failure
+ *          Tpacket * on success
+ */
+Tpacket *
+tpacket_open(const char *interface, unsigned block_size,
+    unsigned block_count, char *errbuf)
+{
+    Tpacket *tp;
+    struct tpacket_req3 req;
+    struct sockaddr_ll sll;
+    struct packet_mreq mreq;
+    int version = TPACKET_V3;
+    unsigned ifindex;
+
+    if ((ifindex = if_nametoindex(interface)) == 0) {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "no such interface");
+        return NULL;
+    }
+
+    if ((tp = calloc(1, sizeof *tp)) == NULL) {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "out of memory");
+        return NULL;
+    }
+
+    tp->block_size = block_size;
+    tp->block_count = block_count;
+    tp->map = MAP_FAILED;
+
+    /* No protocol until the socket is bound, or frames of every interface
+     * would land in the ring meanwhile */
+    if ((tp->fd = socket(AF_PACKET, SOCK_RAW, 0)) < 0) {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "socket: %s", strerror(errno));
+        free(tp);
+        return NULL;
+    }
+
+    if ((tp->datalink = tpacket_datalink_of(tp->fd, interface, errbuf)) < 0)
+        goto fail;
+
+    if (setsockopt(tp->fd, SOL_PACKET, PACKET_VERSION, &version,
+        sizeof version) < 0) {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "PACKET_VERSION: %s",
+            strerror(errno));
+        goto fail;
+    }
+
+    memset(&req, 0, sizeof req);
+    req.tp_block_size = block_size;
+    req.tp_block_nr = block_count;
+    req.tp_frame_size = TPACKET_FRAME_SIZE;
+    req.tp_frame_nr = (block_size / TPACKET_FRAME_SIZE) * block_count;
+    req.tp_retire_blk_tov = TPACKET_BLOCK_TIMEOUT;
+    req.tp_feature_req_word = TP_FT_REQ_FILL_RXHASH;
+
+    if (setsockopt(tp->fd, SOL_PACKET, PACKET_RX_RING, &req,
+        sizeof req) < 0) {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "PACKET_RX_RING: %s",
+            strerror(errno));
+        goto fail;
+    }
+
+    tp->map_size = (size_t)block_size * block_count;
+    tp->map = mmap(NULL, tp->map_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, tp->fd, 0);
+
+    if (tp->map == MAP_FAILED) {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "mmap: %s", strerror(errno));
+        goto fail;
+    }
+
+    memset(&sll, 0, sizeof sll);
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex = ifindex;
+
+    if (bind(tp->fd, (struct sockaddr *)&sll, sizeof sll) < 0) {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "bind: %s", strerror(errno));
+        goto fail;
+    }
+
+    memset(&mreq, 0, sizeof mreq);
+    mreq.mr_ifindex = ifindex;
+    mreq.mr_type = PACKET_MR_PROMISC;
+
+    if (setsockopt(tp->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq,
+        sizeof mreq) < 0) {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "PACKET_ADD_MEMBERSHIP: %s",
+            strerror(errno));
+        goto fail;
+    }
+
+    return tp;
+
+fail:
+    tpacket_close(tp);
+    return NULL;
+}
+
+void
+tpacket_close(Tpacket *tp)
+{
+    if (tp->map != MAP_FAILED)
+        munmap(tp->map, tp->map_size);
+
+    close(tp->fd);
+    free(tp);
+}
+
+/* Tpacket Fanout
+ *
+ * Fragments are reassembled by the kernel before being hashed so every
+ * fragment of a datagram lands on the same socket.
+ *
+ * @return  -1 on failure
+ *          0 on success
+ */
+int
+tpacket_fanout(Tpacket *tp, unsigned group, char *errbuf)
+{
+    int arg = (group & 0xffff) |
+        ((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+
+    if (setsockopt(tp->fd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof arg) < 0) {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "PACKET_FANOUT: %s",
+            strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Tpacket Set Filter
+ *
+ * @return  -1 on failure
+ *          0 on success
+ */
+int
+tpacket_setfilter(Tpacket *tp, struct bpf_program *program, char *errbuf)
+{
+    struct sock_fprog fprog;
+
+    /* struct bpf_insn and struct sock_filter share their layout */
+    fprog.len = program->bf_len;
+    fprog.filter = (struct sock_filter *)program->bf_insns;
+
+    if (setsockopt(tp->fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog,
+        sizeof fprog) < 0) {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "SO_ATTACH_FILTER: %s",
+            strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+tpacket_datalink(Tpacket *tp)
+{
+    return tp->datalink;
+}
+
+/* Tpacket Loop
+ *
+ * @return  -1 on failure
+ *          0 when the loop was broken
+ */
+int
+tpacket_loop(Tpacket *tp, pcap_handler callback,
+    void (*flush)(uint8_t *user), uint8_t *user)
+{
+    struct pollfd pfd;
+    struct pcap_pkthdr pkthdr;
+
+    pfd.fd = tp->fd;
+    pfd.events = POLLIN | POLLERR;
+    pfd.revents = 0;
+
+    while (!tp->breakloop) {
+        struct tpacket_block_desc *block = (struct tpacket_block_desc *)
+            (tp->map + (size_t)tp->block * tp->block_size);
+
+        if (!(__atomic_load_n(&block->hdr.bh1.block_status,
+            __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+            if (poll(&pfd, 1, 1000) < 0 && errno != EINTR)
+                return -1;
+            continue;
+        }
+
+        struct tpacket3_hdr *frame = (struct tpacket3_hdr *)
+            ((uint8_t *)block + block->hdr.bh1.offset_to_first_pkt);
+
+        for (unsigned i = 0; i < block->hdr.bh1.num_pkts; i++) {
+            pkthdr.ts.tv_sec = frame->tp_sec;
+            pkthdr.ts.tv_usec = frame->tp_nsec / 1000;
+            pkthdr.caplen = frame->tp_snaplen;
+            pkthdr.len = frame->tp_len;
+
+            callback(user, &pkthdr, (uint8_t *)frame + frame->tp_mac);
+
+            frame = (struct tpacket3_hdr *)
+                ((uint8_t *)frame + frame->tp_next_offset);
+        }
+
+        /* Give the block back to the kernel */
+        if (flush)
+            flush(user);
+
+        __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL,
+            __ATOMIC_RELEASE);
+
+        tp->block = (tp->block + 1) % tp->block_count;
+    }
+
+    tp->breakloop = 0;
+
+    return 0;
+}
+
+void
+tpacket_breakloop(Tpacket *tp)
+{
+    tp->breakloop = 1;
+}
+
+/* Tpacket Stats
+ *
+ * The kernel resets its counters on every read, keep a running total.
+ */
+int
+tpacket_stats(Tpacket *tp, uint64_t *packets, uint64_t *drops)
+{
+    struct tpacket_stats_v3 stats;
+    socklen_t len = sizeof stats;
+
+    if (getsockopt(tp->fd, SOL_PACKET, PACKET_STATISTICS, &stats, &len) < 0)
+        return -1;
+
+    tp->packets += stats.tp_packets;
+    tp->drops += stats.tp_drops;
+
+    *packets = tp->packets;
+    *drops = tp->drops;
+
+    return 0;
+}
+
+#else /* !LINUX */
+
+Tpacket *
+tpacket_open(const char *interface UNUSED, unsigned block_size UNUSED,
+    unsigned block_count UNUSED, char *errbuf)
+{
+    snprintf(errbuf, PCAP_ERRBUF_SIZE, "tpacket capture requires Linux");
+    return NULL;
+}
+
+void
+tpacket_close(Tpacket *tp UNUSED)
+{
+}
+
+int
+tpacket_fanout(Tpacket *tp UNUSED, unsigned group UNUSED, char *errbuf)
+{
+    snprintf(errbuf, PCAP_ERRBUF_SIZE, "tpacket capture requires Linux");
+    return -1;
+}
+
+int
+tpacket_setfilter(Tpacket *tp UNUSED, struct bpf_program *program UNUSED,
+    char *errbuf)
+{
+    snprintf(errbuf, PCAP_ERRBUF_SIZE, "tpacket capture requires Linux");
+    return -1;
+}
+
+int
+tpacket_datalink(Tpacket *tp UNUSED)
+{
+    return -1;
+}
+
+int
+tpacket_loop(Tpacket *tp UNUSED, pcap_handler callback UNUSED,
+    void (*flush)(uint8_t *user) UNUSED, uint8_t *user UNUSED)
+{
+    return -1;
+}
+
+void
+tpacket_breakloop(Tpacket *tp UNUSED)
+{
+}
+
+int
+tpacket_stats(Tpacket *tp UNUSED, uint64_t *packets UNUSED,
+    uint64_t *drops UNUSED)
+{
+    return -1;
+}
+
+#endif /* LINUX */
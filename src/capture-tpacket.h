@@ -0,0 +1,47 @@
+/* Copyright (c) Victor Roemer, 2013. All rights reserved.
+ * See LICENSE in the root source directory for details. */
+
+#ifndef CAPTURE_TPACKET_H
+#define CAPTURE_TPACKET_H
+
+#include <stdint.h>
+#include <pcap.h>
+
+typedef struct _Tpacket Tpacket;
+
+/* Open a TPACKET_V3 ring of block_count blocks of block_size bytes on
+ * interface. errbuf receives the reason on failure.
+ */
+Tpacket *tpacket_open(const char *interface, unsigned block_size,
+    unsigned block_count, char *errbuf);
+
+void tpacket_close(Tpacket *tp);
+
+/* Join the fanout group, the kernel spreads flows over every socket in the
+ * group by a hash symmetric in both directions.
+ */
+int tpacket_fanout(Tpacket *tp, unsigned group, char *errbuf);
+
+/* Attach a compiled BPF program to the socket, replacing the previous
+ * one. Frames it rejects never reach the ring.
+ */
+int tpacket_setfilter(Tpacket *tp, struct bpf_program *program,
+    char *errbuf);
+
+/* Datalink type of the frames handed to the callback */
+int tpacket_datalink(Tpacket *tp);
+
+/* Walk the ring handing each frame, in place, to callback until
+ * tpacket_breakloop is called. Frames stay valid until their block is
+ * handed back to the kernel; flush, when not NULL, is called right before.
+ * Like pcap_loop, a broken loop can be entered again.
+ */
+int tpacket_loop(Tpacket *tp, pcap_handler callback,
+    void (*flush)(uint8_t *user), uint8_t *user);
+
+void tpacket_breakloop(Tpacket *tp);
+
+/* Kernel packet and drop counters since the ring was opened */
+int tpacket_stats(Tpacket *tp, uint64_t *packets, uint64_t *drops);
+
+#endif /* CAPTURE_TPACKET_H */
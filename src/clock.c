@@ -0,0 +1,80 @@
+/* Copyright (c) Victor Roemer, 2013. All rights reserved.
+ * See LICENSE in the root source directory for details. */
+
+/* clock.c
+ *
+ * Time as seen by the trackers. Live captures age their state on the
+ * monotonic system clock. Savefiles age it on the capture time of the
+ * packets instead, so replaying an old capture expires state exactly as it
+ * would have expired live, and two runs over the same file agree.
+ *
+ * The packet clock is kept per thread: every analysis thread moves its own
+ * forward with the packets it analyzes, and only ever compares it against
+ * the entries of its own tables.
+ */
+#include <config.h>
+
+#include <time.h>
+
+#include "clock.h"
+
+static ClockSource source = CLOCK_SOURCE_SYSTEM;
+
+static __thread struct timeval packet_time;
+static __thread struct timeval first_time;
+static __thread bool holding;
+
+void
+clock_set_source(ClockSource new_source)
+{
+    source = new_source;
+}
+
+void
+clock_advance(const struct timeval *ts)
+{
+    if (timercmp(ts, &packet_time, >)) {
+        if (!timerisset(&packet_time))
+            first_time = *ts;
+        packet_time = *ts;
+    }
+}
+
+void
+clock_now(struct timeval *now)
+{
+    struct timespec ts;
+
+    if (source == CLOCK_SOURCE_PACKET) {
+        *now = packet_time;
+        return;
+    }
+
+#ifdef CLOCK_MONOTONIC_COARSE
+    /* Ticks every few ms, plenty for timeouts counted in seconds */
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+
+    now->tv_sec = ts.tv_sec;
+    now->tv_usec = ts.tv_nsec / 1000;
+}
+
+void
+clock_hold()
+{
+    holding = true;
+}
+
+void
+clock_release()
+{
+    holding = false;
+}
+
+bool
+clock_held(const struct timeval *created, int timeout)
+{
+    return holding && created->tv_sec < first_time.tv_sec + timeout;
+}
@@ -0,0 +1,37 @@
+/* Copyright (c) Victor Roemer, 2013. All rights reserved.
+ * See LICENSE in the root source directory for details. */
+
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdbool.h>
+#include <sys/time.h>
+
+/* Where the trackers take the current time from */
+typedef enum {
+    CLOCK_SOURCE_SYSTEM,    /* monotonic system clock, for live captures */
+    CLOCK_SOURCE_PACKET     /* capture time of the packets analyzed */
+} ClockSource;
+
+/* Pick the time source, before any tracker table is set up */
+void clock_set_source(ClockSource source);
+
+/* Move the packet clock of the calling thread up to ts. Time never runs
+ * backwards, packets captured out of order do not rewind it.
+ */
+void clock_advance(const struct timeval *ts);
+
+/* Current time of the calling thread */
+void clock_now(struct timeval *now);
+
+/* Chunked reads: state a thread creates within timeout of its first packet
+ * may belong to state left by the previous chunk, so it must not expire
+ * until the tables of that chunk have been merged in.
+ */
+void clock_hold(void);
+void clock_release(void);
+
+/* Is state created at created still held back from expiring? */
+bool clock_held(const struct timeval *created, int timeout);
+
+#endif /* CLOCK_H */
@@ -50,7 +50,8 @@
 #include <netinet/ip.h>
 
 #include "timequeue.h"
-#include "hashtable.h"
+#include "hashtable-typed.h"
+#include "hashdigest.h"
 
 #include "mesg.h"
 #include "readconf.h"
@@ -60,14 +61,11 @@
 # include "print-data.h"
 #endif
 
-extern Options options;
-
 struct frag_key
 {
-    struct ipaddr srcaddr;
-    struct ipaddr dstaddr;
+    struct packet_key flow;     /* conversation, without ports */
     uint32_t id;
-    uint8_t protocol;
+    uint8_t reversed;           /* direction within the conversation */
 };
 
 struct frag
@@ -91,6 +89,13 @@ struct frag_list
     int acquired_bytes;
     int flush_bytes;
     bool have_last;
+
+    struct tmq_element *timeout;    /* in the timeout queue */
+
+    /* Frame of the latest fragment, if it stays mapped, to decode the
+     * datagram from when a merge completes it */
+    const uint8_t *frame;
+    uint32_t frame_size;
 };
 
 typedef enum OVERLAP_TYPE
@@ -109,9 +114,10 @@ typedef enum OVERLAP_TYPE
 } OVERLAP_TYPE;
 
 /* Fragment Table Management Code */
-int frag_table_remove(struct frag_key *, struct frag_list *);
-struct frag_list *frag_table_get(struct frag_key *key);
-int frag_table_insert(struct frag_key *, struct frag_list *);
+int frag_table_remove(const struct frag_key *, uint32_t, struct frag_list *);
+struct frag_list *frag_table_find(const struct frag_key *key, uint32_t hash);
+struct frag_list *frag_table_get(struct frag_key *key, uint32_t hash);
+int frag_table_insert(struct frag_key *, uint32_t, struct frag_list *);
 
 /* Debugging Stuff */
 int frag_print(struct frag *frag);
@@ -125,8 +131,7 @@ int frag_list_pop(struct frag_list *list, struct frag *frag);
 int frag_list_insert(struct frag_list *list, struct frag *frag);
 uint8_t *frag_list_join(struct frag_list *list);
 int find_frag_overlap(struct frag_list *, struct frag *, struct frag **);
-int _frag_timeout_queue_task(const void *p_key);
-int frag_key_compare(const void *p_key_1, const void *p_key_2);
+int _frag_timeout_queue_task(const struct tmq_element *elem);
 
 /* Insertion models */
 int frag_insert_first(struct frag_list *, struct frag *);
@@ -137,16 +142,82 @@ int frag_insert_bsdright(struct frag_list *, struct frag *);
 int frag_insert_windows(struct frag_list *, struct frag *);
 int frag_insert_solaris(struct frag_list *, struct frag *);
 
-int(*frag_insert_model)(struct frag_list *, struct frag *)
+/* Reassembly policies by their FragModel name */
+static const struct
+{
+    const char *name;
+    int (*insert)(struct frag_list *, struct frag *);
+} frag_models[] = {
+    { "first", &frag_insert_first },
+    { "last", &frag_insert_last },
+    { "linux", &frag_insert_linux },
+    { "bsd", &frag_insert_bsd },
+    { "bsd-right", &frag_insert_bsdright },
+    { "windows", &frag_insert_windows },
+    { "solaris", &frag_insert_solaris },
+};
+
+/* Policy of the calling thread, looked up again whenever its options
+ * name another one */
+static __thread int(*frag_insert_model)(struct frag_list *, struct frag *)
     = &frag_insert_first;
+static __thread const char *frag_model;
+
+static void frag_model_refresh(void);
+
+HASH_TABLE_DECLARE(fraglist_hash, struct frag_key, struct frag_list);
 
-static Hash *fragtable = NULL;
-struct tmq *timeout_queue;
+/* Each analysis thread has its own table */
+static __thread fraglist_hash *fragtable = NULL;
+static __thread struct tmq *timeout_queue;
+static __thread struct tracker_stats fragstats;
+
+/* Reassembled payloads are built here, the buffer only ever grows and is
+ * reused by the next reassembly */
+static __thread uint8_t *reassembly;
+static __thread int reassembly_size;
+
+/* Tables detached from a thread for merging */
+struct frag_tables
+{
+    fraglist_hash *fragtable;
+    struct tmq *timeout_queue;
+};
 
 /******************************************************************************
  * Fragment List Table Management Code
  *****************************************************************************/
 
+/* Fragments are hashed on the conversation hash their packet already
+ * carries and the datagram id, the addresses are not hashed again.
+ */
+static inline uint32_t
+frag_key_hash(uint32_t flow_hash, const struct frag_key *key)
+{
+    uint32_t words[3] = { flow_hash, key->id, key->reversed };
+
+    return key_digest(words, sizeof words);
+}
+
+/* Hash of a key without the packet it came from */
+static uint32_t
+frag_hash(const struct frag_key *key)
+{
+    return frag_key_hash(key_digest(&key->flow, sizeof key->flow), key);
+}
+
+/* Key and hash of a fragment */
+static uint32_t
+frag_key_from_context(struct frag_key *key, struct packet_context *ctx)
+{
+    memset(key, 0, sizeof *key);
+    key->flow = ctx->key;
+    key->id = packet_id(ctx->packet);
+    key->reversed = ctx->reversed;
+
+    return frag_key_hash(ctx->hash, key);
+}
+
 /* Create Frag Tree
  *
  * @return  -1 on failure
@@ -155,7 +226,7 @@ struct tmq *timeout_queue;
 int
 frag_table_init()
 {
-    fragtable = hash_create(options.frag_max_mem);
+    fragtable = fraglist_hash_create(options.frag_max_mem);
     if(fragtable == NULL)
         return -1;
 
@@ -163,13 +234,8 @@ frag_table_init()
     if(timeout_queue == NULL)
         return -1;
 
-    timeout_queue->compare = frag_key_compare;
     timeout_queue->task = _frag_timeout_queue_task;
 
-#ifdef ENABLE_PTHREADS
-    tmq_start(timeout_queue);
-#endif
-
     return 0;
 }
 
@@ -186,25 +252,201 @@ frag_table_finalize()
 {
     struct frag_list *it;
     unsigned i;
-    const void *key;
+    const struct frag_key *key;
+
+    /* The buffer stays with the thread even if its table was exported */
+    free(reassembly);
+    reassembly = NULL;
+    reassembly_size = 0;
 
     if(!fragtable)
         return -1;
 
-#ifdef ENABLE_PTHREADS
-    tmq_stop(timeout_queue);
-#endif
     tmq_destroy(timeout_queue);
 
-    for(it = hash_first(fragtable, &i, &key); it;
-         it = hash_next(fragtable, &i, &key))
-        frag_table_remove((struct frag_key *) key, it);
+    for(it = fraglist_hash_first(fragtable, &i, &key); it;
+         it = fraglist_hash_next(fragtable, &i, &key))
+        frag_table_remove(key, frag_hash(key), it);
 
-    hash_destroy(fragtable);
+    fraglist_hash_destroy(fragtable);
+    fragtable = NULL;
 
     return 0;
 }
 
+/* Frag Table Stats
+ *
+ * Add this thread's defragmentation counters to stats
+ */
+void
+frag_table_stats(struct tracker_stats *stats)
+{
+    stats->frag_fragments += fragstats.frag_fragments;
+    stats->frag_reassembled += fragstats.frag_reassembled;
+
+    if (fragtable)
+        fraglist_hash_stats(fragtable, &stats->frag_table);
+}
+
+/* Frag Table Prefetch
+ *
+ * Start loading the list a fragment belongs to, ahead of defragment()
+ */
+void
+frag_table_prefetch(struct packet_context *ctx)
+{
+    struct frag_key key;
+
+    if(!packet_is_fragment(ctx->packet))
+        return;
+
+    fraglist_hash_prefetch(fragtable, frag_key_from_context(&key, ctx));
+}
+
+/* Frag Table Export
+ *
+ * Detach this thread's table so it can be merged by another thread
+ *
+ * @return  NULL on failure
+ *          tables on success
+ */
+void *
+frag_table_export()
+{
+    struct frag_tables *tables;
+
+    if ((tables = malloc(sizeof *tables)) == NULL)
+        return NULL;
+
+    tables->fragtable = fragtable;
+    tables->timeout_queue = timeout_queue;
+
+    fragtable = NULL;
+    timeout_queue = NULL;
+
+    return tables;
+}
+
+/* Frag List Reassembled
+ *
+ * Decode the frame of the latest fragment of a datagram a merge completed
+ * and hand it to reassembled with the datagram as its payload, the way
+ * defragment() returns the packet of the fragment completing one.
+ */
+static void
+frag_list_reassembled(struct frag_list *list, Packet **packet,
+    void (*reassembled)(struct packet_context *ctx))
+{
+    struct packet_context ctx;
+    const uint8_t *payload;
+
+    if(list->frame == NULL)
+        return;
+
+    if(*packet == NULL && (*packet = packet_create()) == NULL)
+        return;
+
+    if(packet_decode(*packet, list->frame, list->frame_size))
+        return;
+
+    if((payload = frag_list_join(list)) == NULL)
+        return;
+
+    packet_set_payload(*packet, payload, list->flush_bytes);
+
+    memset(&ctx, 0, sizeof ctx);
+    ctx.packet = *packet;
+    ctx.merged = true;
+
+    reassembled(&ctx);
+}
+
+/* Frag Table Merge
+ *
+ * Fold the detached table of an earlier part of the capture into this
+ * thread's table. The earlier fragments stay in front so the insertion
+ * model sees every fragment in capture order, and datagrams whose
+ * fragments were split between the two tables are reassembled here and
+ * handed to reassembled.
+ */
+void
+frag_table_merge(void *p_tables,
+    void (*reassembled)(struct packet_context *ctx))
+{
+    struct frag_tables *tables = p_tables;
+    struct frag_list *list, *mine;
+    Packet *packet = NULL;
+    struct tmq_element *tmq_elem;
+    struct frag_key key;
+    const struct frag_key *p_key;
+    uint32_t hash;
+    unsigned i;
+
+    if (tables == NULL)
+        return;
+
+    frag_model_refresh();
+
+    for (list = fraglist_hash_first(tables->fragtable, &i, &p_key); list;
+         list = fraglist_hash_next(tables->fragtable, &i, &p_key)) {
+        memcpy(&key, p_key, sizeof key);
+        hash = frag_hash(&key);
+        fraglist_hash_remove(tables->fragtable, &key, hash);
+
+        /* The element of the earlier table goes with its queue, the list
+         * takes over the one of this thread's list if there is one */
+        tmq_elem = NULL;
+
+        if ((mine = frag_table_find(&key, hash)) != NULL) {
+            tmq_elem = mine->timeout;
+
+            while (mine->size > 0) {
+                struct frag *frag = mine->head;
+                frag_list_pop(mine, frag);
+                frag_insert_model(list, frag);
+            }
+
+            list->packet_count += mine->packet_count;
+            if (mine->frame) {
+                list->frame = mine->frame;
+                list->frame_size = mine->frame_size;
+            }
+            frag_table_remove(&key, hash, mine);
+        }
+
+        list->timeout = tmq_elem;
+
+        if (list->have_last && (list->acquired_bytes >= list->flush_bytes)) {
+            if (tmq_elem)
+                tmq_delete(timeout_queue, tmq_elem);
+
+            fragstats.frag_reassembled++;
+            frag_list_reassembled(list, &packet, reassembled);
+            frag_list_destroy(list);
+        }
+        else if (frag_table_insert(&key, hash, list) < 0) {
+            if (tmq_elem)
+                tmq_delete(timeout_queue, tmq_elem);
+
+            frag_list_destroy(list);
+        }
+        else if (tmq_elem == NULL &&
+            (list->timeout = tmq_element_create(&key, sizeof key)) != NULL) {
+            list->timeout->hash = hash;
+            tmq_insert(timeout_queue, list->timeout);
+        }
+    }
+
+    if (packet)
+        packet_destroy(packet);
+
+    fraglist_hash_merge_stats(fragtable, tables->fragtable);
+
+    tmq_destroy(tables->timeout_queue);
+    fraglist_hash_destroy(tables->fragtable);
+    free(tables);
+}
+
 /* Frag Table Remove
  *
  * Remove a fragment list from the table
@@ -213,12 +455,13 @@ frag_table_finalize()
  *          0 on success
  */
 int
-frag_table_remove(struct frag_key *key, struct frag_list *list)
+frag_table_remove(const struct frag_key *key, uint32_t hash,
+    struct frag_list *list)
 {
     if(list == NULL)
         return -1;
 
-    hash_remove(fragtable, key, sizeof *key);
+    fraglist_hash_remove(fragtable, key, hash);
 
     frag_list_destroy(list);
 
@@ -235,25 +478,37 @@ frag_table_remove(struct frag_key *key, struct frag_list *list)
  *          NULL if no fragment lists are found
  */
 struct frag_list *
-frag_table_find(struct frag_key *key)
+frag_table_find(const struct frag_key *key, uint32_t hash)
 {
-    return hash_get(fragtable, key, sizeof *key);
+    return fraglist_hash_get(fragtable, key, hash);
 }
 
+/* Get Frag Tracker
+ *
+ * Find the frag list of key, or insert a new one in the same probe
+ *
+ * @return  a pointer to the list
+ *          NULL if the table is full or out of memory
+ */
 struct frag_list *
-frag_table_get(struct frag_key *key)
+frag_table_get(struct frag_key *key, uint32_t hash)
 {
-    struct frag_list *list;
+    struct frag_list **slot;
+    bool inserted;
 
-    if((list = frag_table_find(key)) == NULL) {
-        if((list = frag_list_create()) == NULL)
-            return NULL;
+    /* FragMaxMem may have changed on SIGHUP */
+    fraglist_hash_limit(fragtable, options.frag_max_mem);
 
-        else if((frag_table_insert(key, list) < 0))
-            return NULL;
+    slot = fraglist_hash_find_or_insert(fragtable, key, hash, &inserted);
+    if(slot == NULL)
+        return NULL;
+
+    if(inserted && (*slot = frag_list_create()) == NULL) {
+        fraglist_hash_remove(fragtable, key, hash);
+        return NULL;
     }
 
-    return list; 
+    return *slot; 
 }
 
 
@@ -266,9 +521,12 @@ frag_table_get(struct frag_key *key)
  *          Pointer to new fragment list
  */
 int
-frag_table_insert(struct frag_key *key, struct frag_list *list)
+frag_table_insert(struct frag_key *key, uint32_t hash, struct frag_list *list)
 {
-    if(hash_insert(fragtable, list, key, sizeof *key) < 0)
+    /* FragMaxMem may have changed on SIGHUP */
+    fraglist_hash_limit(fragtable, options.frag_max_mem);
+
+    if(fraglist_hash_insert(fragtable, list, key, hash) < 0)
         return -1;
 
     return 0;
@@ -352,6 +610,7 @@ frag_list_create()
     list->head = NULL;
     list->tail = NULL;
     list->packet_count = 0;
+    list->timeout = NULL;
 
     return list;
 }
@@ -478,7 +737,8 @@ frag_list_insert(struct frag_list *list, struct frag *frag)
  *
  * @param   list, fragment list containing the list to join.
  *
- * @return  pointer to reassembled data
+ * @return  pointer to reassembled data, valid until the next join on
+ *          this thread
  */
 uint8_t *
 frag_list_join(struct frag_list * list)
@@ -489,9 +749,16 @@ frag_list_join(struct frag_list * list)
     if(list == NULL || list->head == NULL)
         return NULL;
 
-    data = malloc(list->acquired_bytes);
-    if(data == NULL)
-        return NULL;
+    if(list->acquired_bytes > reassembly_size) {
+        data = realloc(reassembly, list->acquired_bytes);
+        if(data == NULL)
+            return NULL;
+
+        reassembly = data;
+        reassembly_size = list->acquired_bytes;
+    }
+
+    data = reassembly;
 
     for(it = list->head; it; it = it->next)
     {
@@ -1014,29 +1281,15 @@ frag_insert_solaris(struct frag_list *list, struct frag *frag)
 
 /* timeout_queue_callbacks */
 int
-_frag_timeout_queue_task(const void *p_key)
+_frag_timeout_queue_task(const struct tmq_element *elem)
 {
-    struct frag_list *list = frag_table_find((struct frag_key *)p_key);
+    struct frag_key *key = elem->key;
+    struct frag_list *list = frag_table_find(key, elem->hash);
 
     if(list == NULL)
         return -1;
 
-    return frag_table_remove((struct frag_key *)p_key, list);
-}
-
-int
-frag_key_compare(const void *p_key_1, const void *p_key_2)
-{
-    struct frag_key *key_1, *key_2; 
-    key_1 =(struct frag_key *)p_key_1;
-    key_2 =(struct frag_key *)p_key_2;
-
-    if ((ip_compare(&key_1->srcaddr, &key_2->srcaddr) == IP_EQUAL) &&
-        (ip_compare(&key_1->dstaddr, &key_2->dstaddr) == IP_EQUAL) &&
-        (key_1->id == key_2->id) && (key_1->protocol == key_2->protocol))
-        return 0;
-
-    return 1;
+    return frag_table_remove(key, elem->hash, list);
 }
 
 /* Defragment
@@ -1047,40 +1300,46 @@ frag_key_compare(const void *p_key_1, const void *p_key_2)
  * @param   p, Pointer to the decoded Packet structure
  *
  * @return  -1 on failure
- *          0 on success
+ *          0 on success, the reassembled payload set on p is good until
+ *          the next call on this thread
  */
 int
-defragment(Packet *p)
+defragment(struct packet_context *ctx)
 {
+    Packet *p = ctx->packet;
     int ret = -1;
 
-    /* Create a fragment key from the packet structure
+    frag_model_refresh();
+
+    /* Create a fragment key from the packet context
      */
     struct frag_key key;
-    memset(&key, 0, sizeof(key));
-    key.srcaddr = packet_srcaddr(p);
-    key.dstaddr = packet_dstaddr(p);
-    key.id = packet_id(p);
-    key.protocol = packet_protocol(p);
+    uint32_t hash = frag_key_from_context(&key, ctx);
 
     /* Lookup or create a new fragment list
      */
     struct frag_list *list;
-    if((list = frag_table_get(&key)) == NULL)
+    if((list = frag_table_get(&key, hash)) == NULL)
         return -1;
 
     list->packet_count++;
+    fragstats.frag_fragments++;
 
-    /* Create or locate an existing timeout queue element
-     * Requeue the element
+    if(ctx->frame) {
+        list->frame = ctx->frame;
+        list->frame_size = ctx->frame_size;
+    }
+
+    /* Requeue the list, its timeout queue element is created with it
      */
-    struct tmq_element *tmq_elem;
-    if((tmq_elem = tmq_find(timeout_queue, &key)) == NULL) {
-        tmq_elem = tmq_element_create(&key, sizeof(key));
-        tmq_insert(timeout_queue, tmq_elem);
+    if(list->timeout == NULL) {
+        if((list->timeout = tmq_element_create(&key, sizeof(key))) != NULL) {
+            list->timeout->hash = hash;
+            tmq_insert(timeout_queue, list->timeout);
+        }
     }
     else
-        tmq_bump(timeout_queue, tmq_elem);
+        tmq_bump(timeout_queue, list->timeout);
 
     /* Create a new fragment
      * Insert the fragment into the fragment list
@@ -1100,64 +1359,61 @@ defragment(Packet *p)
         const uint8_t *payload = frag_list_join(list);
         const uint32_t paysize = list->flush_bytes;
 
-        tmq_delete(timeout_queue, tmq_elem);
-
-        packet_set_payload(p, payload, paysize);
+        tmq_delete(timeout_queue, list->timeout);
+        list->timeout = NULL;
 
-        frag_table_remove(&key, list);
+        /* The payload belongs to this thread's reassembly buffer, it is
+         * good until the next call to defragment() */
+        if(payload) {
+            packet_set_payload(p, payload, paysize);
+            ret = 0;
+        }
 
-        ret = 0;
+        frag_table_remove(&key, hash, list);
+        fragstats.frag_reassembled++;
     }
 
-    /* If we are not using a threaded timer then check for
-     * timed out elements
+    /* Check for timed out elements, the table belongs to this thread
+     * so expiry has to happen here as well
      */
-#ifndef ENABLE_PTHREADS
     tmq_timeout(timeout_queue);
-#endif
 
     return ret;
 }
 
+/* Frag Model Refresh
+ * Follow the FragModel of the calling thread's options
+ */
+static void
+frag_model_refresh()
+{
+    if (options.frag_model == frag_model)
+        return;
+
+    for (size_t i = 0; i < sizeof frag_models / sizeof *frag_models; i++)
+        if (strcmp(options.frag_model, frag_models[i].name) == 0)
+            frag_insert_model = frag_models[i].insert;
+
+    frag_model = options.frag_model;
+}
+
 /* Set Defrag Method
  * The verification routine for readconf.c
+ *
+ * Return
+ * the canonical name of the method
+ * NULL on an unknown method
  */
-int
+const char *
 set_defrag_method(const char *value, const char *filename,
     unsigned linenum, int *error)
 {
-    if(strcasecmp(value, "first") == 0) {
-        frag_insert_model = &frag_insert_first;
-        return 0;
-    }
-    else if(strcasecmp(value, "last") == 0) {
-        frag_insert_model = &frag_insert_last;
-        return 0;
-    }
-    else if(strcasecmp(value, "linux") == 0) {
-        frag_insert_model = &frag_insert_linux;
-        return 0;
-    }
-    else if(strcasecmp(value, "bsd") == 0) {
-        frag_insert_model = &frag_insert_bsd;
-        return 0;
-    }
-    else if(strcasecmp(value, "bsd-right") == 0) {
-        frag_insert_model = &frag_insert_bsdright;
-        return 0;
-    }
-    else if(strcasecmp(value, "windows") == 0) {
-        frag_insert_model = &frag_insert_windows;
-        return 0;
-    }
-    else if(strcasecmp(value, "solaris") == 0) {
-        frag_insert_model = &frag_insert_solaris;
-        return 0;
-    }
-    else {
-        warn("Bad defrag method %s:%d", filename, linenum);
-        return -1;
-    }
+    for (size_t i = 0; i < sizeof frag_models / sizeof *frag_models; i++)
+        if (strcasecmp(value, frag_models[i].name) == 0)
+            return frag_models[i].name;
+
+    warn("Bad defrag method %s:%d", filename, linenum);
+    *error = -1;
 
-    return -1;
+    return NULL;
 }
@@ -34,19 +34,28 @@
 #include <stdbool.h>
 #include <packet.h>
 
+#include "stats.h"
+#include "packet-context.h"
+
 //#include "../ghthash/ght_hash_table.h"
 
 /* Public Interface */
 //int ip4_defrag (uint8_t * pkt, int len, Packet * p);
-int defragment(Packet *p);
+int defragment(struct packet_context *ctx);
 
 /* Setup functions */
-int set_defrag_method(const char *value, const char *filename,
+const char *set_defrag_method(const char *value, const char *filename,
     unsigned linenum, int *error);
 
 
 /* Frag Table Public Interface */
 int frag_table_init();
 int frag_table_finalize();
+void frag_table_stats(struct tracker_stats *stats);
+void frag_table_prefetch(struct packet_context *ctx);
+void *frag_table_export();
+/* Datagrams the merge completes are handed to reassembled */
+void frag_table_merge(void *tables,
+    void (*reassembled)(struct packet_context *ctx));
 
 #endif
@@ -51,20 +51,18 @@
 #include "readconf.h"
 
 #include "timequeue.h"
-#include "hashtable.h"
+#include "hashtable-typed.h"
 
 #include <packet.h>
 #include "tcp-state.h"
+#include "stats.h"
+#include "clock.h"
+#include "flow.h"
+#include "packet-context.h"
 
-extern Options options;
+static int _flow_timeout_queue_task(const struct tmq_element *elem);
 
-static Hash *flowtable;
-static struct tmq *timeout_queue;
-
-static int _flow_timeout_queue_task(const void *key);
-int flow_key_compare(const void *k1, const void *k2);
-
-static struct flow_stats
+static __thread struct flow_stats
 {
     float avg_rtt;
     float min_rtt;
@@ -95,191 +93,258 @@ typedef struct
     uint32_t cwr_count;
     struct timeval time_start;
     struct timeval time_end;
+
+    struct tmq_element *timeout;    /* in the timeout queue */
     
     uint8_t     __padding__[1];
 } FlowTracker;
 
-typedef struct
+/* Flows are keyed on the conversation of their packets */
+typedef struct packet_key FlowKey;
+
+HASH_TABLE_DECLARE(flow_hash, FlowKey, FlowTracker);
+
+/* Each analysis thread has its own table */
+static __thread flow_hash *flowtable;
+static __thread struct tmq *timeout_queue;
+
+/* Table detached by flow_table_export */
+struct flow_tables
 {
-    struct ipaddr srcaddr;
-    struct ipaddr dstaddr;
-    uint8_t     protocol;
-    uint16_t    srcport;
-    uint16_t    dstport;
-    uint8_t     padding[1];
-} FlowKey;
+    flow_hash *table;
+    struct tmq *timeout_queue;
+};
 
-int flow_remove(FlowKey *key);
+int flow_remove(const FlowKey *key);
 
 int
 flow_table_init( )
 {
-    flowtable = hash_create(options.flow_max_mem);
+    flowtable = flow_hash_create(options.flow_max_mem);
     if (flowtable == NULL)
         return -1;
 
     timeout_queue = tmq_create(options.flow_age_limit);
     if (timeout_queue == NULL) {
-        free(flowtable);
+        flow_hash_destroy(flowtable);
         return -1;
     }
 
-    timeout_queue->compare = flow_key_compare;
     timeout_queue->task = _flow_timeout_queue_task;
 
-#ifdef ENABLE_PTHREADS
-    tmq_start(timeout_queue);
-#endif
-
     return 0;
 }
 
 void
 flow_table_finalize( )
 {
-    assert(flowtable);
-
     FlowTracker *it;
     unsigned i;
-    const void *key;
+    const FlowKey *key;
 
-#ifdef ENABLE_PTHREADS
-    tmq_stop(timeout_queue);
-#endif
-    tmq_destroy(timeout_queue);
+    /* Already handed to another thread */
+    if (flowtable == NULL)
+        return;
 
+    for (it = flow_hash_first(flowtable, &i, &key); it;
+         it = flow_hash_next(flowtable, &i, &key))
+        flow_remove(key);
+
+    tmq_destroy(timeout_queue);
     timeout_queue = NULL;
 
-    for (it = hash_first(flowtable, &i, &key); it;
-         it = hash_next(flowtable, &i, &key))
-        flow_remove((FlowKey*)key);
+    flow_hash_destroy(flowtable);
+    flowtable = NULL;
+}
 
-    hash_destroy(flowtable);
+void
+flow_table_stats(struct tracker_stats *stats)
+{
+    stats->flows += flowstats.total_flows;
+
+    if (flowtable)
+        flow_hash_stats(flowtable, &stats->flow_table);
 }
 
-FlowTracker *
-flow_get(FlowKey *key)
+/* Flow Table Export
+ *
+ * Detach the table of the calling thread, to be merged by another one
+ */
+void *
+flow_table_export( )
 {
-    assert(flowtable);
-    assert(key);
+    struct flow_tables *tables;
+
+    if ((tables = malloc(sizeof *tables)) == NULL)
+        return NULL;
+
+    tables->table = flowtable;
+    tables->timeout_queue = timeout_queue;
+
+    flowtable = NULL;
+    timeout_queue = NULL;
+
+    return tables;
+}
+
+/* Flow Table Merge
+ *
+ * Fold the detached table of an earlier part of the capture into this
+ * thread's table. A flow seen by both parts is counted once, with the
+ * packets of both.
+ */
+void
+flow_table_merge(void *p_tables)
+{
+    struct flow_tables *tables = p_tables;
+    FlowTracker *it, *mine;
+    struct timeval last;
+    FlowKey key;
+    uint32_t hash;
+    unsigned i;
+    const FlowKey *p_key;
+
+    if (tables == NULL)
+        return;
 
-    struct tmq_element *tmq_elem;
-    if ((tmq_elem = tmq_find(timeout_queue, &key))) {
-        tmq_bump(timeout_queue, tmq_elem);
+    for (it = flow_hash_first(tables->table, &i, &p_key); it;
+         it = flow_hash_next(tables->table, &i, &p_key)) {
+        memcpy(&key, p_key, sizeof key);
+        hash = flow_hash_digest(&key);
+        flow_hash_remove(tables->table, &key, hash);
+
+        /* Its element goes with the earlier queue */
+        if (it->timeout)
+            last = it->timeout->time;
+        else
+            clock_now(&last);
+
+        it->timeout = NULL;
+
+        if ((mine = flow_hash_get(flowtable, &key, hash)) != NULL) {
+            mine->octet_count += it->octet_count;
+            mine->packet_count += it->packet_count;
+
+            /* The earlier part saw its first packet */
+            mine->version = it->version;
+            mine->srcaddr = it->srcaddr;
+            mine->dstaddr = it->dstaddr;
+            mine->srcport = it->srcport;
+            mine->dstport = it->dstport;
+            flowstats.total_flows--;
+            free(it);
+            continue;
+        }
+
+        if (flow_hash_insert(flowtable, it, &key, hash) < 0) {
+            free(it);
+            continue;
+        }
+
+        /* Queued from the time it was last seen */
+        if ((it->timeout = tmq_element_create(&key, sizeof key)) != NULL) {
+            it->timeout->hash = hash;
+            tmq_schedule(timeout_queue, it->timeout, &last,
+                timeout_queue->timeout);
+        }
     }
 
-    return (FlowTracker *)hash_get(flowtable, key, sizeof *key);
+    flow_hash_merge_stats(flowtable, tables->table);
+
+    tmq_destroy(tables->timeout_queue);
+    flow_hash_destroy(tables->table);
+    free(tables);
 }
 
-int
-flow_key_compare(const void *k1, const void *k2)
+/* Flow Table Prefetch
+ *
+ * Start loading the entry of the packet's flow
+ */
+void
+flow_table_prefetch(struct packet_context *ctx)
 {
-    return memcmp(k1, k2, sizeof(FlowKey));
+    flow_hash_prefetch(flowtable, ctx->hash);
 }
 
-int
-flow_remove(FlowKey *key)
+/* Flow Get
+ *
+ * Find the flow of key, or start tracking a new one.
+ *
+ * @return  the flow, *created set if it is new
+ *          NULL if the table is full or out of memory
+ */
+FlowTracker *
+flow_get(FlowKey *key, uint32_t hash, bool *created)
 {
     assert(flowtable);
     assert(key);
 
-    struct tmq_element *tmq_elem = tmq_find(timeout_queue, &key);
-    if (tmq_elem)
-        tmq_delete(timeout_queue, tmq_elem);
-    
-    free(hash_remove(flowtable, key, sizeof *key));
+    FlowTracker *flow, **slot;
 
-    return 0;
+    /* FlowMaxMem may have changed on SIGHUP */
+    flow_hash_limit(flowtable, options.flow_max_mem);
+
+    slot = flow_hash_find_or_insert(flowtable, key, hash, created);
+    if (slot == NULL)
+        return NULL;
+
+    if (!*created) {
+        tmq_bump(timeout_queue, (*slot)->timeout);
+        return *slot;
+    }
+
+    if ((flow = *slot = calloc(1, sizeof(FlowTracker))) == NULL) {
+        warn("could not allocate flow data");
+        flow_hash_remove(flowtable, key, hash);
+        return NULL;
+    }
+
+    if ((flow->timeout = tmq_element_create(key, sizeof *key)) != NULL) {
+        flow->timeout->hash = hash;
+        tmq_insert(timeout_queue, flow->timeout);
+    }
+
+    return flow;
 }
 
 int
-flow_insert(FlowKey *key, FlowTracker *data)
+flow_remove(const FlowKey *key)
 {
     assert(flowtable);
     assert(key);
 
-    struct tmq_element *tmq_elem =
-        tmq_element_create(&key, sizeof key);
-    tmq_insert(timeout_queue, tmq_elem);
+    FlowTracker *flow = flow_hash_remove(flowtable, key,
+        flow_hash_digest(key));
 
-    return hash_insert(flowtable, data, key, sizeof *key);
-}
+    if (flow == NULL)
+        return -1;
 
-int
-_flow_timeout_queue_task(const void *key)
-{
-    free(hash_remove(flowtable, key, sizeof(FlowKey)));
+    tmq_delete(timeout_queue, flow->timeout);
+    free(flow);
 
     return 0;
 }
 
-static int track_tcp_flow(Packet *p)
+int
+_flow_timeout_queue_task(const struct tmq_element *elem)
 {
-    FlowKey flowkey; 
-    int state = 0;
-    memset(&flowkey, 0, sizeof flowkey);
-
-    flowkey.srcaddr = packet_srcaddr(p);
-    flowkey.dstaddr = packet_dstaddr(p);
-    flowkey.protocol = packet_protocol(p); 
-    flowkey.srcport = packet_srcport(p);
-    flowkey.dstport = packet_dstport(p);
-
-    if (ip_compare(&flowkey.srcaddr, &flowkey.dstaddr) == IP_LESSER)
-    {
-        flowkey.srcaddr = packet_dstaddr(p);
-        flowkey.dstaddr = packet_srcaddr(p);
-        flowkey.srcport = packet_dstport(p);
-        flowkey.dstport = packet_srcport(p);
-    }
-
-    FlowTracker *flow = flow_get(&flowkey);
-    if (flow == NULL) {
-        if ((flow = calloc(1, sizeof *flow)) == NULL) {
-            warn("could not allocate flow data");
-            return -1;
-        }
-        flow_insert(&flowkey, flow);
-        memset(flow, 0, sizeof *flow);
-    }
-
-    flow->octet_count += packet_paysize(p);
-
-    flow->packet_count++;
+    free(flow_hash_remove(flowtable, elem->key, elem->hash));
 
     return 0;
 }
 
 int
-track_packet_flow(Packet *p)
+track_packet_flow(struct packet_context *ctx)
 {
-    FlowKey flowkey; 
-    memset(&flowkey, 0, sizeof flowkey);
-
-    flowkey.srcaddr = packet_srcaddr(p);
-    flowkey.dstaddr = packet_dstaddr(p);
-    flowkey.protocol = packet_protocol(p); 
-    flowkey.srcport = packet_srcport(p);
-    flowkey.dstport = packet_dstport(p);
-
-    /* if source address is numerically smaller use the
-     * destination as the primary keying address */
-    if (ip_compare(&flowkey.srcaddr, &flowkey.dstaddr) == IP_LESSER)
-    {
-        flowkey.srcaddr = packet_dstaddr(p);
-        flowkey.dstaddr = packet_srcaddr(p);
-        flowkey.srcport = packet_dstport(p);
-        flowkey.dstport = packet_srcport(p);
-    }
+    Packet *p = ctx->packet;
+    bool created;
 
-    FlowTracker *flow = flow_get(&flowkey);
-    if (flow == NULL) {
-        if ((flow = calloc(1, sizeof *flow)) == NULL) {
-            warn("could not allocate flow data");
-            return -1;
-        }
-        flow_insert(&flowkey, flow);
-        memset(flow, 0, sizeof *flow);
+    FlowTracker *flow = flow_get(&ctx->key, ctx->hash, &created);
+    if (flow == NULL)
+        return -1;
+
+    if (created) {
+        flowstats.total_flows++;
 
         flow->version = packet_version(p);
         flow->srcaddr = packet_srcaddr(p);
@@ -332,9 +397,7 @@ track_packet_flow(Packet *p)
     }
 #endif /* DEBUG */
 
-#ifndef ENABLE_PTHREADS
     tmq_timeout(timeout_queue);
-#endif
 
     return 0;
 }
@@ -27,9 +27,22 @@
  * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
  * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
+#include "stats.h"
+#include "packet-context.h"
+
 int flow_table_init( );
 
 void flow_table_finalize( );
 
-int track_packet_flow(Packet *p);
+void flow_table_stats(struct tracker_stats *stats);
+
+/* Detach the table of the calling thread, and fold a detached table into
+ * the calling thread's own */
+void *flow_table_export( );
+
+void flow_table_merge(void *tables);
+
+void flow_table_prefetch(struct packet_context *ctx);
+
+int track_packet_flow(struct packet_context *ctx);
 
@@ -1,14 +1,38 @@
+#include <config.h>
+
 #include <sys/types.h>
 #include "hashdigest.h"
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#ifdef HAVE_GETRANDOM
+#include <sys/random.h>
+#endif
 
 static int seed;
 
-void digest_init(unsigned buckets)
+static uint32_t digest_select(const void *buf, size_t len);
+
+/* Key digest picked for this CPU on first use */
+static uint32_t (*digest)(const void *buf, size_t len) = digest_select;
+static pthread_once_t selected = PTHREAD_ONCE_INIT;
+
+static DigestMode mode = DIGEST_FAST;
+
+/* SipHash key of the keyed mode */
+static uint64_t sipkey[2];
+
+/* Every table and the dispatcher share the seed, it is picked by the main
+ * thread before any other thread starts and never changes after. */
+void digest_init(void)
 {
     srand(time(0));
-    seed = (rand() * rand() % buckets);
+    seed = rand();
 }
 
 unsigned long fnv1a_digest(const void *buf, size_t len, unsigned long hval)
@@ -24,3 +48,196 @@ unsigned long fnv1a_digest(const void *buf, size_t len, unsigned long hval)
 
     return hval + seed;
 }
+
+/* Odd constant of the golden ratio, spreads the low bits of a product into
+ * the high ones */
+#define GOLDEN 0x9e3779b97f4a7c15ULL
+
+/*
+ * mix_digest
+ *
+ * Portable digest taking a key eight bytes at a time, each word is folded
+ * in with a multiply.
+ */
+static uint32_t mix_digest(const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    uint64_t hval = (uint64_t)seed ^ (len * GOLDEN);
+    uint64_t word;
+    uint32_t half;
+
+    for (; len >= 8; p += 8, len -= 8) {
+        memcpy(&word, p, 8);
+        hval = (hval ^ word) * GOLDEN;
+        hval ^= hval >> 32;
+    }
+
+    if (len >= 4) {
+        memcpy(&half, p, 4);
+        hval = (hval ^ half) * GOLDEN;
+        hval ^= hval >> 32;
+        p += 4;
+        len -= 4;
+    }
+
+    while (len--)
+        hval = (hval ^ *p++) * GOLDEN;
+
+    hval ^= hval >> 29;
+    hval *= 0xbf58476d1ce4e5b9ULL;
+    hval ^= hval >> 32;
+
+    return (uint32_t)hval;
+}
+
+#define ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND \
+    do { \
+        v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+        v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+        v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+        v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+    } while (0)
+
+/*
+ * siphash_digest
+ *
+ * SipHash-1-3 of the key under sipkey. Without the key nobody can tell
+ * which keys collide, however the traffic is crafted. Words are read in
+ * host order, digests are never stored or compared across hosts.
+ */
+static uint32_t siphash_digest(const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    uint64_t v0 = sipkey[0] ^ 0x736f6d6570736575ULL;
+    uint64_t v1 = sipkey[1] ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = sipkey[0] ^ 0x6c7967656e657261ULL;
+    uint64_t v3 = sipkey[1] ^ 0x7465646279746573ULL;
+    uint64_t last = (uint64_t)len << 56;
+    uint64_t word;
+
+    for (; len >= 8; p += 8, len -= 8) {
+        memcpy(&word, p, 8);
+        v3 ^= word;
+        SIPROUND;
+        v0 ^= word;
+    }
+
+    for (size_t i = 0; i < len; i++)
+        last |= (uint64_t)p[i] << (8 * i);
+
+    v3 ^= last;
+    SIPROUND;
+    v0 ^= last;
+
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+
+    word = v0 ^ v1 ^ v2 ^ v3;
+
+    return (uint32_t)(word ^ word >> 32);
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+
+/*
+ * crc32c_digest
+ *
+ * CRC32C of the key with the SSE4.2 crc32 instruction, a cycle or so per
+ * eight bytes. A CRC is linear in its input, the multiply at the end puts
+ * every input bit into the high bits that pick tags and buckets.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_digest(const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    uint64_t crc = (uint32_t)seed;
+    uint64_t word;
+    uint32_t half;
+
+    for (; len >= 8; p += 8, len -= 8) {
+        memcpy(&word, p, 8);
+        crc = __builtin_ia32_crc32di(crc, word);
+    }
+
+    if (len >= 4) {
+        memcpy(&half, p, 4);
+        crc = __builtin_ia32_crc32si((uint32_t)crc, half);
+        p += 4;
+        len -= 4;
+    }
+
+    while (len--)
+        crc = __builtin_ia32_crc32qi((uint32_t)crc, *p++);
+
+    return (uint32_t)((crc * GOLDEN) >> 32);
+}
+
+static void digest_pick(void)
+{
+    __builtin_cpu_init();
+
+    if (mode == DIGEST_KEYED)
+        __atomic_store_n(&digest, siphash_digest, __ATOMIC_RELEASE);
+    else if (__builtin_cpu_supports("sse4.2"))
+        __atomic_store_n(&digest, crc32c_digest, __ATOMIC_RELEASE);
+    else
+        __atomic_store_n(&digest, mix_digest, __ATOMIC_RELEASE);
+}
+
+#else
+
+static void digest_pick(void)
+{
+    __atomic_store_n(&digest, mode == DIGEST_KEYED ? siphash_digest :
+        mix_digest, __ATOMIC_RELEASE);
+}
+
+#endif
+
+static uint32_t digest_select(const void *buf, size_t len)
+{
+    pthread_once(&selected, digest_pick);
+
+    return digest(buf, len);
+}
+
+uint32_t key_digest(const void *buf, size_t len)
+{
+    return __atomic_load_n(&digest, __ATOMIC_ACQUIRE)(buf, len);
+}
+
+/*
+ * digest_random
+ *
+ * Fill buf with random bytes from the kernel.
+ */
+static int digest_random(void *buf, size_t len)
+{
+#ifdef HAVE_GETRANDOM
+    if (getrandom(buf, len, 0) == (ssize_t)len)
+        return 0;
+#endif
+    int fd = open("/dev/urandom", O_RDONLY);
+
+    if (fd < 0)
+        return -1;
+
+    ssize_t got = read(fd, buf, len);
+    close(fd);
+
+    return got == (ssize_t)len ? 0 : -1;
+}
+
+int digest_set_mode(DigestMode newmode)
+{
+    if (newmode == DIGEST_KEYED && digest_random(sipkey, sizeof sipkey) < 0)
+        return -1;
+
+    mode = newmode;
+
+    return 0;
+}
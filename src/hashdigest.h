@@ -6,7 +6,32 @@
 //  Copyright (c) 2012 Victor J. Roemer. All rights reserved.
 //
 //
+#ifndef hashdigest_h
+#define hashdigest_h
+
 #include <sys/types.h>
+#include <stdint.h>
+
+/* How keys of the tables are digested */
+typedef enum {
+    DIGEST_FAST,    /* CRC32C or a multiply mix, collisions can be forged */
+    DIGEST_KEYED    /* SipHash-1-3 under a random key, for hostile traffic */
+} DigestMode;
 
-void digest_init(unsigned buckets);
+/* Seed the digests, once before any thread creates a table */
+void digest_init(void);
 unsigned long fnv1a_digest(const void *buf, size_t len, unsigned long hval);
+
+/* Digest of a fixed size key, taken a word at a time. In the fast mode
+ * CRC32C where the CPU has SSE4.2, a multiply mix otherwise. */
+uint32_t key_digest(const void *buf, size_t len);
+
+/* Pick how keys are digested, before the first key is. The keyed mode
+ * draws its key from the kernel.
+ *
+ * @return  -1 if no key could be read
+ *          0 on success
+ */
+int digest_set_mode(DigestMode mode);
+
+#endif /* hashdigest_h */
@@ -0,0 +1,647 @@
+/* Copyright (c) 2012, Victor J Roemer. All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * 3. The name of the author may not be used to endorse or promote
+ * products derived from this software without specific prior written
+ * permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+//
+//  hashtable-impl.h
+//  pcapstats
+//
+//  Layout of a table and the probes over it, shared by hashtable.c and the
+//  typed tables of hashtable-typed.h. Every probe takes the key and entry
+//  size as arguments and is always inlined: hashtable.c passes the sizes
+//  the table was created with, a typed table passes constants, and the
+//  compiler turns its key compares and copies into a few fixed width
+//  loads and stores.
+//
+//  Nothing but those two should include this file.
+//
+
+#ifndef hashtable_impl_h
+#define hashtable_impl_h
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "hashtable.h"
+#include "cdefs.h"
+
+#define HASH_INLINE static inline __attribute__((always_inline))
+
+#define CACHELINE 64
+
+/* Reserved values of the cached hash. Only the old array of a resize
+ * holds deleted entries. */
+#define HASH_EMPTY      0
+#define HASH_DELETED    1
+#define HASH_MIN        2
+
+/* Smallest array a table shrinks to */
+#define HASH_MIN_BUCKETS 1024
+
+/* Buckets whose tags are compared at once. The tags of the first group are
+ * repeated past the end of the array so a group never wraps. */
+#define HASH_GROUP 16
+
+/* Tag of an empty bucket, those of entries have the top bit set */
+#define TAG_EMPTY 0
+#define TAG(hash) ((uint8_t)(0x80 | (hash) >> 25))
+
+/* Old buckets moved to the resized array by every insert and lookup. After
+ * growing, two are enough to finish before the resized array is due to
+ * grow again. Four is headroom for shrinks: the old array is then twice
+ * the size of the new one, which starts at 1/8 load, and the inserts that
+ * take it to 3/4 load number only a quarter of the old buckets. */
+#define HASH_MIGRATE_STEP 4
+
+typedef struct
+{
+    void *value;
+    uint32_t hash;
+    /* Position of the entry in the live index */
+    uint32_t live;
+    uint8_t key __flexarr;
+} Entry;
+
+/* Entries are rounded up so that they never straddle two cache lines: to
+ * a power of two up to a line, to whole lines past it. A constant for a
+ * constant keysize. */
+#define HASH_ENTRY_SIZE(keysize) \
+    (sizeof(Entry) + (keysize) <= 16 ? 16 : \
+     sizeof(Entry) + (keysize) <= 32 ? 32 : \
+     sizeof(Entry) + (keysize) <= CACHELINE ? CACHELINE : \
+     (sizeof(Entry) + (keysize) + CACHELINE - 1) & ~(size_t)(CACHELINE - 1))
+
+typedef struct
+{
+    uint8_t *entries;
+    uint8_t *tags;
+    /* Buckets of the first count entries, in no particular order */
+    uint32_t *index;
+    size_t count;
+    size_t buckets;
+    size_t mask;
+    size_t bytes;
+} Array;
+
+struct _Hash
+{
+    size_t size;
+
+    size_t keysize;
+    size_t entrysize;
+
+    /* Growth limit as asked for, and rounded to a power of two */
+    size_t limit;
+    size_t max_buckets;
+
+    Array table;
+
+    /* Array being emptied into table while resizing. Buckets before
+     * migrated have been moved, the first released bytes are unmapped. */
+    Array old;
+    size_t migrated;
+    size_t released;
+
+    /* Counted by the probes, a table is only used by one thread */
+    struct hash_stats stats;
+};
+
+#define ENTRY(array, idx, entrysize) \
+    ((Entry *)((array)->entries + (idx) * (entrysize)))
+
+/* The rare parts of resizing, in hashtable.c */
+int hash_resize(Hash *this, size_t buckets);
+void hash_migrate(Hash *this, size_t count);
+
+/*
+ * cached_hash
+ *
+ * Hash cached for a key digest, staying clear of the reserved values.
+ */
+HASH_INLINE uint32_t cached_hash(uint32_t digest)
+{
+    return digest < HASH_MIN ? digest + HASH_MIN : digest;
+}
+
+HASH_INLINE void array_set_tag(Array *array, size_t idx, uint8_t tag)
+{
+    array->tags[idx] = tag;
+
+    if (idx < HASH_GROUP)
+        array->tags[array->buckets + idx] = tag;
+}
+
+/*
+ * index_add
+ *
+ * Add the entry in bucket idx to the live index.
+ */
+HASH_INLINE void index_add(Array *array, size_t idx, size_t entrysize)
+{
+    ENTRY(array, idx, entrysize)->live = array->count;
+    array->index[array->count++] = idx;
+}
+
+/*
+ * index_move
+ *
+ * The entry now in bucket to was moved there, point its place in the live
+ * index at it.
+ */
+HASH_INLINE void index_move(Array *array, size_t to, size_t entrysize)
+{
+    array->index[ENTRY(array, to, entrysize)->live] = to;
+}
+
+/*
+ * index_remove
+ *
+ * Take the entry in bucket idx out of the live index. The last entry of
+ * the index takes its place.
+ */
+HASH_INLINE void index_remove(Array *array, size_t idx, size_t entrysize)
+{
+    uint32_t live = ENTRY(array, idx, entrysize)->live;
+    size_t last = array->index[--array->count];
+
+    array->index[live] = last;
+    ENTRY(array, last, entrysize)->live = live;
+}
+
+/*
+ * group_match
+ *
+ * Bit masks of the buckets in the group starting at tags whose tag is tag,
+ * and of those that are empty.
+ */
+HASH_INLINE void group_match(const uint8_t *tags, uint8_t tag,
+    unsigned *match, unsigned *empty)
+{
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i *)tags);
+
+    *match = _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(tag)));
+    *empty = ~_mm_movemask_epi8(group) & 0xffff;
+#else
+    *match = *empty = 0;
+
+    for (unsigned i = 0; i < HASH_GROUP; i++) {
+        *match |= (unsigned)(tags[i] == tag) << i;
+        *empty |= (unsigned)(tags[i] == TAG_EMPTY) << i;
+    }
+#endif
+}
+
+/*
+ * distance
+ *
+ * How far the entry in bucket idx is from its home bucket.
+ */
+HASH_INLINE size_t distance(Array *array, size_t idx, size_t entrysize)
+{
+    return (idx - ENTRY(array, idx, entrysize)->hash) & array->mask;
+}
+
+/*
+ * stats_probe
+ *
+ * Count a lookup that went probe buckets past the home of its key.
+ */
+HASH_INLINE void stats_probe(Hash *this, size_t probe, bool hit)
+{
+    struct hash_stats *stats = &this->stats;
+    unsigned bin = probe ? 64 - __builtin_clzll(probe) : 0;
+
+    stats->lookups++;
+    stats->hits += hit;
+    stats->probes[bin < HASH_PROBE_BINS ? bin : HASH_PROBE_BINS - 1]++;
+
+    if (probe > stats->max_probe)
+        stats->max_probe = probe;
+}
+
+/*
+ * table_find
+ *
+ * Entry of the table holding key, NULL if there is none. A key is always
+ * between its home and the next empty bucket, only the entries in between
+ * whose tag matches are compared. Sets probe to how far past its home the
+ * key was found or found missing.
+ */
+HASH_INLINE Entry *table_find(Hash *this, const void *key, uint32_t hash,
+    size_t *probe, size_t keysize, size_t entrysize)
+{
+    Array *array = &this->table;
+    size_t idx = hash & array->mask;
+    unsigned match, empty;
+
+    for (size_t i = 0; i < array->buckets; i += HASH_GROUP) {
+        group_match(array->tags + idx, TAG(hash), &match, &empty);
+
+        /* Past the first empty bucket nothing belongs to this run */
+        if (empty)
+            match &= (empty & -empty) - 1;
+
+        while (match) {
+            Entry *entry = ENTRY(array,
+                (idx + __builtin_ctz(match)) & array->mask, entrysize);
+
+            if (entry->hash == hash &&
+                memcmp(key, entry->key, keysize) == 0) {
+                *probe = i + __builtin_ctz(match);
+                return entry;
+            }
+
+            match &= match - 1;
+        }
+
+        if (empty) {
+            *probe = i + __builtin_ctz(empty);
+            return NULL;
+        }
+
+        idx = (idx + HASH_GROUP) & array->mask;
+    }
+
+    *probe = array->buckets;
+
+    return NULL;
+}
+
+/*
+ * array_find
+ *
+ * Entry of the old array holding key, NULL if there is none. Buckets before
+ * start have been moved and are skipped. The old array may hold deleted
+ * entries, a probe goes on to an empty bucket.
+ */
+HASH_INLINE Entry *array_find(Array *array, const void *key, uint32_t hash,
+    size_t start, size_t keysize, size_t entrysize)
+{
+    size_t idx = hash & array->mask;
+
+    for (size_t i = 0; i < array->buckets; i++) {
+        if (idx < start) {
+            i += start - idx - 1;
+            idx = start;
+            continue;
+        }
+
+        Entry *entry = ENTRY(array, idx, entrysize);
+
+        if (entry->hash == HASH_EMPTY)
+            return NULL;
+
+        if (entry->hash == hash &&
+            memcmp(key, entry->key, keysize) == 0)
+            return entry;
+
+        idx = (idx + 1) & array->mask;
+    }
+
+    return NULL;
+}
+
+/*
+ * table_probe
+ *
+ * Entry of the table holding key, or NULL, and the bucket of that entry or
+ * the one an entry for it would be placed in. Both are found by the same
+ * walk: a key is never past the first entry closer to its home, and that
+ * is where it goes. Sets probe to the length of the walk.
+ */
+HASH_INLINE Entry *table_probe(Hash *this, const void *key, uint32_t hash,
+    size_t *place, size_t *probe, size_t keysize, size_t entrysize)
+{
+    Array *array = &this->table;
+    size_t idx = hash & array->mask;
+    size_t dist = 0;
+
+    while (array->tags[idx] != TAG_EMPTY) {
+        Entry *entry = ENTRY(array, idx, entrysize);
+
+        if (array->tags[idx] == TAG(hash) && entry->hash == hash &&
+            memcmp(key, entry->key, keysize) == 0) {
+            *place = idx;
+            *probe = dist;
+            return entry;
+        }
+
+        if (distance(array, idx, entrysize) < dist)
+            break;
+
+        idx = (idx + 1) & array->mask;
+        dist++;
+    }
+
+    *place = idx;
+    *probe = dist;
+
+    return NULL;
+}
+
+/*
+ * hash_place_at
+ *
+ * Put an entry with hash in bucket idx of the table. The entry there and
+ * the rest of its run move up a bucket. The table always has an empty
+ * bucket.
+ */
+HASH_INLINE Entry *hash_place_at(Hash *this, size_t idx, uint32_t hash,
+    size_t entrysize)
+{
+    Array *array = &this->table;
+    size_t end;
+
+    for (end = idx; array->tags[end] != TAG_EMPTY;)
+        end = (end + 1) & array->mask;
+
+    while (end != idx) {
+        size_t prev = (end - 1) & array->mask;
+        memcpy(ENTRY(array, end, entrysize), ENTRY(array, prev, entrysize),
+            entrysize);
+        array_set_tag(array, end, array->tags[prev]);
+        index_move(array, end, entrysize);
+        end = prev;
+    }
+
+    ENTRY(array, idx, entrysize)->hash = hash;
+    array_set_tag(array, idx, TAG(hash));
+    index_add(array, idx, entrysize);
+
+    return ENTRY(array, idx, entrysize);
+}
+
+/*
+ * hash_place
+ *
+ * Make room for an entry with hash in the table, ahead of the first entry
+ * closer to its home.
+ */
+HASH_INLINE Entry *hash_place(Hash *this, uint32_t hash, size_t entrysize)
+{
+    Array *array = &this->table;
+    size_t idx = hash & array->mask;
+    size_t dist = 0;
+
+    while (array->tags[idx] != TAG_EMPTY &&
+        distance(array, idx, entrysize) >= dist) {
+        idx = (idx + 1) & array->mask;
+        dist++;
+    }
+
+    return hash_place_at(this, idx, hash, entrysize);
+}
+
+/*
+ * hash_step
+ *
+ * Move a few buckets of a resize along, if there is one.
+ */
+HASH_INLINE void hash_step(Hash *this, size_t count)
+{
+    if (this->old.entries)
+        hash_migrate(this, count);
+}
+
+/*
+ * hash_balance
+ *
+ * Keep the load of the table between 1/8 and 3/4, and within its limit.
+ */
+HASH_INLINE void hash_balance(Hash *this)
+{
+    size_t buckets = this->table.buckets;
+
+    /* One resize at a time, the last one is well done before the load
+     * can call for another */
+    if (this->old.entries)
+        return;
+
+    if ((this->size + 1) * 4 > buckets * 3 && buckets < this->max_buckets)
+        hash_resize(this, buckets * 2);
+
+    else if (buckets > HASH_MIN_BUCKETS && this->size * 4 < buckets / 2 * 3 &&
+        (this->size * 8 < buckets || buckets > this->max_buckets))
+        hash_resize(this, buckets / 2);
+}
+
+/*
+ * hash_full
+ *
+ * A table at its limit stops short of filling up, keeping at least one
+ * bucket empty.
+ */
+HASH_INLINE bool hash_full(Hash *this)
+{
+    size_t capacity = this->table.buckets < this->max_buckets ?
+        this->table.buckets : this->max_buckets;
+
+    return this->size >= capacity - (capacity + 7) / 8;
+}
+
+/*
+ * hash_find
+ *
+ * Entry holding key in either array, NULL if there is none.
+ */
+HASH_INLINE Entry *hash_find(Hash *this, const void *key, uint32_t hash,
+    Array **array, size_t keysize, size_t entrysize)
+{
+    Entry *entry;
+    size_t probe;
+
+    *array = &this->table;
+    entry = table_find(this, key, hash, &probe, keysize, entrysize);
+
+    if (entry == NULL && this->old.entries != NULL) {
+        *array = &this->old;
+        entry = array_find(*array, key, hash, this->migrated, keysize,
+            entrysize);
+    }
+
+    stats_probe(this, probe, entry != NULL);
+
+    return entry;
+}
+
+/*
+ * hash_lookup
+ *
+ * Value of key, NULL if it is not in the table.
+ */
+HASH_INLINE void *hash_lookup(Hash *this, const void *key, uint32_t hash,
+    size_t keysize, size_t entrysize)
+{
+    Array *array;
+    Entry *entry;
+
+    hash_step(this, HASH_MIGRATE_STEP);
+
+    entry = hash_find(this, key, hash, &array, keysize, entrysize);
+
+    return entry ? entry->value : NULL;
+}
+
+/*
+ * hash_add
+ *
+ * Insert a key/value pair.
+ */
+HASH_INLINE int hash_add(Hash *this, void *value, const void *key,
+    uint32_t hash, size_t keysize, size_t entrysize)
+{
+    hash_balance(this);
+    hash_step(this, HASH_MIGRATE_STEP);
+
+    if (hash_full(this)) {
+        this->stats.failed_inserts++;
+        return -1;
+    }
+
+    Entry *entry = hash_place(this, hash, entrysize);
+
+    entry->value = value;
+    memcpy(entry->key, key, keysize);
+    this->size++;
+
+    return 0;
+}
+
+/*
+ * hash_upsert
+ *
+ * Entry holding key, placed with a NULL value where the probe for it
+ * stopped if there is none.
+ */
+HASH_INLINE Entry *hash_upsert(Hash *this, const void *key, uint32_t hash,
+    bool *inserted, size_t keysize, size_t entrysize)
+{
+    Entry *entry;
+    size_t place, probe;
+
+    hash_balance(this);
+    hash_step(this, HASH_MIGRATE_STEP);
+
+    *inserted = false;
+
+    entry = table_probe(this, key, hash, &place, &probe, keysize, entrysize);
+
+    /* Not moved to the table yet */
+    if (entry == NULL && this->old.entries)
+        entry = array_find(&this->old, key, hash, this->migrated, keysize,
+            entrysize);
+
+    stats_probe(this, probe, entry != NULL);
+
+    if (entry != NULL)
+        return entry;
+
+    if (hash_full(this)) {
+        this->stats.failed_inserts++;
+        return NULL;
+    }
+
+    entry = hash_place_at(this, place, hash, entrysize);
+    entry->value = NULL;
+    memcpy(entry->key, key, keysize);
+    this->size++;
+    *inserted = true;
+
+    return entry;
+}
+
+/*
+ * hash_delete
+ *
+ * Remove key from the table and return its value.
+ */
+HASH_INLINE void *hash_delete(Hash *this, const void *key, uint32_t hash,
+    size_t keysize, size_t entrysize)
+{
+    Array *array;
+    Entry *entry = hash_find(this, key, hash, &array, keysize, entrysize);
+    void *value;
+
+    if (entry == NULL)
+        return NULL;
+
+    value = entry->value;
+    this->size--;
+
+    /* The old array is going away, moving its entries would only race
+     * the migration */
+    if (array != &this->table) {
+        entry->hash = HASH_DELETED;
+        this->stats.tombstones++;
+        return value;
+    }
+
+    size_t idx = ((uint8_t *)entry - array->entries) / entrysize;
+    size_t next = (idx + 1) & array->mask;
+
+    index_remove(array, idx, entrysize);
+
+    /* Shift the entries after it back toward their home, up to an empty
+     * bucket or one already home */
+    while (array->tags[next] != TAG_EMPTY &&
+        distance(array, next, entrysize) > 0) {
+        memcpy(ENTRY(array, idx, entrysize), ENTRY(array, next, entrysize),
+            entrysize);
+        array_set_tag(array, idx, array->tags[next]);
+        index_move(array, idx, entrysize);
+        idx = next;
+        next = (next + 1) & array->mask;
+    }
+
+    ENTRY(array, idx, entrysize)->hash = HASH_EMPTY;
+    array_set_tag(array, idx, TAG_EMPTY);
+
+    return value;
+}
+
+/*
+ * table_prefetch
+ *
+ * Start loading the tags and the first bucket of hash.
+ */
+HASH_INLINE void table_prefetch(Hash *this, uint32_t hash, size_t entrysize)
+{
+    size_t idx = hash & this->table.mask;
+
+    __builtin_prefetch(this->table.tags + idx);
+    __builtin_prefetch(ENTRY(&this->table, idx, entrysize));
+}
+
+#endif /* hashtable_impl_h */
@@ -0,0 +1,165 @@
+/* Copyright (c) 2012, Victor J Roemer. All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * 3. The name of the author may not be used to endorse or promote
+ * products derived from this software without specific prior written
+ * permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+//
+//  hashtable-typed.h
+//  pcapstats
+//
+//  Hash tables of one key and value type.
+//
+//      HASH_TABLE_DECLARE(flow_table, FlowKey, FlowTracker);
+//
+//  declares the type flow_table and static inline functions
+//
+//      flow_table *flow_table_create(size_t max_buckets);
+//      void flow_table_destroy(flow_table *table);
+//      void flow_table_limit(flow_table *table, size_t max_buckets);
+//      uint32_t flow_table_digest(const FlowKey *key);
+//      FlowTracker *flow_table_get(flow_table *, const FlowKey *, digest);
+//      FlowTracker **flow_table_find_or_insert(flow_table *,
+//          const FlowKey *, digest, bool *inserted);
+//      int flow_table_insert(flow_table *, FlowTracker *,
+//          const FlowKey *, digest);
+//      FlowTracker *flow_table_remove(flow_table *, const FlowKey *, digest);
+//      void flow_table_prefetch(flow_table *, digest);
+//      void flow_table_stats(flow_table *, struct hash_stats *stats);
+//      void flow_table_merge_stats(flow_table *, flow_table *from);
+//      FlowTracker *flow_table_first(flow_table *, unsigned *it,
+//          const FlowKey **key);
+//      FlowTracker *flow_table_next(flow_table *, unsigned *it,
+//          const FlowKey **key);
+//
+//  that behave as their hash_*_hashed() counterparts, digest being the
+//  key_digest() of the key. The table is a Hash underneath, but its key
+//  size is a constant, so probes compare and copy keys with fixed width
+//  code inlined into the caller instead of calling memcmp() and memcpy().
+//
+
+#ifndef hashtable_typed_h
+#define hashtable_typed_h
+
+#include "hashtable.h"
+#include "hashtable-impl.h"
+#include "hashdigest.h"
+
+#define HASH_TABLE_DECLARE(name, key_type, value_type) \
+    struct name; \
+    \
+    static inline struct name *name##_create(size_t max_buckets) \
+    { \
+        return (struct name *)hash_create(max_buckets, sizeof(key_type)); \
+    } \
+    \
+    static inline void name##_destroy(struct name *table) \
+    { \
+        hash_destroy((Hash *)table); \
+    } \
+    \
+    static inline void name##_limit(struct name *table, size_t max_buckets) \
+    { \
+        hash_limit((Hash *)table, max_buckets); \
+    } \
+    \
+    static inline uint32_t name##_digest(const key_type *key) \
+    { \
+        return key_digest(key, sizeof(key_type)); \
+    } \
+    \
+    static inline value_type *name##_get(struct name *table, \
+        const key_type *key, uint32_t digest) \
+    { \
+        return hash_lookup((Hash *)table, key, cached_hash(digest), \
+            sizeof(key_type), HASH_ENTRY_SIZE(sizeof(key_type))); \
+    } \
+    \
+    static inline value_type **name##_find_or_insert(struct name *table, \
+        const key_type *key, uint32_t digest, bool *inserted) \
+    { \
+        Entry *entry = hash_upsert((Hash *)table, key, cached_hash(digest), \
+            inserted, sizeof(key_type), HASH_ENTRY_SIZE(sizeof(key_type))); \
+        \
+        return entry ? (value_type **)&entry->value : NULL; \
+    } \
+    \
+    static inline int name##_insert(struct name *table, value_type *value, \
+        const key_type *key, uint32_t digest) \
+    { \
+        return hash_add((Hash *)table, value, key, cached_hash(digest), \
+            sizeof(key_type), HASH_ENTRY_SIZE(sizeof(key_type))); \
+    } \
+    \
+    static inline value_type *name##_remove(struct name *table, \
+        const key_type *key, uint32_t digest) \
+    { \
+        return hash_delete((Hash *)table, key, cached_hash(digest), \
+            sizeof(key_type), HASH_ENTRY_SIZE(sizeof(key_type))); \
+    } \
+    \
+    static inline void name##_prefetch(struct name *table, uint32_t digest) \
+    { \
+        table_prefetch((Hash *)table, cached_hash(digest), \
+            HASH_ENTRY_SIZE(sizeof(key_type))); \
+    } \
+    \
+    static inline void name##_stats(struct name *table, \
+        struct hash_stats *stats) \
+    { \
+        hash_stats((Hash *)table, stats); \
+    } \
+    \
+    static inline void name##_merge_stats(struct name *table, \
+        struct name *from) \
+    { \
+        hash_merge_stats((Hash *)table, (Hash *)from); \
+    } \
+    \
+    static inline value_type *name##_first(struct name *table, \
+        unsigned *it, const key_type **key) \
+    { \
+        const void *p_key = NULL; \
+        value_type *value = hash_first((Hash *)table, it, &p_key); \
+        \
+        *key = p_key; \
+        return value; \
+    } \
+    \
+    static inline value_type *name##_next(struct name *table, \
+        unsigned *it, const key_type **key) \
+    { \
+        const void *p_key = NULL; \
+        value_type *value = hash_next((Hash *)table, it, &p_key); \
+        \
+        *key = p_key; \
+        return value; \
+    } \
+    \
+    typedef struct name name
+
+#endif /* hashtable_typed_h */
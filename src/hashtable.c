@@ -30,73 +30,212 @@
 
 //
 //  hashtable.c
-//  Open address hash table using quadratic probing to avoid
-//  collisions. Modeled loosely after Googles sparse hash table.
+//  Open address hash table using Robin Hood linear probing. Keys are of a
+//  fixed size set when the table is created and are stored inline with the
+//  value and the hash of the key, all in one cache line aligned array, so
+//  a lookup usually touches a single cache line.
+//
+//  Alongside the entries is an array of one byte tags holding a few bits of
+//  each hash. Lookups compare the tags of a group of buckets at once, with
+//  SSE2 where there is, and only read the entries whose tag matches.
+//
+//  An entry never sits further from its home bucket than the entries it
+//  passed on the way, which keeps probes short and lets a lookup stop as
+//  soon as it passes where the key would have been. Removing an entry
+//  shifts the rest of its run back a bucket instead of leaving a
+//  tombstone, so a table with constant churn stays as fast as a new one.
+//
+//  A dense index of the occupied buckets is kept up to date as entries
+//  come, go and shift, so walking a table visits only its entries.
+//
+//  The table grows and shrinks with its load. Entries are moved to the
+//  resized array a few at a time by the inserts and lookups that follow,
+//  and the old array is handed back to the kernel piece by piece as it
+//  empties, so no single operation pays for the whole table.
 //
 //  Created by Victor J. Roemer on 3/4/12.
 //  Copyright (c) 2012 Victor J. Roemer. All rights reserved.
 //
 
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 
 #include <assert.h>
 
 #include <sys/types.h>
 #include <sys/cdefs.h>
+#include <sys/mman.h>
 
 #include "hashtable.h"
+#include "hashtable-impl.h"
 #include "hashdigest.h"
 
-#include "cdefs.h"
+/* Keys of a batch whose first buckets are loaded at once, about as many
+ * misses as a core keeps in flight */
+#define HASH_BATCH 16
+
+/* The emptied front of an old array is unmapped in pieces this large */
+#define HASH_RELEASE_SIZE (64 * 1024)
+
+/* Arrays are a power of two buckets, and never smaller than a group */
+static size_t power_of_two(size_t buckets)
+{
+    size_t rounded = HASH_GROUP;
+
+    while (rounded < buckets)
+        rounded <<= 1;
+
+    return rounded;
+}
 
-typedef struct
+/*
+ * array_create
+ *
+ * Arrays are mapped straight from the kernel as zero pages that are only
+ * backed once touched, so creating even a large one costs next to nothing.
+ * Zeroed tags are all empty.
+ */
+static int array_create(Hash *this, Array *array, size_t buckets)
 {
-    bool filled;
-    void *value;
-    size_t keysize;
-#if __STDC_VERSION__ >= 199901L
-    char key __flexarr;
-#else
-    void *key;
-#endif
-} Bucket;
-
-struct _Hash
+    array->bytes = buckets * this->entrysize;
+    array->entries = mmap(NULL, array->bytes, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (array->entries == MAP_FAILED) {
+        array->entries = NULL;
+        return -1;
+    }
+
+    array->tags = mmap(NULL, buckets + HASH_GROUP, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (array->tags == MAP_FAILED) {
+        munmap(array->entries, array->bytes);
+        array->entries = NULL;
+        array->tags = NULL;
+        return -1;
+    }
+
+    array->index = mmap(NULL, buckets * sizeof *array->index,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (array->index == MAP_FAILED) {
+        munmap(array->entries, array->bytes);
+        munmap(array->tags, buckets + HASH_GROUP);
+        array->entries = NULL;
+        array->tags = NULL;
+        array->index = NULL;
+        return -1;
+    }
+
+    array->count = 0;
+    array->buckets = buckets;
+    array->mask = buckets - 1;
+
+    return 0;
+}
+
+/* What only the table array needs, lookups in the old array are rare
+ * enough to go without tags and it is iterated bucket by bucket */
+static void array_tags_destroy(Array *array)
 {
-    size_t buckets;
-    size_t size;
-    Bucket **table;
-};
+    if (array->tags) {
+        munmap(array->tags, array->buckets + HASH_GROUP);
+        array->tags = NULL;
+    }
+
+    if (array->index) {
+        munmap(array->index, array->buckets * sizeof *array->index);
+        array->index = NULL;
+    }
+}
+
+/*
+ * hash_migrate
+ *
+ * Move up to count buckets of the old array into the table.
+ */
+void hash_migrate(Hash *this, size_t count)
+{
+    while (this->old.entries && count--) {
+        Entry *entry = ENTRY(&this->old, this->migrated++, this->entrysize);
+
+        /* The cached hash spares hashing the key again */
+        if (entry->hash >= HASH_MIN) {
+            Entry *placed = hash_place(this, entry->hash, this->entrysize);
+
+            placed->value = entry->value;
+            memcpy(placed->key, entry->key, this->keysize);
+        }
+
+        if (this->migrated == this->old.buckets) {
+            munmap(this->old.entries + this->released,
+                this->old.bytes - this->released);
+            this->old.entries = NULL;
+        }
+        /* Lookups skip what was moved, nothing reads it anymore */
+        else if (this->migrated * this->entrysize - this->released >=
+            HASH_RELEASE_SIZE) {
+            munmap(this->old.entries + this->released, HASH_RELEASE_SIZE);
+            this->released += HASH_RELEASE_SIZE;
+        }
+    }
+}
+
+/*
+ * hash_resize
+ *
+ * Start moving the table to an array of buckets entries. Whatever is left
+ * of a previous resize is moved first.
+ */
+int hash_resize(Hash *this, size_t buckets)
+{
+    Array array;
+
+    if (array_create(this, &array, buckets) < 0)
+        return -1;
+
+    hash_migrate(this, SIZE_MAX);
+
+    array_tags_destroy(&this->table);
+
+    this->old = this->table;
+    this->table = array;
+    this->migrated = 0;
+    this->released = 0;
+    this->stats.resizes++;
+
+    return 0;
+}
 
 /*
  * hash_create
  *
- * Allocate space for a new table and initialize all the table elements.
+ * Allocate space for a new table holding keys of keysize bytes, that may
+ * grow up to at least max_buckets entries.
  */
-Hash *hash_create(size_t buckets)
+Hash *hash_create(size_t max_buckets, size_t keysize)
 {
     Hash *this = calloc(1, sizeof(*this));
     if (this == NULL) {
         return NULL;
     }
 
-    this->table = (Bucket **)calloc(buckets, sizeof(*(this->table)));
-    if (this->table == NULL) {
-        free(this);
-        return NULL;
-    }
-
-    this->buckets = buckets;
+    this->keysize = keysize;
+    this->entrysize = HASH_ENTRY_SIZE(keysize);
+    this->limit = max_buckets;
+    this->max_buckets = power_of_two(max_buckets);
     this->size = 0;
 
-    for (size_t i = 0; i < this->buckets; ++i) {
-        this->table[i] = NULL;
+    if (array_create(this, &this->table, this->max_buckets < HASH_MIN_BUCKETS ?
+        this->max_buckets : HASH_MIN_BUCKETS) < 0) {
+        free(this);
+        return NULL;
     }
 
-    digest_init(buckets);
-
     return this;
 }
 
@@ -108,39 +247,30 @@ Hash *hash_create(size_t buckets)
 void hash_destroy(Hash *this)
 {
     assert(this != NULL);
-    assert(this->table != NULL);
+    assert(this->table.entries != NULL);
     assert(this->size == 0);
 
-    for (size_t i = 0; i < this->buckets; ++i)
-        free(this->table[i]);
+    if (this->old.entries)
+        munmap(this->old.entries + this->released,
+            this->old.bytes - this->released);
 
-    free(this->table);
+    munmap(this->table.entries, this->table.bytes);
+    array_tags_destroy(&this->table);
     free(this);
 }
 
 /*
- * bucket_create
+ * hash_limit
  *
- * Create a new bucket.
+ * Change how far the table may grow. A table over the new limit shrinks
+ * back as soon as its entries fit.
  */
-static inline Bucket *bucket_create(void *value, void *key, size_t keysize)
+void hash_limit(Hash *this, size_t max_buckets)
 {
-    Bucket *bucket = NULL;
-    if ((bucket = malloc(keysize + sizeof(*bucket))) == NULL) {
-        return NULL;
+    if (max_buckets != this->limit) {
+        this->limit = max_buckets;
+        this->max_buckets = power_of_two(max_buckets);
     }
-
-    bucket->keysize = keysize;
-    bucket->value = value;
-    bucket->filled = true;
-
-    /* store key with bucket, bucket->key will point into itself */
-#if __STDC_VERSION__ < 199901L
-    bucket->key = &bucket->key+1;
-#endif
-    memcpy(bucket->key, key, keysize);
-
-    return bucket;
 }
 
 /* 
@@ -148,68 +278,63 @@ static inline Bucket *bucket_create(void *value, void *key, size_t keysize)
  *
  * Insert a new key/value pair.
  */
-int hash_insert(Hash *this, void *value, void *key, size_t keysize)
+int hash_insert(Hash *this, void *value, const void *key)
 {
-//    if ((float)(this->size/this->buckets) > 0.8f) {
-//        printf("Loadfactor == %f\n", (float)(this->size/this->buckets));
-//        return -1;
-//    }
-
-    unsigned long idx = fnv1a_digest(key, keysize, 0x811c9dc5) % this->buckets;
-    
-    for (size_t i = 1; i < this->buckets; ++i) {
-        if (this->table[idx] == NULL) {
-            this->table[idx] = bucket_create(value, key, keysize);
-            this->size++;
-            return 0;
-        }
-        /** FIXME: if key sizes differ, than the bucket really needs to be
-         * updated. */
-        else if (this->table[idx]->filled == false) {
-            this->table[idx]->filled = true;
-            memcpy(this->table[idx]->key, key, keysize);
-            this->table[idx]->keysize = keysize;
-            this->table[idx]->value = value;
-            this->size++;
-            return 0;
-        }
+    return hash_insert_hashed(this, value, key,
+        key_digest(key, this->keysize));
+}
 
-        /* bucket was already filled, find a new bucket */
-        idx = (idx + i*i) % this->buckets;
-    }
-    
-    return -1;
+/*
+ * hash_insert_hashed
+ *
+ * Insert a new key/value pair, the key_digest() of the key is given.
+ */
+int hash_insert_hashed(Hash *this, void *value, const void *key,
+    uint32_t digest)
+{
+    return hash_add(this, value, key, cached_hash(digest), this->keysize,
+        this->entrysize);
 }
 
 /*
- * hash_remove
+ * hash_find_or_insert
+ *
+ * Slot holding the value of key. A key not in the table yet is inserted
+ * with a NULL value, and *inserted is set, in the same probe that looked
+ * for it. The slot must be filled in before the table is used again.
  *
- * Remove key/value pair from table and return the value.
+ * NULL if the key is new and the table is full.
  */
-void *hash_remove(Hash *this, const void *key, size_t keysize)
+void **hash_find_or_insert(Hash *this, const void *key, bool *inserted)
 {
-    unsigned long idx = fnv1a_digest(key, keysize, 0x811c9dc5) % this->buckets;
+    return hash_find_or_insert_hashed(this, key,
+        key_digest(key, this->keysize), inserted);
+}
 
-    for (size_t i = 0; i < this->buckets; i++) {
-        if (this->table[idx] == NULL)
-            return NULL;
+void **hash_find_or_insert_hashed(Hash *this, const void *key,
+    uint32_t digest, bool *inserted)
+{
+    Entry *entry = hash_upsert(this, key, cached_hash(digest), inserted,
+        this->keysize, this->entrysize);
 
-        if (this->table[idx]->filled == false) {
-            idx = (idx + i*i) % this->buckets;
-            continue;
-        }
+    return entry ? &entry->value : NULL;
+}
 
-        if (memcmp(key, this->table[idx]->key,
-            this->table[idx]->keysize) == 0) {
-            this->table[idx]->filled = false;
-            this->size--;
-            return this->table[idx]->value;
-        }
+/*
+ * hash_remove
+ *
+ * Remove key/value pair from table and return the value. The entry being
+ * visited may be removed while iterating, no other.
+ */
+void *hash_remove(Hash *this, const void *key)
+{
+    return hash_remove_hashed(this, key, key_digest(key, this->keysize));
+}
 
-        idx = (idx + i*i) % this->buckets;
-    }
-    
-    return NULL;
+void *hash_remove_hashed(Hash *this, const void *key, uint32_t digest)
+{
+    return hash_delete(this, key, cached_hash(digest), this->keysize,
+        this->entrysize);
 }
 
 /*
@@ -217,46 +342,153 @@ void *hash_remove(Hash *this, const void *key, size_t keysize)
  *
  * Return value for the key in the table.
  */
-void *hash_get(Hash *this, void *key, size_t keysize)
+void *hash_get(Hash *this, const void *key)
 {
-    unsigned long idx = fnv1a_digest(key, keysize, 0x811c9dc5)
-    % this->buckets;
+    return hash_get_hashed(this, key, key_digest(key, this->keysize));
+}
 
-    for (size_t i = 0; i < this->buckets; i++) {
-        if (this->table[idx] == NULL)
-            return NULL;
+void *hash_get_hashed(Hash *this, const void *key, uint32_t digest)
+{
+    return hash_lookup(this, key, cached_hash(digest), this->keysize,
+        this->entrysize);
+}
 
-        if (this->table[idx]->filled == false)
-            continue;
+/*
+ * hash_prefetch
+ *
+ * Start loading the tags and the entry a key hashes to, ahead of a
+ * hash_get.
+ */
+void hash_prefetch(Hash *this, const void *key)
+{
+    hash_prefetch_hashed(this, key_digest(key, this->keysize));
+}
 
-        else 
-        if (memcmp(key, this->table[idx]->key,
-            this->table[idx]->keysize) == 0)
-            return this->table[idx]->value;
+void hash_prefetch_hashed(Hash *this, uint32_t digest)
+{
+    table_prefetch(this, cached_hash(digest), this->entrysize);
+}
 
-        idx = (idx + i*i) % this->buckets;
+/*
+ * batch_hashes
+ *
+ * Hashes of up to HASH_BATCH keys, and start loading their first buckets.
+ * Every load is in flight before any key is looked up, so the misses of a
+ * batch overlap instead of following one another.
+ */
+static size_t batch_hashes(Hash *this, const void *const *keys,
+    const uint32_t *digests, size_t count, uint32_t *hashes)
+{
+    if (count > HASH_BATCH)
+        count = HASH_BATCH;
+
+    for (size_t i = 0; i < count; i++) {
+        hashes[i] = cached_hash(digests ? digests[i] :
+            key_digest(keys[i], this->keysize));
+        table_prefetch(this, hashes[i], this->entrysize);
     }
-    
-    return NULL;
+
+    return count;
 }
 
 /*
- * hash_first
+ * hash_get_batch
  *
- * return the first element in the hash table.
+ * Look count keys up at once, values[i] is the value of keys[i] or NULL.
+ * The key_digest() of every key is given in digests, or NULL to have them
+ * worked out.
  */
-void *hash_first(Hash *this, unsigned *it, const void **key)
+void hash_get_batch(Hash *this, const void *const *keys,
+    const uint32_t *digests, void **values, size_t count)
+{
+    uint32_t hashes[HASH_BATCH];
+
+    while (count > 0) {
+        size_t n = batch_hashes(this, keys, digests, count, hashes);
+
+        hash_step(this, HASH_MIGRATE_STEP * n);
+
+        for (size_t i = 0; i < n; i++) {
+            Array *array;
+            Entry *entry = hash_find(this, keys[i], hashes[i], &array,
+                this->keysize, this->entrysize);
+
+            values[i] = entry ? entry->value : NULL;
+        }
+
+        keys += n;
+        digests = digests ? digests + n : NULL;
+        values += n;
+        count -= n;
+    }
+}
+
+/*
+ * hash_upsert_batch
+ *
+ * Find or insert count keys at once. values[i] holds the value to insert
+ * for keys[i] if it is new, and is left holding the value of the key in
+ * the table: the one given if it was inserted, NULL if the table is full.
+ *
+ * Returns how many keys were inserted.
+ */
+size_t hash_upsert_batch(Hash *this, const void *const *keys,
+    const uint32_t *digests, void **values, size_t count)
 {
-    for (*it = 0; (*it) < this->buckets; (*it)++) {
-        if (this->table[*it] == NULL)
-            continue;
-        if (this->table[*it]->filled) {
-            *key = this->table[*it]->key;
-            return this->table[*it]->value;
+    uint32_t hashes[HASH_BATCH];
+    size_t added = 0;
+
+    while (count > 0) {
+        size_t n = batch_hashes(this, keys, digests, count, hashes);
+
+        for (size_t i = 0; i < n; i++) {
+            bool inserted;
+            Entry *entry = hash_upsert(this, keys[i], hashes[i], &inserted,
+                this->keysize, this->entrysize);
+
+            if (entry == NULL)
+                values[i] = NULL;
+            else if (inserted) {
+                entry->value = values[i];
+                added++;
+            }
+            else
+                values[i] = entry->value;
         }
+
+        keys += n;
+        digests = digests ? digests + n : NULL;
+        values += n;
+        count -= n;
     }
 
-    return NULL;
+    return added;
+}
+
+/* Iterators over the old array of a resize have this bit set, the rest
+ * is the bucket to look at next */
+#define HASH_ITER_OLD 0x80000000u
+
+/*
+ * hash_first
+ *
+ * return the first element in the hash table. The table must not be
+ * inserted into or looked up in until the iteration is over.
+ *
+ * Whatever a resize has not moved yet is visited where it is, from the end
+ * of the old array down, and then the table through its live index. An
+ * iteration moves nothing, so it never pays for a resize at once. The
+ * index is walked from its end: removing the entry being visited moves the
+ * last one in its place, and that one was already visited.
+ */
+void *hash_first(Hash *this, unsigned *it, const void **key)
+{
+    if (this->old.entries)
+        *it = HASH_ITER_OLD | (unsigned)this->old.buckets;
+    else
+        *it = this->table.count;
+
+    return hash_next(this, it, key);
 }
 
 /*
@@ -266,16 +498,69 @@ void *hash_first(Hash *this, unsigned *it, const void **key)
  */
 void *hash_next(Hash *this, unsigned *it, const void **key)
 {
-    for ((*it)++; (*it) < this->buckets; (*it)++) {
-        if (this->table[*it] == NULL)
-            continue;
-        if (this->table[*it]->filled) {
-            *key = this->table[*it]->key;
-            return this->table[*it]->value;
+    Entry *entry;
+
+    while (*it & HASH_ITER_OLD) {
+        size_t idx = *it & ~HASH_ITER_OLD;
+
+        /* Buckets before migrated are in the table by now */
+        if (this->old.entries == NULL || idx <= this->migrated) {
+            *it = this->table.count;
+            break;
+        }
+
+        *it = HASH_ITER_OLD | (unsigned)--idx;
+        entry = ENTRY(&this->old, idx, this->entrysize);
+
+        if (entry->hash >= HASH_MIN) {
+            *key = entry->key;
+            return entry->value;
         }
     }
 
-    return NULL;
+    if (*it == 0)
+        return NULL;
+
+    entry = ENTRY(&this->table, this->table.index[--(*it)], this->entrysize);
+
+    *key = entry->key;
+    return entry->value;
+}
+
+/* Bytes the table has mapped */
+static size_t hash_memory(Hash *this)
+{
+    return sizeof(*this) + this->table.bytes +
+        this->table.buckets * sizeof *this->table.index +
+        (this->old.entries ? this->old.bytes - this->released : 0);
+}
+
+/*
+ * hash_stats
+ *
+ * Add the counters of the table and its current size to stats, so the
+ * tables of several threads sum up.
+ */
+void hash_stats(Hash *this, struct hash_stats *stats)
+{
+    struct hash_stats now = this->stats;
+
+    now.entries = this->size;
+    now.buckets = this->table.buckets;
+    now.memory = hash_memory(this);
+
+    hash_stats_add(stats, &now);
+}
+
+/*
+ * hash_merge_stats
+ *
+ * The entries of from were moved to this and from is going away, its
+ * lookups are counted with those of this from now on.
+ */
+void hash_merge_stats(Hash *this, Hash *from)
+{
+    hash_stats_add(&this->stats, &from->stats);
 }
 
 /*
@@ -285,10 +570,10 @@ void *hash_next(Hash *this, unsigned *it, const void **key)
  */
 void hash_dump(Hash *this)
 {
-    unsigned long memuse = sizeof(*this) + ((sizeof(Bucket)+16)*this->buckets);
+    unsigned long memuse = hash_memory(this);
     printf("Fixed memory usage = %lu\n", memuse);
-    for (size_t i = 1; i < this->buckets; ++i) {
-        if (this->table[i] != NULL && this->table[i]->filled)
+    for (size_t i = 0; i < this->table.buckets; ++i) {
+        if (ENTRY(&this->table, i, this->entrysize)->hash >= HASH_MIN)
             printf("[%u][ full ]\n", (unsigned)i);
     }
 }
@@ -42,29 +42,111 @@
 #define hashtable_h
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdbool.h>
 
 
 typedef struct _Hash Hash;
 
+/* Lookups by how many buckets past its home a key was found, or found
+ * missing: 0, 1, 2-3, 4-7, ... and 64 or more */
+#define HASH_PROBE_BINS 8
+
+/* Health of a table. Counters run from its creation, the last three are
+ * its state when asked. */
+struct hash_stats
+{
+    uint64_t lookups;
+    uint64_t hits;
+    uint64_t probes[HASH_PROBE_BINS];
+    uint64_t max_probe;
+    uint64_t failed_inserts;    /* table full */
+    uint64_t tombstones;        /* removals while resizing */
+    uint64_t resizes;
+
+    uint64_t entries;
+    uint64_t buckets;
+    uint64_t memory;            /* bytes mapped */
+};
+
+static inline void
+hash_stats_add(struct hash_stats *dst, const struct hash_stats *src)
+{
+    dst->lookups += src->lookups;
+    dst->hits += src->hits;
+    for (int i = 0; i < HASH_PROBE_BINS; i++)
+        dst->probes[i] += src->probes[i];
+    if (src->max_probe > dst->max_probe)
+        dst->max_probe = src->max_probe;
+    dst->failed_inserts += src->failed_inserts;
+    dst->tombstones += src->tombstones;
+    dst->resizes += src->resizes;
+    dst->entries += src->entries;
+    dst->buckets += src->buckets;
+    dst->memory += src->memory;
+}
+
 #define hash_size(table) ((table)->size)
 
 typedef void *(*alloc_t)(size_t size);
 typedef void (*free_t)(void *ptr);
 
-Hash *hash_create(size_t buckets);
+/* Keys of a table all have the same size, keysize. The table starts small
+ * and grows with its load up to max_buckets entries. */
+Hash *hash_create(size_t max_buckets, size_t keysize);
+
+/* Change how far a table may grow */
+void hash_limit(Hash *this, size_t max_buckets);
 
 void hash_destroy(Hash *this);
 
-int hash_insert(Hash *table, void *data, void *key, size_t keysize);
+int hash_insert(Hash *table, void *data, const void *key);
+
+void *hash_remove(Hash *this, const void *key);
+
+/* Callers that already hold the hash of a key pass it in instead of having
+ * it worked out again. A key must always come with the same hash; tables
+ * also used through the calls above take the key_digest() of the key. */
+int hash_insert_hashed(Hash *this, void *data, const void *key,
+    uint32_t digest);
+
+void *hash_remove_hashed(Hash *this, const void *key, uint32_t digest);
+
+void *hash_get_hashed(Hash *this, const void *key, uint32_t digest);
+
+void hash_prefetch_hashed(Hash *this, uint32_t digest);
 
-void *hash_remove(Hash *this, const void *key, size_t keysize);
+/* Slot holding the value of key, found or inserted in a single probe. A
+ * new key gets a NULL value and sets *inserted, the caller fills the slot
+ * in before the next call on the table. NULL if the key is new and the
+ * table is full. */
+void **hash_find_or_insert(Hash *this, const void *key, bool *inserted);
+
+void **hash_find_or_insert_hashed(Hash *this, const void *key,
+    uint32_t digest, bool *inserted);
+
+/* Look up or find-or-insert a batch of keys at once, the first buckets of
+ * all the keys are loaded before any is resolved. digests holds the hash of
+ * every key, or is NULL. */
+void hash_get_batch(Hash *this, const void *const *keys,
+    const uint32_t *digests, void **values, size_t count);
+
+size_t hash_upsert_batch(Hash *this, const void *const *keys,
+    const uint32_t *digests, void **values, size_t count);
 
 void *hash_first(Hash *this, unsigned *it, const void **key);
 
 void *hash_next(Hash *this, unsigned *it, const void **key);
 
-void *hash_get(Hash *this, void *key, size_t keysize);
+void *hash_get(Hash *this, const void *key);
+
+void hash_prefetch(Hash *this, const void *key);
+
+/* Add the health of a table to stats */
+void hash_stats(Hash *this, struct hash_stats *stats);
+
+/* Carry the counters of from over to this, once its entries were */
+void hash_merge_stats(Hash *this, Hash *from);
 
 void hash_dump(Hash *table);
 
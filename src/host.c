@@ -39,18 +39,18 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#include "cdefs.h"
 #include "mesg.h"
 #include "readconf.h"
 
 #include "timequeue.h"
-#include "hashtable.h"
+#include "hashtable-typed.h"
+#include "shared-hash.h"
 
 #include <packet.h>
 
-extern Options options;
-
-static Hash *hosttable;
-static struct tmq *timeout_queue;
+#include "clock.h"
+#include "host.h"
 
 typedef struct
 {
@@ -70,6 +70,8 @@ typedef struct
     uint64_t tx_packets;
     uint64_t rx_octets;
     uint64_t tx_octets;
+
+    struct tmq_element *timeout;    /* in the timeout queue */
 } HostData;
 
 typedef struct
@@ -77,26 +79,162 @@ typedef struct
     struct ipaddr address;
 } HostKey;
 
-static int _host_timeout_queue_task(const void *key);
-int host_key_compare(const void *k1, const void *k2);
+HASH_TABLE_DECLARE(host_hash, HostKey, HostData);
+
+/* Each analysis thread has its own table */
+static __thread host_hash *hosttable;
+static __thread struct tmq *timeout_queue;
+
+/* Traffic of a host summed over every analysis thread */
+struct host_total
+{
+    struct ipaddr address;
+    unsigned version;
+    uint64_t rx_packets;
+    uint64_t tx_packets;
+    uint64_t rx_octets;
+    uint64_t tx_octets;
+};
+
+/* Every host any thread has tracked, shared by all of them. A thread
+ * folds the traffic of a host in when it lets go of the host, once it has
+ * aged out or the table is torn down. */
+static SharedHash *totals;
+
+/* Table detached by host_table_export */
+struct host_tables
+{
+    host_hash *table;
+    struct tmq *timeout_queue;
+};
+
+static int _host_timeout_queue_task(const struct tmq_element *elem);
+
+
+int host_remove(const HostKey *key);
+
+static int
+host_total_fold(void **value, bool inserted, void *arg)
+{
+    struct host_total *total = *value;
+    const HostData *host = arg;
+
+    if (inserted) {
+        if ((total = *value = calloc(1, sizeof *total)) == NULL)
+            return -1;
+
+        total->address = host->address;
+        total->version = host->version;
+    }
+
+    total->rx_packets += host->rx_packets;
+    total->tx_packets += host->tx_packets;
+    total->rx_octets += host->rx_octets;
+    total->tx_octets += host->tx_octets;
+
+    return 0;
+}
+
+/* Fold the traffic of a host this thread lets go of into the totals, and
+ * free it */
+static void
+host_release(HostData *host)
+{
+    HostKey key = { host->address };
+
+    if (totals && shared_hash_upsert(totals, &key, host_hash_digest(&key),
+        host_total_fold, host) < 0)
+        warn("could not add host to the totals");
+
+    free(host);
+}
+
+/* Host Totals Init
+ *
+ * Create the totals shared by every thread, before any of them starts
+ *
+ * @return  -1 on failure
+ *          0 on success
+ */
+int
+host_totals_init()
+{
+    totals = shared_hash_create(options.host_max_mem, sizeof(HostKey));
+
+    return totals ? 0 : -1;
+}
+
+static void
+host_total_key(const void *key, void *value UNUSED, void *arg)
+{
+    HostKey **next = arg;
+
+    memcpy((*next)++, key, sizeof **next);
+}
+
+/* Host Totals Finalize
+ *
+ * Free the totals, once every thread is done with them
+ */
+void
+host_totals_finalize()
+{
+    struct hash_stats stats;
+    HostKey *keys, *next;
+
+    if (totals == NULL)
+        return;
 
+    memset(&stats, 0, sizeof stats);
+    shared_hash_stats(totals, &stats);
 
-int host_remove(HostKey *key);
+    if ((keys = next = malloc((stats.entries + 1) * sizeof *keys)) == NULL)
+        return;
+
+    shared_hash_snapshot(totals, host_total_key, &next);
+
+    while (next-- > keys)
+        free(shared_hash_remove(totals, next, host_hash_digest(next)));
+
+    free(keys);
+
+    shared_hash_destroy(totals);
+    totals = NULL;
+}
+
+/* Host Totals Stats
+ *
+ * Count every host the threads have let go of, once however many threads
+ * tracked it
+ */
+void
+host_totals_stats(struct tracker_stats *stats)
+{
+    struct hash_stats health;
+
+    if (totals == NULL)
+        return;
+
+    memset(&health, 0, sizeof health);
+    shared_hash_stats(totals, &health);
+
+    stats->hosts += health.entries;
+    hash_stats_add(&stats->host_totals, &health);
+}
 
 int
 host_table_init( )
 {
-    hosttable = hash_create(options.host_max_mem);
+    hosttable = host_hash_create(options.host_max_mem);
     if (hosttable == NULL)
         return -1;
 
     timeout_queue = tmq_create(options.host_age_limit);
     if (timeout_queue == NULL) {
-        free(hosttable);
+        host_hash_destroy(hosttable);
         return -1;
     }
 
-    timeout_queue->compare = host_key_compare;
     timeout_queue->task = _host_timeout_queue_task;
 
     return 0;
@@ -105,83 +243,186 @@ host_table_init( )
 void
 host_table_finalize( )
 {
-    assert(hosttable);
-
     HostData *it;
     unsigned i;
-    const void *key;
+    const HostKey *key;
+
+    /* Already handed to another thread */
+    if (hosttable == NULL)
+        return;
+
+    for (it = host_hash_first(hosttable, &i, &key); it;
+         it = host_hash_next(hosttable, &i, &key))
+        host_remove(key);
 
     tmq_destroy(timeout_queue);
     timeout_queue = NULL;
 
-    for (it = hash_first(hosttable, &i, &key); it;
-         it = hash_next(hosttable, &i, &key))
-        host_remove((HostKey*)key);
+    host_hash_destroy(hosttable);
+    hosttable = NULL;
+}
 
-    hash_destroy(hosttable);
+void
+host_table_stats(struct tracker_stats *stats)
+{
+    if (hosttable)
+        host_hash_stats(hosttable, &stats->host_table);
 }
 
-HostData *
-host_get(HostKey *key)
+/* Detach the table of the calling thread, to be merged by another one
+ */
+void *
+host_table_export( )
 {
-    assert(hosttable);
-    assert(key);
+    struct host_tables *tables;
 
-    struct tmq_element *tmq_elem;
-    if ((tmq_elem = tmq_find(timeout_queue, &key))) {
-        tmq_bump(timeout_queue, tmq_elem);
-    }
+    if ((tables = malloc(sizeof *tables)) == NULL)
+        return NULL;
+
+    tables->table = hosttable;
+    tables->timeout_queue = timeout_queue;
 
-    return (HostData *)hash_get(hosttable, key, sizeof *key);
+    hosttable = NULL;
+    timeout_queue = NULL;
+
+    return tables;
 }
 
-int
-host_key_compare(const void *k1, const void *k2)
+/* Fold the detached table of an earlier part of the capture into this
+ * thread's table. A host seen by both parts is counted once, with the
+ * traffic of both.
+ */
+void
+host_table_merge(void *p_tables)
 {
-    if(!k2) return 0; // something is broken
-    return memcmp(k1, k2, sizeof(HostKey));
+    struct host_tables *tables = p_tables;
+    HostData *it, *mine;
+    struct timeval last;
+    HostKey key;
+    uint32_t hash;
+    unsigned i;
+    const HostKey *p_key;
+
+    if (tables == NULL)
+        return;
+
+    for (it = host_hash_first(tables->table, &i, &p_key); it;
+         it = host_hash_next(tables->table, &i, &p_key)) {
+        memcpy(&key, p_key, sizeof key);
+        hash = host_hash_digest(&key);
+        host_hash_remove(tables->table, &key, hash);
+
+        /* Its element goes with the earlier queue */
+        if (it->timeout)
+            last = it->timeout->time;
+        else
+            clock_now(&last);
+
+        it->timeout = NULL;
+
+        if ((mine = host_hash_get(hosttable, &key, hash)) != NULL) {
+            mine->rx_packets += it->rx_packets;
+            mine->tx_packets += it->tx_packets;
+            mine->rx_octets += it->rx_octets;
+            mine->tx_octets += it->tx_octets;
+            free(it);
+            continue;
+        }
+
+        if (host_hash_insert(hosttable, it, &key, hash) < 0) {
+            host_release(it);
+            continue;
+        }
+
+        /* Queued from the time it was last seen */
+        if ((it->timeout = tmq_element_create(&key, sizeof key)) != NULL) {
+            it->timeout->hash = hash;
+            tmq_schedule(timeout_queue, it->timeout, &last,
+                timeout_queue->timeout);
+        }
+    }
+
+    host_hash_merge_stats(hosttable, tables->table);
+
+    tmq_destroy(tables->timeout_queue);
+    host_hash_destroy(tables->table);
+    free(tables);
 }
 
-int
-host_remove(HostKey *key)
+/* Find the host of key, or start tracking a new one of packet p. NULL if
+ * the table is full or out of memory.
+ */
+HostData *
+host_get(HostKey *key, Packet *p)
 {
     assert(hosttable);
     assert(key);
 
-    struct tmq_element *tmq_elem = 
-        tmq_find(timeout_queue, &key);
-    if (tmq_elem)
-        tmq_delete(timeout_queue, tmq_elem);
-    
-    free(hash_remove(hosttable, key, sizeof *key));
+    uint32_t hash = host_hash_digest(key);
+    HostData *host, **slot;
+    bool inserted;
 
-    return 0;
+    /* HostMaxMem may have changed on SIGHUP */
+    host_hash_limit(hosttable, options.host_max_mem);
+
+    slot = host_hash_find_or_insert(hosttable, key, hash, &inserted);
+    if (slot == NULL)
+        return NULL;
+
+    if (!inserted) {
+        tmq_bump(timeout_queue, (*slot)->timeout);
+        return *slot;
+    }
+
+    if ((host = *slot = calloc(1, sizeof *host)) == NULL) {
+        warn("could not allocate host data");
+        host_hash_remove(hosttable, key, hash);
+        return NULL;
+    }
+
+    host->address = key->address;
+    host->version = packet_version(p);
+
+    if ((host->timeout = tmq_element_create(key, sizeof *key)) != NULL) {
+        host->timeout->hash = hash;
+        tmq_insert(timeout_queue, host->timeout);
+    }
+
+    return host;
 }
 
 int
-host_insert(HostKey *key, HostData *data)
+host_remove(const HostKey *key)
 {
     assert(hosttable);
     assert(key);
 
-    struct tmq_element *tmq_elem =
-        tmq_element_create(&key, sizeof key);
-    tmq_insert(timeout_queue, tmq_elem);
+    HostData *host = host_hash_remove(hosttable, key, host_hash_digest(key));
 
-    return hash_insert(hosttable, data, key, sizeof *key);
+    if (host == NULL)
+        return -1;
+
+    tmq_delete(timeout_queue, host->timeout);
+    host_release(host);
+
+    return 0;
 }
 
 int
-_host_timeout_queue_task(const void *key)
+_host_timeout_queue_task(const struct tmq_element *elem)
 {
-    free(hash_remove(hosttable, key, sizeof(HostKey)));
+    HostData *host = host_hash_remove(hosttable, elem->key, elem->hash);
+
+    if (host)
+        host_release(host);
 
     return 0;
 }
 
-void
-print_host(HostData *host)
+static void
+print_host(const void *key UNUSED, void *value, void *arg UNUSED)
 {
+    const struct host_total *host = value;
     char addr[INET6_ADDRSTRLEN+1];
 
     inet_ntop(AF_INET, &host->address, addr, INET_ADDRSTRLEN);
@@ -197,17 +438,12 @@ print_host(HostData *host)
     printf("Rx Octets:  %"PRIu64"\n", host->rx_octets);
 }
 
+/* Print the totals of every host the threads have let go of */
 void
 dump_hosts()
 {
-    HostData *it;
-    unsigned i;
-    const void *key;
-
-    for (it = hash_first(hosttable, &i, &key); it;
-         it = hash_next(hosttable, &i, &key)) {
-        print_host(it);
-    }
+    if (totals)
+        shared_hash_snapshot(totals, print_host, NULL);
 }
 
 int
@@ -216,43 +452,21 @@ track_packet_host(Packet *p)
     struct ipaddr addr;
     addr = packet_srcaddr(p);
 
-    HostData *host = host_get((HostKey *)&addr);
-    if (host == NULL) {
-        if ((host = calloc(1, sizeof *host)) == NULL) {
-            warn("could not allocate host data");
-            return -1;
-        }
-        if (host_insert((HostKey *)&addr, host) < 0)
-            return -1;
-        memset(host, 0, sizeof *host);
-        host->address = packet_srcaddr(p);
-        host->version = packet_version(p);
-    }
+    HostData *host = host_get((HostKey *)&addr, p);
+    if (host == NULL)
+        return -1;
 
-    if (host != NULL) {
-        host->tx_packets++;
-        host->tx_octets += packet_paysize(p);
-    }
+    host->tx_packets++;
+    host->tx_octets += packet_paysize(p);
 
     addr = packet_dstaddr(p);
 
-    host = host_get((HostKey *)&addr);
-    if (host == NULL) {
-        if ((host = calloc(1, sizeof *host)) == NULL) {
-            warn("could not allocate host data");
-            return -1;
-        }
-        if (host_insert((HostKey *)&addr, host) < 0)
-            return -1;
-        memset(host, 0, sizeof *host);
-        host->address = packet_dstaddr(p);
-        host->version = packet_version(p);
-    }
+    host = host_get((HostKey *)&addr, p);
+    if (host == NULL)
+        return -1;
 
-    if (host != NULL) {
-        host->rx_packets++;
-        host->rx_octets += packet_paysize(p);
-    }
+    host->rx_packets++;
+    host->rx_octets += packet_paysize(p);
 
     tmq_timeout(timeout_queue);
     return 0;
@@ -30,10 +30,29 @@
 #ifndef HOST_H
 #define HOST_H
 
+#include "stats.h"
+
 int host_table_init();
 
 void host_table_finalize();
 
+void host_table_stats(struct tracker_stats *stats);
+
+/* Detach the table of the calling thread, and fold a detached table into
+ * the calling thread's own */
+void *host_table_export();
+
+void host_table_merge(void *tables);
+
+/* Totals of every host, shared by the analysis threads. Set up before
+ * the first thread starts and freed after the last one is done. */
+int host_totals_init();
+
+void host_totals_finalize();
+
+/* Count the hosts of the totals, and add their health to stats */
+void host_totals_stats(struct tracker_stats *stats);
+
 void dump_hosts();
 
 int track_packet_host(Packet *p);
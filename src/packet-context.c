@@ -0,0 +1,80 @@
+/* Copyright (c) Victor Roemer, 2013. All rights reserved.
+ * See LICENSE in the root source directory for details. */
+
+/* packet-context.c
+ *
+ * The trackers key most of their tables on the conversation of a packet.
+ * It is put in canonical order and hashed once, every tracker reuses the
+ * same hash.
+ *
+ * The dispatcher can not use it. Only the first fragment of a datagram
+ * carries ports, so a fragmented segment would be reassembled on another
+ * worker than the one owning its session. Workers are picked by a second
+ * hash of the addresses and protocol alone.
+ */
+#include <config.h>
+
+#include <string.h>
+
+#include "packet-context.h"
+#include "hashdigest.h"
+
+static void
+packet_context_key(struct packet_context *ctx, bool ports)
+{
+    Packet *packet = ctx->packet;
+    struct packet_key *key = &ctx->key;
+
+    /* Keys are hashed and compared whole, padding included */
+    memset(key, 0, sizeof *key);
+
+    key->addr_a = packet_srcaddr(packet);
+    key->addr_b = packet_dstaddr(packet);
+    key->protocol = packet_protocol(packet);
+    ctx->reversed = false;
+
+    if (ports) {
+        key->port_a = packet_srcport(packet);
+        key->port_b = packet_dstport(packet);
+    }
+
+    int order = ip_compare(&key->addr_a, &key->addr_b);
+
+    /* Both ends on the same address are told apart by their ports, the
+     * higher one goes first like the higher address does */
+    if (order == IP_LESSER ||
+        (order == IP_EQUAL && key->port_a < key->port_b)) {
+        key->addr_a = packet_dstaddr(packet);
+        key->addr_b = packet_srcaddr(packet);
+        if (ports) {
+            key->port_a = packet_dstport(packet);
+            key->port_b = packet_srcport(packet);
+        }
+        ctx->reversed = true;
+    }
+
+    if (key->port_a == 0 && key->port_b == 0) {
+        ctx->hash = key_digest(key, sizeof *key);
+        ctx->shard = ctx->hash;
+        return;
+    }
+
+    struct packet_key addrs = *key;
+    addrs.port_a = 0;
+    addrs.port_b = 0;
+
+    ctx->hash = key_digest(key, sizeof *key);
+    ctx->shard = key_digest(&addrs, sizeof addrs);
+}
+
+void
+packet_context_init(struct packet_context *ctx)
+{
+    packet_context_key(ctx, !packet_is_fragment(ctx->packet));
+}
+
+void
+packet_context_reassembled(struct packet_context *ctx)
+{
+    packet_context_key(ctx, true);
+}
@@ -0,0 +1,54 @@
+/* Copyright (c) Victor Roemer, 2013. All rights reserved.
+ * See LICENSE in the root source directory for details. */
+
+#ifndef PACKET_CONTEXT_H
+#define PACKET_CONTEXT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <packet.h>
+
+/* Conversation of a packet, the same in both directions. The greater
+ * address comes first, each port goes with its address. Fragments carry
+ * ports only in their first fragment so they are keyed without them.
+ */
+struct packet_key
+{
+    struct ipaddr addr_a;
+    struct ipaddr addr_b;
+    uint16_t port_a;
+    uint16_t port_b;
+    uint8_t protocol;
+};
+
+/* What every tracker needs to know about a packet, worked out once when
+ * it is decoded.
+ */
+struct packet_context
+{
+    Packet *packet;
+    struct packet_key key;
+    uint32_t hash;      /* key_digest() of key */
+    uint32_t shard;     /* key_digest() of key without ports */
+    bool reversed;      /* the packet goes from addr_b to addr_a */
+
+    /* Datagram completed by merging the tables of two chunks. It is seen
+     * after every packet of the later chunk, so it only updates state that
+     * is still there and never creates any. */
+    bool merged;
+
+    /* Raw frame of the packet where it stays mapped for the whole run
+     * (chunked reads), NULL otherwise */
+    const uint8_t *frame;
+    uint32_t frame_size;
+};
+
+/* Key and hash the packet ctx->packet */
+void packet_context_init(struct packet_context *ctx);
+
+/* Key and hash ctx->packet again once its datagram has been reassembled,
+ * now that its ports are known */
+void packet_context_reassembled(struct packet_context *ctx);
+
+#endif /* PACKET_CONTEXT_H */
@@ -0,0 +1,82 @@
+/* Copyright (c) Victor Roemer, 2013. All rights reserved.
+ * See LICENSE in the root source directory for details. */
+
+/* packet-pool.c
+ *
+ * Recycled packet objects. Every packet is created once, up front, and
+ * handed out again after it has been analyzed, so the capture path never
+ * calls into the allocator.
+ */
+#include <config.h>
+
+#include <stdlib.h>
+
+#include "packet-pool.h"
+
+struct _PacketPool
+{
+    Packet **packets;   /* every packet owned by the pool */
+    Packet **free;      /* stack of packets not handed out */
+    unsigned count;
+    unsigned nfree;
+};
+
+/* Packet Pool Create
+ *
+ * @return  NULL on failure
+ *          PacketPool * on success
+ */
+PacketPool *
+packet_pool_create(unsigned count)
+{
+    PacketPool *pool;
+
+    if ((pool = calloc(1, sizeof *pool)) == NULL)
+        return NULL;
+
+    pool->packets = calloc(count, sizeof *pool->packets);
+    pool->free = calloc(count, sizeof *pool->free);
+    if (pool->packets == NULL || pool->free == NULL)
+        goto fail;
+
+    for (; pool->count < count; pool->count++) {
+        Packet *packet = packet_create();
+        if (packet == NULL)
+            goto fail;
+
+        pool->packets[pool->count] = packet;
+        pool->free[pool->nfree++] = packet;
+    }
+
+    return pool;
+
+fail:
+    packet_pool_destroy(pool);
+    return NULL;
+}
+
+void
+packet_pool_destroy(PacketPool *pool)
+{
+    for (unsigned i = 0; i < pool->count; i++)
+        packet_destroy(pool->packets[i]);
+
+    free(pool->packets);
+    free(pool->free);
+    free(pool);
+}
+
+Packet *
+packet_pool_get(PacketPool *pool)
+{
+    if (pool->nfree == 0)
+        return NULL;
+
+    return pool->free[--pool->nfree];
+}
+
+void
+packet_pool_put(PacketPool *pool, Packet *packet)
+{
+    pool->free[pool->nfree++] = packet;
+}
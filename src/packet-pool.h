@@ -0,0 +1,27 @@
+/* Copyright (c) Victor Roemer, 2013. All rights reserved.
+ * See LICENSE in the root source directory for details. */
+
+#ifndef PACKET_POOL_H
+#define PACKET_POOL_H
+
+#include <packet.h>
+
+typedef struct _PacketPool PacketPool;
+
+/* Create a pool holding count decoded packet objects. A pool belongs to a
+ * single thread.
+ */
+PacketPool *packet_pool_create(unsigned count);
+
+/* Destroy the pool and every packet in it, packets still handed out are
+ * destroyed as well */
+void packet_pool_destroy(PacketPool *pool);
+
+/* Take a packet from the pool, NULL when all of them are in use. The
+ * packet stays valid until it is put back.
+ */
+Packet *packet_pool_get(PacketPool *pool);
+
+void packet_pool_put(PacketPool *pool, Packet *packet);
+
+#endif /* PACKET_POOL_H */
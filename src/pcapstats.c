@@ -36,8 +36,10 @@
 
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
 #include <getopt.h>
 
+#include <time.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 
@@ -49,6 +51,12 @@
 #include "mesg.h"
 #include "daemon.h"
 #include "print-data.h"
+#include "worker.h"
+#include "capture-tpacket.h"
+#include "capture-mmap.h"
+#include "batch.h"
+#include "clock.h"
+#include "hashdigest.h"
 
 #include "defragment.h"
 #include "stream-tcp.h"
@@ -56,18 +64,48 @@
 #include "host.h"
 
 // cmdline configurations
-Options cmdline, options = basicopts;
+Options cmdline;
+__thread Options options = basicopts;
 
 const char *config_file = SYSCONFDIR "/" PACKAGE_CONFIG_FILE;
 const char *progname;
 
 pcap_t *pcap = NULL;
+Tpacket *tpacket = NULL;
+Pcapmap *pcapmap = NULL;
+
+/* Sockets of the PACKET_FANOUT group, one per analysis thread */
+static Tpacket *fanout[MAX_WORKERS];
+static unsigned nfanout;
+
+/* Tracker counters of the capture thread when running single threaded */
+static struct tracker_stats trackers;
+
+/* Packets of the capture thread waiting to be analyzed when running
+ * single threaded */
+static struct batch batch;
+
+/* Wall clock time spent reading and analyzing (s) */
+static double analysis_time;
+
+/* CaptureFilter of a savefile. Live captures hand theirs to the kernel,
+ * savefiles are filtered in user space so every removed packet is counted */
+static struct bpf_program offline_filter;
+static bool offline_filtering;
+
+/* Packets the interface had seen when the capture started */
+static uint64_t interface_packets_start;
+
+/* Set by the signal handlers, acted upon by the main thread */
+static volatile sig_atomic_t reload_config;
+static volatile sig_atomic_t terminating;
 
 /* Getopt stuff */
-const char *shortopts = "r:i:Tc:Vdq";
+const char *shortopts = "r:i:t:Tc:Vdq";
 static struct option longopts[] = {
     {"read", required_argument, NULL, 'r'},
     {"interface", required_argument, NULL, 'i'},
+    {"threads", required_argument, NULL, 't'},
     {"config-test", no_argument, NULL, 'T'},
     {"config-file", required_argument, NULL, 'c'},
     {"help", no_argument, NULL, 254},
@@ -76,29 +114,146 @@ static struct option longopts[] = {
     {0, 0, 0, 0}
 };
 
-/*
- *
+/* Setup the tracker tables of the calling thread
+ */
+static int
+tracker_init()
+{
+    if (frag_table_init() < 0)
+        return -1;
+
+    if (tcpssn_table_init( ) < 0)
+        return -1;
+
+    if (flow_table_init() < 0)
+        return -1;
+
+    if (host_table_init() < 0)
+        return -1;
+
+    return 0;
+}
+
+/* Collect the counters of the calling thread and tear down its tables
  */
 static void
-packet_callback(uint8_t * user UNUSED, const struct pcap_pkthdr *pkthdr,
-                 const uint8_t * pkt)
+tracker_finalize(struct tracker_stats *stats)
 {
-    Packet *packet = packet_create();
+    frag_table_stats(stats);
+    tcpssn_table_stats(stats);
+    flow_table_stats(stats);
+    host_table_stats(stats);
 
-    int error = packet_decode(packet, pkt, pkthdr->caplen);
+    frag_table_finalize();
+    tcpssn_table_finalize( );
+    flow_table_finalize();
+    host_table_finalize();
+}
 
-    if (error)
-        return;
+/* Tables of one chunk reader, handed to the reader of the next chunk */
+struct tracker_tables
+{
+    void *frag;
+    void *tcpssn;
+    void *flow;
+    void *host;
+};
+
+/* Detach the tracker tables of the calling thread
+ */
+static void *
+tracker_export()
+{
+    struct tracker_tables *tables;
+
+    if ((tables = malloc(sizeof *tables)) == NULL)
+        return NULL;
+
+    tables->frag = frag_table_export();
+    tables->tcpssn = tcpssn_table_export( );
+    tables->flow = flow_table_export();
+    tables->host = host_table_export();
 
-    /* defragment the packet */
-    if (packet_is_fragment(packet) && defragment(packet) != 0)
+    return tables;
+}
+
+static void datagram_reassembled(struct packet_context *ctx);
+static void config_reload(void);
+
+/* Merge detached tracker tables into those of the calling thread. The
+ * fragments go last, datagrams they complete are tracked in the merged
+ * tables.
+ */
+static void
+tracker_merge(void *p_tables)
+{
+    struct tracker_tables *tables = p_tables;
+
+    if (tables == NULL)
         return;
 
-    if (packet_protocol(packet) == IPPROTO_TCP)
-        track_tcp(packet);
+    tcpssn_table_merge(tables->tcpssn);
+    flow_table_merge(tables->flow);
+    host_table_merge(tables->host);
+    frag_table_merge(tables->frag, datagram_reassembled);
+
+    free(tables);
+}
+
+/* Run a raw packet through the CaptureFilter of a savefile
+ */
+static bool
+packet_accept(const struct pcap_pkthdr *pkthdr, const uint8_t *pkt)
+{
+    return !offline_filtering ||
+        pcap_offline_filter(&offline_filter, pkthdr, pkt) != 0;
+}
+
+/* Start loading the table entries a packet will need
+ */
+static void
+packet_prefetch(struct packet_context *ctx)
+{
+    frag_table_prefetch(ctx);
+    tcpssn_table_prefetch(ctx);
+    flow_table_prefetch(ctx);
+}
+
+/* Run a whole datagram through the trackers
+ */
+static void
+packet_track(struct packet_context *ctx)
+{
+    if (packet_protocol(ctx->packet) == IPPROTO_TCP)
+        track_tcp(ctx);
+
+    track_packet_flow(ctx);
+    track_packet_host(ctx->packet);
+}
+
+/* A reassembled datagram is keyed again, now with its ports
+ */
+static void
+datagram_reassembled(struct packet_context *ctx)
+{
+    packet_context_reassembled(ctx);
+    packet_track(ctx);
+}
+
+/* Run a decoded packet through the trackers
+ */
+static void
+packet_process(struct packet_context *ctx)
+{
+    Packet *packet = ctx->packet;
 
-//    track_packet_flow(packet);
-//    track_packet_host(packet);
+    /* defragment the packet, the datagram it completes is keyed again */
+    if (!packet_is_fragment(packet))
+        packet_track(ctx);
+    else if (defragment(ctx) == 0)
+        datagram_reassembled(ctx);
+    else
+        return;
 
 #ifdef DEBUG
     if (!options.quiet && packet_paysize(packet)) {
@@ -109,30 +264,90 @@ packet_callback(uint8_t * user UNUSED, const struct pcap_pkthdr *pkthdr,
 #endif
 }
 
-/* Catch SIGHUP to reload the configuration file */
+static const struct worker_ops tracker_ops = {
+    tracker_init,
+    packet_accept,
+    packet_prefetch,
+    packet_process,
+    tracker_finalize,
+    tracker_export,
+    tracker_merge
+};
+
+/*
+ *
+ */
+static void
+packet_callback(uint8_t * user UNUSED, const struct pcap_pkthdr *pkthdr,
+                 const uint8_t * pkt)
+{
+    if (reload_config)
+        config_reload();
+
+    if (!packet_accept(pkthdr, pkt)) {
+        trackers.filtered++;
+        return;
+    }
+
+    /* Hand the packet off to the worker that owns its flow */
+    if (options.threads > 1) {
+        worker_dispatch(pkthdr, pkt);
+        return;
+    }
+
+    int count = batch_add(&batch, pkthdr, pkt);
+
+    if (count > 0)
+        trackers.packets += count;
+}
+
+/* Analyze whatever is left in the batch before the capture buffer it
+ * points into is reused */
+static void
+packet_flush(uint8_t *user UNUSED)
+{
+    trackers.packets += batch_flush(&batch);
+}
+
+/* Stop whichever capture loop is running */
+static void breakloop()
+{
+    if (nfanout)
+        for (unsigned i = 0; i < nfanout; i++)
+            tpacket_breakloop(fanout[i]);
+    else if (tpacket)
+        tpacket_breakloop(tpacket);
+    else if (pcapmap)
+        pcapmap_breakloop(pcapmap);
+    else if (pcap)
+        pcap_breakloop(pcap);
+}
+
+/* Catch SIGHUP to reload the configuration file. The main thread reloads
+ * it once the capture loop returns, or from the packet callback when
+ * reading a savefile; fanout threads keep capturing meanwhile. */
 void sighup()
 {
-    info("Caught SIGHUP; reloading the configuration");
+    reload_config = 1;
 
-    /* Read configuration from config file */
-    if (reload_config_file(config_file, &options) < 0)
-        warn("Failed to reload the configuration; Continuing.");
-    else
-        info("Successfully reloaded the configuration.");
+    if (options.interface && !nfanout)
+        breakloop();
 }
 
 /* Catch SIGTERM and terminate the application */
 void sigterm()
 {
     info("Caught SIGTERM; exiting");
-    pcap_breakloop(pcap);
+    terminating = 1;
+    breakloop();
 }
 
 /* Catch SIGINT and terminate the application */
 void sigint()
 {
     info("Caught SIGINT; exiting");
-    pcap_breakloop(pcap);
+    terminating = 1;
+    breakloop();
 }
 
 /* Display version info */
@@ -161,6 +376,7 @@ static void show_help()
     "Statistical analysis of network traffic.\n\n"
     "\t-i, --interface=INTERFACE  live packet capture interface to read\n"
     "\t-r, --read=PCAP            static packet capture to read in\n"
+    "\t-t, --threads=N            number of analysis threads\n"
     "\t-c, --config-file=FILE     specify alternate config file\n"
     "\t-T, --config-test          test the config file and exit\n"
     "\t-d, --daemon               run as a daemon\n\n"
@@ -175,6 +391,7 @@ static void parse_args(int argc, char *argv[], Options *options)
 {
     int ch;
     int idx = 0;
+    char *end;
 
     progname = argv[0];
 
@@ -193,6 +410,13 @@ static void parse_args(int argc, char *argv[], Options *options)
             case 'r':
                 options->pcapfile = optarg;
                 break;
+            case 't':
+                options->threads = strtoul(optarg, &end, 10);
+                if (*end != '\0' || options->threads < 1 ||
+                    options->threads > MAX_WORKERS)
+                    fatal("Thread count must be between 1 and %d",
+                        MAX_WORKERS);
+                break;
             case 'c':
                 config_file = optarg;
                 break;
@@ -223,12 +447,280 @@ static void parse_args(int argc, char *argv[], Options *options)
     }
 }
 
+/* Datalink type of whichever capture is open */
+static int capture_datalink()
+{
+    if (nfanout)
+        return tpacket_datalink(fanout[0]);
+    else if (tpacket)
+        return tpacket_datalink(tpacket);
+    else if (pcapmap)
+        return pcapmap_datalink(pcapmap);
+    else
+        return pcap_datalink(pcap);
+}
+
+/* Compile the CaptureFilter and attach it to the live capture, or keep it
+ * around for the reader of a savefile. Without a filter every packet is
+ * accepted again.
+ *
+ * @return  -1 on failure
+ *          0 on success
+ */
+static int capture_filter_apply(char *errbuf)
+{
+    struct bpf_program program;
+    const char *expression = options.capture_filter ?
+        options.capture_filter : "";
+    pcap_t *compiler = pcap;
+    int ret = 0;
+
+    /* The native readers have no pcap handle of their own */
+    if (!compiler && !(compiler = pcap_open_dead(capture_datalink(), 262144))) {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "out of memory");
+        return -1;
+    }
+
+    if (pcap_compile(compiler, &program, expression, 1,
+        PCAP_NETMASK_UNKNOWN) < 0) {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "%s", pcap_geterr(compiler));
+        if (compiler != pcap)
+            pcap_close(compiler);
+        return -1;
+    }
+
+    if (compiler != pcap)
+        pcap_close(compiler);
+
+    if (options.pcapfile) {
+        offline_filter = program;
+        offline_filtering = true;
+        return 0;
+    }
+
+    if (nfanout) {
+        for (unsigned i = 0; i < nfanout && ret == 0; i++)
+            ret = tpacket_setfilter(fanout[i], &program, errbuf);
+    }
+    else if (tpacket)
+        ret = tpacket_setfilter(tpacket, &program, errbuf);
+    else if (pcap_setfilter(pcap, &program) < 0) {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "%s", pcap_geterr(pcap));
+        ret = -1;
+    }
+
+    pcap_freecode(&program);
+
+    return ret;
+}
+
+/* Swap the filter of the live capture */
+static void capture_filter_reload()
+{
+    char errbuf[PCAP_ERRBUF_SIZE];
+
+    if (capture_filter_apply(errbuf) < 0)
+        warn("Failed to apply the CaptureFilter (%s); Continuing.", errbuf);
+    else if (options.capture_filter)
+        info("Capturing \"%s\"", options.capture_filter);
+    else
+        info("Capturing everything");
+}
+
+/* Reload the configuration after a SIGHUP and hand it to the analysis
+ * threads */
+static void config_reload()
+{
+    reload_config = 0;
+
+    info("Caught SIGHUP; reloading the configuration");
+
+    /* Read configuration from config file */
+    if (reload_config_file(config_file, &options) < 0) {
+        warn("Failed to reload the configuration; Continuing.");
+        return;
+    }
+
+    if (options_publish() < 0) {
+        warn("Failed to hand the configuration to the analysis threads");
+        return;
+    }
+
+    info("Successfully reloaded the configuration.");
+
+    if (options.interface)
+        capture_filter_reload();
+}
+
+/* Packets received and sent by interface, as counted by its driver
+ *
+ * @return  -1 on failure
+ *          0 on success
+ */
+static int interface_packets(const char *interface, uint64_t *packets)
+{
+    static const char *counters[] = { "rx_packets", "tx_packets" };
+    char path[128];
+
+    *packets = 0;
+
+    for (unsigned i = 0; i < 2; i++) {
+        unsigned long long value;
+        FILE *file;
+        int n;
+
+        snprintf(path, sizeof path, "/sys/class/net/%s/statistics/%s",
+            interface, counters[i]);
+
+        if ((file = fopen(path, "r")) == NULL)
+            return -1;
+
+        n = fscanf(file, "%llu", &value);
+        fclose(file);
+
+        if (n != 1)
+            return -1;
+
+        *packets += value;
+    }
+
+    return 0;
+}
+
+/* Display the health of a tracker table: how full it got and how far
+ * lookups had to probe. Long probes or failed inserts mean it is too small
+ * or its keys hash badly.
+ */
+static void dump_table_stats(const char *name, const struct hash_stats *stats)
+{
+    char probes[128];
+    int len = 0;
+
+    if (stats->lookups == 0)
+        return;
+
+    for (int i = 0; i < HASH_PROBE_BINS && len < (int)sizeof probes; i++) {
+        unsigned low = i ? 1u << (i - 1) : 0, high = (1u << i) - 1;
+
+        if (i == HASH_PROBE_BINS - 1)
+            len += snprintf(probes + len, sizeof probes - len, " %u+:", low);
+        else if (low >= high)
+            len += snprintf(probes + len, sizeof probes - len, " %u:", low);
+        else
+            len += snprintf(probes + len, sizeof probes - len, " %u-%u:",
+                low, high);
+
+        if (len < (int)sizeof probes)
+            len += snprintf(probes + len, sizeof probes - len, "%"PRIu64,
+                stats->probes[i]);
+    }
+
+    mesg("%-17s %"PRIu64" entries, %"PRIu64" buckets (%.1f%% load)", name,
+        stats->entries, stats->buckets,
+        stats->buckets ? 100.0 * stats->entries / stats->buckets : 0.0);
+    mesg("  Lookups         %"PRIu64" (%"PRIu64" hits, %"PRIu64" misses)",
+        stats->lookups, stats->hits, stats->lookups - stats->hits);
+    mesg("  Probe Lengths  %s", probes);
+    mesg("  Max Probe       %"PRIu64, stats->max_probe);
+    mesg("  Tombstones      %"PRIu64, stats->tombstones);
+    mesg("  Resizes         %"PRIu64, stats->resizes);
+    mesg("  Failed Inserts  %"PRIu64, stats->failed_inserts);
+    mesg("  Memory          %"PRIu64" KB", stats->memory / 1024);
+}
+
+/* Display the tracker counters, summed over every analysis thread
+ */
+static void dump_tracker_stats()
+{
+    struct tracker_stats total, stats;
+    uint64_t received, dropped;
+
+    total = trackers;
+
+    for (unsigned i = 0; worker_stats(i, &stats) == 0; i++) {
+        mesg("Worker %-2u         %"PRIu64" packets", i, stats.packets);
+        if (worker_capture_stats(i, &received, &dropped) == 0) {
+            mesg("  Kernel Received %"PRIu64, received);
+            mesg("  Kernel Dropped  %"PRIu64, dropped);
+        }
+        tracker_stats_add(&total, &stats);
+    }
+
+    /* A host is counted once, however many threads tracked it */
+    host_totals_stats(&total);
+
+    if (offline_filtering)
+        mesg("Filtered          %"PRIu64, total.filtered);
+
+    if (total.frag_fragments) {
+        mesg("Frag Tracked      %"PRIu64, total.frag_fragments);
+        mesg("Frag Reassembled  %"PRIu64, total.frag_reassembled);
+    }
+
+    if (total.tcp_sessions)
+        mesg("TCP Sessions      %"PRIu64, total.tcp_sessions);
+
+    if (total.flows)
+        mesg("Flows             %"PRIu64, total.flows);
+
+    if (total.hosts)
+        mesg("Hosts             %"PRIu64, total.hosts);
+
+    dump_table_stats("Frag Table", &total.frag_table);
+    dump_table_stats("TCP Table", &total.tcp_table);
+    dump_table_stats("Flow Table", &total.flow_table);
+    dump_table_stats("Host Table", &total.host_table);
+    dump_table_stats("Host Totals", &total.host_totals);
+
+    /* Live captures spend most of their time waiting for packets */
+    if (options.pcapfile && total.packets) {
+        mesg("Analysis Time     %.3f s", analysis_time);
+        mesg("Per Packet        %.0f ns", analysis_time * 1e9 / total.packets);
+    }
+}
+
 void dump_stats()
 {
     const struct packet_stats *stats;
+    uint64_t received = 0, dropped = 0;
 
     packet_stats(&stats);
 
+    if (tpacket && tpacket_stats(tpacket, &received, &dropped) == 0) {
+        mesg("Kernel Received   %"PRIu64, received);
+        mesg("Kernel Dropped    %"PRIu64, dropped);
+    }
+
+    if (nfanout) {
+        for (unsigned i = 0; i < nfanout; i++) {
+            uint64_t r, d;
+            if (tpacket_stats(fanout[i], &r, &d) == 0) {
+                received += r;
+                dropped += d;
+            }
+        }
+        mesg("Kernel Received   %"PRIu64, received);
+        mesg("Kernel Dropped    %"PRIu64, dropped);
+    }
+
+    if (pcap && options.interface) {
+        struct pcap_stat ps;
+
+        if (pcap_stats(pcap, &ps) == 0)
+            received = ps.ps_recv;
+    }
+
+    /* The kernel does not count what the filter removed; whatever the
+     * interface saw but the capture did not receive comes close */
+    uint64_t seen;
+
+    if (options.interface && options.capture_filter &&
+        interface_packets(options.interface, &seen) == 0) {
+        seen -= interface_packets_start;
+        mesg("Kernel Filtered   ~%"PRIu64, seen > received ?
+            seen - received : 0);
+    }
+
     mesg("Analyzed %u packets",
         stats->total_packets - stats->total_errors);
     mesg("Failed analysis on %u packets\n", stats->total_errors);
@@ -313,6 +805,8 @@ void dump_stats()
         mesg("ICMP Bad Code     %u", stats->icmps_badcode);
         mesg("ICMP Too Short    %u", stats->icmps_tooshort);
     }
+
+    dump_tracker_stats();
 }
 
 int watch_signal(int sig, void (*callback)())
@@ -346,6 +840,28 @@ int main(int argc, char *argv[])
         return 0;
     }
 
+    /* Fanout threads read their own socket, there is nothing to dispatch */
+    bool fanout_mode = options.interface &&
+        options.capture_backend == CAPTURE_TPACKET &&
+        options.capture_fanout > 1;
+
+    if (fanout_mode && options.threads > 1)
+        fatal("CaptureFanout can not be combined with --threads");
+
+    if (fanout_mode && options.capture_fanout > MAX_WORKERS)
+        fatal("CaptureFanout must be between 1 and %d", MAX_WORKERS);
+
+    digest_init();
+
+    if (digest_set_mode(options.hash_function) < 0)
+        fatal("Failed to read a key for HashFunction keyed");
+
+    if (options_publish() < 0)
+        fatal("Failed to hand the configuration to the analysis threads");
+
+    if (host_totals_init() < 0)
+        fatal("Failed to create the host totals");
+
     if (watch_signal(SIGTERM, sigterm))
         return 1;
 
@@ -357,46 +873,205 @@ int main(int argc, char *argv[])
         fatal("Failed to daemonize: %s", strerror(errno));
     }
 
-    /* Spinup backend components */
-    frag_table_init();
-    tcpssn_table_init( );
-//    flow_table_init();
-//    host_table_init();
-
     /* Start processing data */
     /* Setup live interface recording */
     if (options.interface) {
         if (watch_signal(SIGINT, sigint))
             return 1;
 
-        pcap = pcap_open_live(options.interface, BUFSIZ, 1, 1000,
-            errbuf);
+        if (fanout_mode) {
+            unsigned group = getpid() & 0xffff;
 
-        if (!pcap)
-            fatal("%s (%s)", options.interface, errbuf);
+            for (nfanout = 0; nfanout < (unsigned)options.capture_fanout;
+                nfanout++) {
+                fanout[nfanout] = tpacket_open(options.interface,
+                    options.tpacket_block_size, options.tpacket_block_count,
+                    errbuf);
+
+                if (!fanout[nfanout] ||
+                    tpacket_fanout(fanout[nfanout], group, errbuf) < 0)
+                    fatal("%s (%s)", options.interface, errbuf);
+            }
+        }
+        else if (options.capture_backend == CAPTURE_TPACKET) {
+            tpacket = tpacket_open(options.interface,
+                options.tpacket_block_size, options.tpacket_block_count,
+                errbuf);
+
+            if (!tpacket)
+                fatal("%s (%s)", options.interface, errbuf);
+        }
+        else {
+            pcap = pcap_open_live(options.interface, BUFSIZ, 1, 1000,
+                errbuf);
+
+            if (!pcap)
+                fatal("%s (%s)", options.interface, errbuf);
+        }
     }
     /* Setup packet capture readback mode */
-    if (options.pcapfile) {
+    if (options.pcapfile && options.read_backend == READ_MMAP) {
+        pcapmap = pcapmap_open(options.pcapfile, errbuf);
+
+        if (!pcapmap)
+            info("%s (%s); reading through libpcap", options.pcapfile,
+                errbuf);
+    }
+
+    if (options.pcapfile && !pcapmap) {
         pcap = pcap_open_offline(options.pcapfile, errbuf);
 
         if (!pcap)
             fatal("%s (%s)", options.pcapfile, errbuf);
     }
 
-    if (packet_set_datalink(pcap_datalink(pcap)) == -1)
-        fatal("datalink type is not supported (%u)",
-            pcap_datalink(pcap));
+    if (options.capture_filter && capture_filter_apply(errbuf) < 0)
+        fatal("CaptureFilter \"%s\" (%s)", options.capture_filter, errbuf);
+
+    if (options.interface)
+        interface_packets(options.interface, &interface_packets_start);
+
+    /* Savefiles age their state on capture time */
+    clock_set_source(options.pcapfile ? CLOCK_SOURCE_PACKET :
+        CLOCK_SOURCE_SYSTEM);
+
+    /* Fanout sockets and chunks of a mapped file are read by the analysis
+     * threads themselves, there is nothing to dispatch */
+    bool readers = nfanout || (pcapmap && options.threads > 1);
+
+    /* Spinup backend components */
+    if (readers)
+        ;   /* every reader thread sets up its own tables */
+    else if (options.threads > 1) {
+        if (workers_start(options.threads, options.batch_size,
+            &tracker_ops) < 0)
+            fatal("Failed to start %u analysis threads", options.threads);
+    }
+    else if (tracker_init() < 0)
+        fatal("Failed to initialize the tracker tables");
+    /* libpcap may reuse its buffer as soon as the callback returns, only
+     * our own readers keep packets around long enough to batch them */
+    else if (batch_init(&batch, pcap ? 1 : options.batch_size,
+        &tracker_ops) < 0)
+        fatal("Failed to allocate the packet batch");
+
+    struct timespec started, finished;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    if (nfanout) {
+        if (packet_set_datalink(tpacket_datalink(fanout[0])) == -1)
+            fatal("datalink type is not supported (%u)",
+                tpacket_datalink(fanout[0]));
+
+        if (fanout_start(fanout, nfanout, options.batch_size,
+            &tracker_ops) < 0)
+            fatal("Failed to start %u fanout threads", nfanout);
+
+        /* Signals are handled here while the threads capture */
+        sigset_t set, old;
+
+        sigemptyset(&set);
+        sigaddset(&set, SIGHUP);
+        sigaddset(&set, SIGTERM);
+        sigaddset(&set, SIGINT);
+        sigprocmask(SIG_BLOCK, &set, &old);
+
+        while (!terminating) {
+            if (reload_config)
+                config_reload();
+            else
+                sigsuspend(&old);
+        }
+
+        sigprocmask(SIG_SETMASK, &old, NULL);
+
+        readers_stop();
+    }
+    else if (tpacket) {
+        if (packet_set_datalink(tpacket_datalink(tpacket)) == -1)
+            fatal("datalink type is not supported (%u)",
+                tpacket_datalink(tpacket));
+
+        int ret;
+
+        while ((ret = tpacket_loop(tpacket, packet_callback, packet_flush,
+            NULL)) == 0 && reload_config && !terminating)
+            config_reload();
+
+        if (ret == -1)
+            fatal("%s (%s)", options.interface, strerror(errno));
+    }
+    else if (pcapmap) {
+        if (packet_set_datalink(pcapmap_datalink(pcapmap)) == -1)
+            fatal("datalink type is not supported (%u)",
+                pcapmap_datalink(pcapmap));
+
+        if (readers) {
+            if (chunks_start(pcapmap, options.threads, options.batch_size,
+                &tracker_ops) < 0)
+                fatal("Failed to start %u analysis threads",
+                    options.threads);
+
+            /* Signals are handled here while the threads read */
+            struct timespec poll = { 0, 100000000 };
+
+            while (!readers_done()) {
+                if (reload_config)
+                    config_reload();
+                nanosleep(&poll, NULL);
+            }
+
+            readers_stop();
+        }
+        else if (pcapmap_loop(pcapmap, packet_callback, NULL) == -1)
+            warn("%s is truncated", options.pcapfile);
+    }
+    else {
+        if (packet_set_datalink(pcap_datalink(pcap)) == -1)
+            fatal("datalink type is not supported (%u)",
+                pcap_datalink(pcap));
+
+        int ret;
+
+        while ((ret = pcap_loop(pcap, -1, packet_callback, NULL)) == -2 &&
+            reload_config && !terminating)
+            config_reload();
 
-    if (pcap_loop(pcap, -1, packet_callback, NULL) == -1)
-        fatal("%s", pcap_geterr(pcap));
+        if (ret == -1)
+            fatal("%s", pcap_geterr(pcap));
+    }
+
+    /* Wait for the analysis threads to drain their queues */
+    if (readers)
+        ;   /* already joined */
+    else if (options.threads > 1)
+        workers_stop();
+    else {
+        packet_flush(NULL);
+        tracker_finalize(&trackers);
+        batch_destroy(&batch);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    analysis_time = (finished.tv_sec - started.tv_sec) +
+        (finished.tv_nsec - started.tv_nsec) / 1e9;
 
     dump_stats();
-    pcap_close(pcap);
 
-    frag_table_finalize();
-    tcpssn_table_finalize( );
-//    flow_table_finalize();
-//    host_table_finalize();
+    host_totals_finalize();
+
+    if (nfanout)
+        for (unsigned i = 0; i < nfanout; i++)
+            tpacket_close(fanout[i]);
+    else if (tpacket)
+        tpacket_close(tpacket);
+    else if (pcapmap)
+        pcapmap_close(pcapmap);
+    else
+        pcap_close(pcap);
+
+    if (offline_filtering)
+        pcap_freecode(&offline_filter);
 
     return 0;
 }
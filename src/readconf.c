@@ -38,6 +38,7 @@
 
 #include "getline.h"
 #include "defragment.h"
+#include "batch.h"
 #include "validate.h"
 #include "readconf.h"
 #include "mesg.h"
@@ -48,6 +49,10 @@ typedef enum {
     oFlowAgeLimit, oFlowMaxMem,
     oFragAgeLimit, oFragMaxMem, oFragModel,
     oHostAgeLimit, oHostMaxMem,
+    oTcpSynTimeout, oTcpEstablishedTimeout, oTcpCloseTimeout,
+    oTcpTimeWaitTimeout,
+    oCaptureBackend, oTpacketBlockSize, oTpacketBlockCount, oCaptureFanout,
+    oReadBackend, oBatchSize, oCaptureFilter, oHashFunction,
     oUnsupported, oDeprecated
 } Token;
 
@@ -67,6 +72,18 @@ static Keyword keywords[] = {
     { "FragModel",      oFragModel },
     { "HostMaxMem",     oHostMaxMem },
     { "HostAgeLimit",   oHostAgeLimit },
+    { "TcpSynTimeout",  oTcpSynTimeout },
+    { "TcpEstablishedTimeout", oTcpEstablishedTimeout },
+    { "TcpCloseTimeout", oTcpCloseTimeout },
+    { "TcpTimeWaitTimeout", oTcpTimeWaitTimeout },
+    { "CaptureBackend", oCaptureBackend },
+    { "TpacketBlockSize", oTpacketBlockSize },
+    { "TpacketBlockCount", oTpacketBlockCount },
+    { "CaptureFanout", oCaptureFanout },
+    { "ReadBackend",    oReadBackend },
+    { "BatchSize",      oBatchSize },
+    { "CaptureFilter",  oCaptureFilter },
+    { "HashFunction",   oHashFunction },
     { NULL,             oBadOption }
 };
 
@@ -121,6 +138,8 @@ process_config_line(Options *opts,
     while (*line && !strchr(" \t\n", *line))
         ++line;
 
+    char *value_end = line;
+
     if (*line)
         *line++ = '\0';
 
@@ -170,7 +189,8 @@ process_config_line(Options *opts,
         break;
 
         case oFragModel:
-        set_defrag_method(value, filename, linenum, &ret);
+        if ((value = set_defrag_method(value, filename, linenum, &ret)))
+            opts->frag_model = value;
         break;
 
         case oFlowMaxMem:
@@ -190,7 +210,7 @@ process_config_line(Options *opts,
         case oHostMaxMem:
         opts->host_max_mem =
             signed32_value(value, filename, linenum, &ret);
-        if (opts->flow_max_mem < 1024) {
+        if (opts->host_max_mem < 1024) {
             warn("Minimum HostMaxMem value is 1024");
             ret = -1;
         }
@@ -200,6 +220,129 @@ process_config_line(Options *opts,
         opts->host_age_limit =
             signed32_value(value, filename, linenum, &ret);
         break;
+
+        case oTcpSynTimeout:
+        opts->tcp_syn_timeout =
+            signed32_value(value, filename, linenum, &ret);
+        if (opts->tcp_syn_timeout < 1) {
+            warn("Minimum TcpSynTimeout value is 1");
+            ret = -1;
+        }
+        break;
+
+        case oTcpEstablishedTimeout:
+        opts->tcp_established_timeout =
+            signed32_value(value, filename, linenum, &ret);
+        if (opts->tcp_established_timeout < 1) {
+            warn("Minimum TcpEstablishedTimeout value is 1");
+            ret = -1;
+        }
+        break;
+
+        case oTcpCloseTimeout:
+        opts->tcp_close_timeout =
+            signed32_value(value, filename, linenum, &ret);
+        if (opts->tcp_close_timeout < 1) {
+            warn("Minimum TcpCloseTimeout value is 1");
+            ret = -1;
+        }
+        break;
+
+        case oTcpTimeWaitTimeout:
+        opts->tcp_time_wait_timeout =
+            signed32_value(value, filename, linenum, &ret);
+        if (opts->tcp_time_wait_timeout < 1) {
+            warn("Minimum TcpTimeWaitTimeout value is 1");
+            ret = -1;
+        }
+        break;
+
+        case oCaptureBackend:
+        if (strcasecmp(value, "pcap") == 0)
+            opts->capture_backend = CAPTURE_PCAP;
+        else if (strcasecmp(value, "tpacket") == 0)
+            opts->capture_backend = CAPTURE_TPACKET;
+        else {
+            warn("Bad capture backend %s:%d", filename, linenum);
+            ret = -1;
+        }
+        break;
+
+        case oTpacketBlockSize:
+        opts->tpacket_block_size =
+            signed32_value(value, filename, linenum, &ret);
+        /* The kernel wants a power of two multiple of the page size */
+        if (opts->tpacket_block_size < 4096 ||
+            (opts->tpacket_block_size & (opts->tpacket_block_size - 1))) {
+            warn("TpacketBlockSize must be a power of two >= 4096");
+            ret = -1;
+        }
+        break;
+
+        case oTpacketBlockCount:
+        opts->tpacket_block_count =
+            signed32_value(value, filename, linenum, &ret);
+        if (opts->tpacket_block_count < 1) {
+            warn("Minimum TpacketBlockCount value is 1");
+            ret = -1;
+        }
+        break;
+
+        case oCaptureFanout:
+        opts->capture_fanout =
+            signed32_value(value, filename, linenum, &ret);
+        if (opts->capture_fanout < 1) {
+            warn("Minimum CaptureFanout value is 1");
+            ret = -1;
+        }
+        break;
+
+        case oReadBackend:
+        if (strcasecmp(value, "pcap") == 0)
+            opts->read_backend = READ_PCAP;
+        else if (strcasecmp(value, "mmap") == 0)
+            opts->read_backend = READ_MMAP;
+        else {
+            warn("Bad read backend %s:%d", filename, linenum);
+            ret = -1;
+        }
+        break;
+
+        case oBatchSize:
+        opts->batch_size =
+            signed32_value(value, filename, linenum, &ret);
+        if (opts->batch_size < 1 || opts->batch_size > BATCH_MAX) {
+            warn("BatchSize must be between 1 and %d", BATCH_MAX);
+            ret = -1;
+        }
+        break;
+
+        case oCaptureFilter:
+        /* The filter expression runs to the end of the line */
+        if (*line) {
+            *value_end = ' ';
+            line += strlen(line);
+
+            while (line > value && strchr(" \t\n", line[-1]))
+                *--line = '\0';
+        }
+        while (isblank(*value))
+            ++value;
+        free((char *)opts->capture_filter);
+        if ((opts->capture_filter = strdup(value)) == NULL)
+            ret = -1;
+        break;
+
+        case oHashFunction:
+        if (strcasecmp(value, "fast") == 0)
+            opts->hash_function = DIGEST_FAST;
+        else if (strcasecmp(value, "keyed") == 0)
+            opts->hash_function = DIGEST_KEYED;
+        else {
+            warn("Bad hash function %s:%d", filename, linenum);
+            ret = -1;
+        }
+        break;
     }
 
     if (keyword && (!value || *value == '\0')) {
@@ -258,6 +401,59 @@ read_config_file(const char *filename, Options *options)
     return ret;
 }
 
+/* Options handed to the analysis threads, newest first. Threads may still
+ * read an older copy, so they are kept until exit. */
+struct options_copy
+{
+    Options options;
+    struct options_copy *older;
+};
+
+static struct options_copy *published;
+static __thread struct options_copy *in_use;
+
+/* Options Publish
+ *
+ * @return  -1 on failure
+ *          0 on success
+ */
+int
+options_publish()
+{
+    struct options_copy *copy;
+
+    if ((copy = malloc(sizeof *copy)) == NULL)
+        return -1;
+
+    copy->options = options;
+    copy->older = published;
+
+    /* The main thread frees its filter on the next reload */
+    if (options.capture_filter &&
+        (copy->options.capture_filter = strdup(options.capture_filter)) ==
+        NULL) {
+        free(copy);
+        return -1;
+    }
+
+    __atomic_store_n(&published, copy, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+void
+options_refresh()
+{
+    struct options_copy *latest =
+        __atomic_load_n(&published, __ATOMIC_ACQUIRE);
+
+    if (latest == in_use)
+        return;
+
+    options = latest->options;
+    in_use = latest;
+}
+
 /* Reread Configuration File
  *
  * Return
@@ -269,34 +465,59 @@ int
 reload_config_file(const char *filename, Options *oldopts)
 {
     int err = 0;
-    Options newopts;
-    memset(&newopts, 0, sizeof newopts);
+    Options newopts = basicopts;
+
+    /* Command line options are not part of the configuration file */
+    newopts.interface = oldopts->interface;
+    newopts.pcapfile = oldopts->pcapfile;
+    newopts.config_test = oldopts->config_test;
+    newopts.daemonize = oldopts->daemonize;
+    newopts.quiet = oldopts->quiet;
+    newopts.threads = oldopts->threads;
 
     err = read_config_file(filename, &newopts);
 
-    /* Hash table sizes can't be resized... yet */
-    if (newopts.frag_max_mem != oldopts->frag_max_mem) {
-        warn("Changing FragMaxMem requires are restart");
+    /* Age limits can't properly be adjusted yet either */
+    if (newopts.frag_age_limit != oldopts->frag_age_limit) {
+        warn("Changing FragAgeLimit requires are restart");
+        err = -1;
+    }
+
+    if (newopts.flow_age_limit != oldopts->flow_age_limit) {
+        warn("Changing FlowAgeLimit requires are restart");
         err = -1;
     }
 
-    if (newopts.flow_max_mem != oldopts->flow_max_mem) {
-        warn("Changing FlowMaxMem requires are restart");
+    /* The capture ring is only set up once */
+    if (newopts.capture_backend != oldopts->capture_backend ||
+        newopts.tpacket_block_size != oldopts->tpacket_block_size ||
+        newopts.tpacket_block_count != oldopts->tpacket_block_count ||
+        newopts.capture_fanout != oldopts->capture_fanout) {
+        warn("Changing the capture backend requires are restart");
         err = -1;
     }
 
-    /* Age limits can't properly be adjusted yet either */
-    if (newopts.frag_age_limit != oldopts->frag_age_limit) {
-        warn("Changing FragAgeLimit requires are restart");
+    if (newopts.read_backend != oldopts->read_backend) {
+        warn("Changing ReadBackend requires are restart");
         err = -1;
     }
 
-    if (newopts.flow_age_limit != oldopts->flow_age_limit) {
-        warn("Changing FlowAgeLimit requires are restart");
+    if (newopts.batch_size != oldopts->batch_size) {
+        warn("Changing BatchSize requires are restart");
+        err = -1;
+    }
+
+    /* Every key in the tables was digested the old way */
+    if (newopts.hash_function != oldopts->hash_function) {
+        warn("Changing HashFunction requires are restart");
         err = -1;
     }
-    if (err == 0)
+    if (err == 0) {
+        free((char *)oldopts->capture_filter);
         *oldopts = newopts;
+    }
+    else
+        free((char *)newopts.capture_filter);
 
     return err;
 
@@ -32,6 +32,18 @@
 
 #include <stdbool.h>
 
+#include "hashdigest.h"
+
+typedef enum {
+    CAPTURE_PCAP,
+    CAPTURE_TPACKET
+} CaptureBackend;
+
+typedef enum {
+    READ_PCAP,
+    READ_MMAP
+} ReadBackend;
+
 typedef struct {
     const char *interface;
     const char *pcapfile;
@@ -40,6 +52,8 @@ typedef struct {
     bool daemonize;
     bool quiet;
 
+    unsigned threads;
+
     uint64_t global_max_mem;
 
     int32_t flow_age_limit;
@@ -49,13 +63,44 @@ typedef struct {
     int32_t host_age_limit;
     int32_t host_max_mem;
 
+    /* Idle timeouts of TCP sessions by state */
+    int32_t tcp_syn_timeout;
+    int32_t tcp_established_timeout;
+    int32_t tcp_close_timeout;
+    int32_t tcp_time_wait_timeout;
+
     const char *frag_model;
+
+    CaptureBackend capture_backend;
+    int32_t tpacket_block_size;
+    int32_t tpacket_block_count;
+    int32_t capture_fanout;
+
+    ReadBackend read_backend;
+
+    int32_t batch_size;
+
+    const char *capture_filter;
+
+    DigestMode hash_function;
 } Options;
 
-#define nullopts { NULL, NULL, false, false, false, 0, 0, 0, 0, 0, 0, 0, NULL }
-#define basicopts { NULL, NULL, false, false, false, 128*1024*1024, 60, 16384, 60, 4096, 3600, 8192, "first" }
+#define nullopts { NULL, NULL, false, false, false, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, NULL, CAPTURE_PCAP, 0, 0, 0, READ_PCAP, 0, NULL, DIGEST_FAST }
+#define basicopts { NULL, NULL, false, false, false, 1, 128*1024*1024, 60, 16384, 60, 4096, 3600, 8192, 30, 3600, 120, 10, "first", CAPTURE_PCAP, 1024*1024, 64, 1, READ_MMAP, 32, NULL, DIGEST_FAST }
+
+/* Options of the calling thread. The main thread owns the configuration
+ * and reloads it, every analysis thread works on its own copy. */
+extern __thread Options options;
 
 int read_config_file(const char *filename, Options *opts);
 int reload_config_file(const char *filename, Options *oldopts);
 
+/* Hand a copy of the main thread's options to the analysis threads. A
+ * published copy is never changed again. */
+int options_publish(void);
+
+/* Analysis threads: take over the latest published options, if they are
+ * not already in use */
+void options_refresh(void);
+
 #endif
@@ -0,0 +1,203 @@
+/* Copyright (c) Victor Roemer, 2013. All rights reserved.
+ * See LICENSE in the root source directory for details. */
+
+/* shared-hash.c
+ *
+ * Lock striped hash table. The per thread tracker tables need no locking
+ * at all; this is for the few views several threads feed at once. The
+ * stripe of a key is picked from its hash with a multiply, so it does not
+ * take the low bits the stripe's own table picks buckets with.
+ */
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "hashtable.h"
+#include "shared-hash.h"
+
+#define CACHELINE 64
+
+/* Stripes of a table. Enough that 32 threads rarely meet on one. */
+#define SHARED_HASH_BITS 6
+#define SHARED_HASH_STRIPES (1 << SHARED_HASH_BITS)
+
+struct stripe
+{
+    pthread_mutex_t lock;
+    Hash *table;
+} __attribute__((aligned(CACHELINE)));
+
+struct shared_hash
+{
+    struct stripe stripes[SHARED_HASH_STRIPES];
+};
+
+static inline struct stripe *
+stripe_of(SharedHash *table, uint32_t digest)
+{
+    return &table->stripes[(digest * 0x9e3779b1u) >> (32 - SHARED_HASH_BITS)];
+}
+
+/* Each stripe gets its share of the table */
+static inline size_t
+stripe_buckets(size_t max_buckets)
+{
+    return (max_buckets + SHARED_HASH_STRIPES - 1) / SHARED_HASH_STRIPES;
+}
+
+SharedHash *
+shared_hash_create(size_t max_buckets, size_t keysize)
+{
+    SharedHash *table;
+    unsigned i;
+
+    if (posix_memalign((void **)&table, CACHELINE, sizeof *table) != 0)
+        return NULL;
+
+    memset(table, 0, sizeof *table);
+
+    for (i = 0; i < SHARED_HASH_STRIPES; i++) {
+        struct stripe *stripe = &table->stripes[i];
+
+        stripe->table = hash_create(stripe_buckets(max_buckets), keysize);
+        if (stripe->table == NULL)
+            goto fail;
+
+        pthread_mutex_init(&stripe->lock, NULL);
+    }
+
+    return table;
+
+fail:
+    while (i-- > 0) {
+        hash_destroy(table->stripes[i].table);
+        pthread_mutex_destroy(&table->stripes[i].lock);
+    }
+
+    free(table);
+
+    return NULL;
+}
+
+void
+shared_hash_destroy(SharedHash *table)
+{
+    for (unsigned i = 0; i < SHARED_HASH_STRIPES; i++) {
+        hash_destroy(table->stripes[i].table);
+        pthread_mutex_destroy(&table->stripes[i].lock);
+    }
+
+    free(table);
+}
+
+void
+shared_hash_limit(SharedHash *table, size_t max_buckets)
+{
+    for (unsigned i = 0; i < SHARED_HASH_STRIPES; i++) {
+        struct stripe *stripe = &table->stripes[i];
+
+        pthread_mutex_lock(&stripe->lock);
+        hash_limit(stripe->table, stripe_buckets(max_buckets));
+        pthread_mutex_unlock(&stripe->lock);
+    }
+}
+
+int
+shared_hash_get(SharedHash *table, const void *key, uint32_t digest,
+    void *copy, size_t size)
+{
+    struct stripe *stripe = stripe_of(table, digest);
+    void *value;
+
+    pthread_mutex_lock(&stripe->lock);
+
+    if ((value = hash_get_hashed(stripe->table, key, digest)) != NULL)
+        memcpy(copy, value, size);
+
+    pthread_mutex_unlock(&stripe->lock);
+
+    return value ? 0 : -1;
+}
+
+int
+shared_hash_upsert(SharedHash *table, const void *key, uint32_t digest,
+    shared_update_t update, void *arg)
+{
+    struct stripe *stripe = stripe_of(table, digest);
+    void **slot;
+    bool inserted;
+    int ret = -1;
+
+    pthread_mutex_lock(&stripe->lock);
+
+    slot = hash_find_or_insert_hashed(stripe->table, key, digest, &inserted);
+    if (slot != NULL) {
+        ret = update(slot, inserted, arg);
+
+        /* A NULL value would read as a missing key */
+        if (inserted && (ret < 0 || *slot == NULL))
+            hash_remove_hashed(stripe->table, key, digest);
+    }
+
+    pthread_mutex_unlock(&stripe->lock);
+
+    return ret;
+}
+
+void *
+shared_hash_remove(SharedHash *table, const void *key, uint32_t digest)
+{
+    struct stripe *stripe = stripe_of(table, digest);
+    void *value;
+
+    pthread_mutex_lock(&stripe->lock);
+    value = hash_remove_hashed(stripe->table, key, digest);
+    pthread_mutex_unlock(&stripe->lock);
+
+    return value;
+}
+
+void
+shared_hash_stats(SharedHash *table, struct hash_stats *stats)
+{
+    for (unsigned i = 0; i < SHARED_HASH_STRIPES; i++) {
+        struct stripe *stripe = &table->stripes[i];
+
+        pthread_mutex_lock(&stripe->lock);
+        hash_stats(stripe->table, stats);
+        pthread_mutex_unlock(&stripe->lock);
+    }
+}
+
+/* Every stripe is locked, always in the same order, before any is walked.
+ * No write lands between the first stripe and the last, so the walk sees
+ * the table as it was when the last lock was taken.
+ */
+size_t
+shared_hash_snapshot(SharedHash *table, shared_visit_t visit, void *arg)
+{
+    size_t visited = 0;
+    unsigned i, it;
+    const void *key;
+    void *value;
+
+    for (i = 0; i < SHARED_HASH_STRIPES; i++)
+        pthread_mutex_lock(&table->stripes[i].lock);
+
+    for (i = 0; i < SHARED_HASH_STRIPES; i++) {
+        Hash *stripe = table->stripes[i].table;
+
+        for (value = hash_first(stripe, &it, &key); value;
+             value = hash_next(stripe, &it, &key)) {
+            visit(key, value, arg);
+            visited++;
+        }
+    }
+
+    for (i = SHARED_HASH_STRIPES; i-- > 0;)
+        pthread_mutex_unlock(&table->stripes[i].lock);
+
+    return visited;
+}
@@ -0,0 +1,68 @@
+/* Copyright (c) Victor Roemer, 2013. All rights reserved.
+ * See LICENSE in the root source directory for details. */
+
+#ifndef SHARED_HASH_H
+#define SHARED_HASH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "hashtable.h"
+
+/* A hash table every analysis thread may use at once. Keys are spread
+ * over stripes by their hash, each stripe is a Hash of its own behind its
+ * own lock, so threads only wait on each other when they hit the same
+ * stripe.
+ *
+ * Every call takes the key_digest() of the key.
+ */
+typedef struct shared_hash SharedHash;
+
+/* Called with the value slot of a key, under the lock of its stripe. A new
+ * key comes with inserted set and a NULL value to fill in; it is taken
+ * back out of the table if it is left NULL or update returns < 0. */
+typedef int (*shared_update_t)(void **value, bool inserted, void *arg);
+
+/* Called for every entry of a snapshot */
+typedef void (*shared_visit_t)(const void *key, void *value, void *arg);
+
+SharedHash *shared_hash_create(size_t max_buckets, size_t keysize);
+
+/* Entries are not freed, empty the table first */
+void shared_hash_destroy(SharedHash *table);
+
+/* Change how far the table may grow */
+void shared_hash_limit(SharedHash *table, size_t max_buckets);
+
+/* Copy size bytes of the value of key into copy. Values are only read
+ * under the lock, so another thread may remove and free one at any time.
+ *
+ * @return  0 on success, -1 if the key is not in the table
+ */
+int shared_hash_get(SharedHash *table, const void *key, uint32_t digest,
+    void *copy, size_t size);
+
+/* Find or insert key and hand its value to update.
+ *
+ * @return  what update returned, -1 if the key is new and the table full
+ */
+int shared_hash_upsert(SharedHash *table, const void *key, uint32_t digest,
+    shared_update_t update, void *arg);
+
+/* Remove key and return its value, NULL if it was not in the table */
+void *shared_hash_remove(SharedHash *table, const void *key,
+    uint32_t digest);
+
+/* Add the health of every stripe to stats */
+void shared_hash_stats(SharedHash *table, struct hash_stats *stats);
+
+/* Visit every entry of the table as it was at one point in time. All the
+ * stripes are locked for the walk, visit must not use the table.
+ *
+ * @return  the entries visited
+ */
+size_t shared_hash_snapshot(SharedHash *table, shared_visit_t visit,
+    void *arg);
+
+#endif /* SHARED_HASH_H */
@@ -0,0 +1,51 @@
+/* Copyright (c) Victor Roemer, 2013. All rights reserved.
+ * See LICENSE in the root source directory for details. */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+#include "hashtable.h"
+
+/* Tracker counters
+ *
+ * Each analysis thread keeps its own set, they are summed together when
+ * the statistics are dumped.
+ */
+struct tracker_stats
+{
+    uint64_t packets;
+    uint64_t filtered;
+    uint64_t frag_fragments;
+    uint64_t frag_reassembled;
+    uint64_t tcp_sessions;
+    uint64_t flows;
+    uint64_t hosts;
+
+    /* Health of the tracker tables */
+    struct hash_stats frag_table;
+    struct hash_stats tcp_table;
+    struct hash_stats flow_table;
+    struct hash_stats host_table;
+    struct hash_stats host_totals;
+};
+
+static inline void
+tracker_stats_add(struct tracker_stats *dst, const struct tracker_stats *src)
+{
+    dst->packets += src->packets;
+    dst->filtered += src->filtered;
+    dst->frag_fragments += src->frag_fragments;
+    dst->frag_reassembled += src->frag_reassembled;
+    dst->tcp_sessions += src->tcp_sessions;
+    dst->flows += src->flows;
+    dst->hosts += src->hosts;
+    hash_stats_add(&dst->frag_table, &src->frag_table);
+    hash_stats_add(&dst->tcp_table, &src->tcp_table);
+    hash_stats_add(&dst->flow_table, &src->flow_table);
+    hash_stats_add(&dst->host_table, &src->host_table);
+    hash_stats_add(&dst->host_totals, &src->host_totals);
+}
+
+#endif /* STATS_H */
@@ -38,97 +38,363 @@
 #include <arpa/inet.h>
 
 #include "mesg.h"
-#include "hashtable.h"
+#include "readconf.h"
+#include "clock.h"
+#include "timequeue.h"
+#include "hashtable-typed.h"
 #include "tcp-state.h"
+#include "stream-tcp.h"
+#include "packet-context.h"
 
 #include <packet.h>
 
-static Hash *table;
-
 typedef struct
 {
     struct tcp_pcb a;
     struct tcp_pcb b;
+
+    struct tmq_element *timeout;    /* in the timeout queue */
+    bool midstream;                 /* first packet seen was not a SYN */
 } TCP_SSN;
 
-typedef struct
+/* Sessions are keyed on the conversation of their packets */
+typedef struct packet_key TCP_KEY;
+
+HASH_TABLE_DECLARE(ssn_hash, TCP_KEY, TCP_SSN);
+
+/* Tables of a thread, detached for another thread to merge */
+struct tcpssn_tables
 {
-    struct ipaddr ip_a;
-    struct ipaddr ip_b;
-    uint16_t    port_a;
-    uint16_t    port_b;
-} TCP_KEY;
+    ssn_hash *table;
+    struct tmq *timeout_queue;
+};
+
+/* Each analysis thread has its own table */
+static __thread ssn_hash *table;
+static __thread struct tmq *timeout_queue;
+static __thread struct tracker_stats tcpstats;
+
+/* Chunked reads: sessions picked up mid-stream and closed while the clock
+ * was held. The previous chunk may still hold their start, they are kept
+ * until its table is merged so the session is only counted once.
+ */
+static __thread ssn_hash *closed;
+
+static int _tcpssn_timeout_queue_task(const struct tmq_element *elem);
 
 int tcpssn_table_init( )
 {
-    table = hash_create(1024);
+    table = ssn_hash_create(options.flow_max_mem);
     if (table == NULL)
         return -1;
 
+    timeout_queue = tmq_create(options.tcp_established_timeout);
+    if (timeout_queue == NULL) {
+        ssn_hash_destroy(table);
+        table = NULL;
+        return -1;
+    }
+
+    timeout_queue->task = _tcpssn_timeout_queue_task;
+
     return 0;
 }
 
-void tcpssn_remove(TCP_KEY *key)
+void tcpssn_remove(const TCP_KEY *key, uint32_t hash)
+{
+    TCP_SSN *ssn = ssn_hash_remove(table, key, hash);
+
+    if (ssn == NULL)
+        return;
+
+    tmq_delete(timeout_queue, ssn->timeout);
+    free(ssn);
+}
+
+static int _tcpssn_timeout_queue_task(const struct tmq_element *elem)
+{
+    free(ssn_hash_remove(table, elem->key, elem->hash));
+
+    return 0;
+}
+
+/* Idle timeout of one end of a session */
+static int tcp_state_timeout(uint8_t state)
+{
+    switch (state)
+    {
+        case SYN_SENT:
+        case SYN_RCVD:
+            return options.tcp_syn_timeout;
+
+        case ESTABLISHED:
+            return options.tcp_established_timeout;
+
+        case FIN_WAIT_1:
+        case FIN_WAIT_2:
+        case CLOSING:
+        case CLOSE_WAIT:
+        case LAST_ACK:
+            return options.tcp_close_timeout;
+
+        default:
+            return options.tcp_time_wait_timeout;
+    }
+}
+
+/* A session lasts as long as the longer lived of its ends. Both ends stay
+ * CLOSED until a handshake is seen, so a session picked up mid-stream
+ * ages as an established one.
+ */
+static int tcpssn_timeout(const TCP_SSN *ssn)
 {
-    free(hash_remove(table, key, sizeof *key));
+    int a, b;
+
+    if (ssn->a.state == CLOSED && ssn->b.state == CLOSED)
+        return options.tcp_established_timeout;
+
+    a = tcp_state_timeout(ssn->a.state);
+    b = tcp_state_timeout(ssn->b.state);
+
+    return a > b ? a : b;
+}
+
+/* Queue a session to expire the idle timeout of its state after now */
+static void tcpssn_schedule(TCP_SSN *ssn, const TCP_KEY *key, uint32_t hash,
+    const struct timeval *now)
+{
+    if (ssn->timeout == NULL)
+    {
+        if ((ssn->timeout = tmq_element_create(key, sizeof *key)) == NULL)
+            return;
+
+        ssn->timeout->hash = hash;
+    }
+
+    tmq_schedule(timeout_queue, ssn->timeout, now, tcpssn_timeout(ssn));
+}
+
+/* Session closed by the packet just seen */
+static void tcpssn_close(const TCP_KEY *key, uint32_t hash, TCP_SSN *ssn,
+    const struct timeval *now)
+{
+    if (!ssn->midstream ||
+        !clock_held(now, options.tcp_established_timeout))
+    {
+        tcpssn_remove(key, hash);
+        return;
+    }
+
+    if (closed == NULL &&
+        (closed = ssn_hash_create(options.flow_max_mem)) == NULL)
+    {
+        tcpssn_remove(key, hash);
+        return;
+    }
+
+    ssn_hash_remove(table, key, hash);
+    tmq_delete(timeout_queue, ssn->timeout);
+    ssn->timeout = NULL;
+
+    /* Replaces any earlier session of the same key closed in this chunk,
+     * only the last one can continue a session of the previous chunk */
+    free(ssn_hash_remove(closed, key, hash));
+
+    if (ssn_hash_insert(closed, ssn, key, hash) < 0)
+        free(ssn);
+}
+
+static void tcpssn_closed_destroy( )
+{
+    TCP_SSN *it;
+    unsigned i;
+    const TCP_KEY *key;
+
+    if (closed == NULL)
+        return;
+
+    for (it = ssn_hash_first(closed, &i, &key); it;
+         it = ssn_hash_next(closed, &i, &key))
+        free(it);
+
+    ssn_hash_destroy(closed);
+    closed = NULL;
 }
 
 void tcpssn_table_finalize( )
 {
     TCP_SSN *it;
     unsigned i;
-    const void *key;
+    const TCP_KEY *key;
+
+    /* Already handed to another thread */
+    if (table == NULL)
+        return;
+
+    for (it = ssn_hash_first(table, &i, &key); it;
+         it = ssn_hash_next(table, &i, &key))
+        tcpssn_remove(key, ssn_hash_digest(key));
+
+    tcpssn_closed_destroy();
 
-    for (it = hash_first(table, &i, &key); it; it = hash_next(table, &i, &key))
-        tcpssn_remove((TCP_KEY*)key);
+    tmq_destroy(timeout_queue);
+    timeout_queue = NULL;
 
-    hash_destroy(table);
+    ssn_hash_destroy(table);
+    table = NULL;
 }
 
-TCP_SSN *tcpssn_get(TCP_KEY *key)
+void tcpssn_table_stats(struct tracker_stats *stats)
 {
-    TCP_SSN *ssn = (TCP_SSN *)hash_get(table, key, sizeof *key);
+    stats->tcp_sessions += tcpstats.tcp_sessions;
 
-    if (ssn != NULL)
-        return ssn;
+    if (table)
+        ssn_hash_stats(table, &stats->tcp_table);
+}
+
+/* Detach this thread's table so it can be merged by another thread */
+void *tcpssn_table_export( )
+{
+    struct tcpssn_tables *tables;
 
-    if ((ssn = calloc(1, sizeof *ssn)) == NULL)
+    if ((tables = malloc(sizeof *tables)) == NULL)
         return NULL;
 
-    hash_insert(table, ssn, key, sizeof *key);
-    memset(ssn, 0, sizeof *ssn);
+    tables->table = table;
+    tables->timeout_queue = timeout_queue;
+
+    table = NULL;
+    timeout_queue = NULL;
 
-    return ssn;
+    return tables;
 }
 
-void tcp_key_from_packet(TCP_KEY *key, Packet *p, int *dir)
+/* Fold the detached table of an earlier part of the capture into this
+ * thread's table. A session still open at the end of the earlier part and
+ * picked up mid-stream by this one is the same session: it is counted once
+ * and keeps the state it was first tracked with, or is dropped if this
+ * part closed it. A session this part saw start replaces the earlier one.
+ */
+void tcpssn_table_merge(void *p_tables)
 {
-    memset(key, 0, sizeof *key);
+    struct tcpssn_tables *tables = p_tables;
+    ssn_hash *earlier;
+    TCP_SSN *it, *mine;
+    TCP_KEY key;
+    uint32_t hash;
+    unsigned i;
+    const TCP_KEY *p_key;
+    struct timeval last;
 
-    key->ip_a = packet_srcaddr(p);
-    key->ip_b = packet_dstaddr(p);
-    key->port_a = packet_srcport(p);
-    key->port_b = packet_dstport(p);
-    *dir = 0;
+    if (tables == NULL)
+        return;
 
-    if (ip_compare(&key->ip_a, &key->ip_b) == IP_LESSER)
+    earlier = tables->table;
+
+    for (it = ssn_hash_first(earlier, &i, &p_key); it;
+         it = ssn_hash_next(earlier, &i, &p_key))
     {
-        key->ip_a = packet_dstaddr(p);
-        key->ip_b = packet_srcaddr(p);
-        key->port_a = packet_dstport(p);
-        key->port_b = packet_srcport(p);
-        *dir = 1;
+        memcpy(&key, p_key, sizeof key);
+        hash = ssn_hash_digest(&key);
+        ssn_hash_remove(earlier, &key, hash);
+
+        /* Its element goes with the earlier queue, the session is queued
+         * here from the time it was last seen */
+        if (it->timeout)
+            last = it->timeout->time;
+        else
+            clock_now(&last);
+
+        it->timeout = NULL;
+
+        if (closed && (mine = ssn_hash_remove(closed, &key, hash)) != NULL)
+        {
+            free(mine);
+            free(it);
+            tcpstats.tcp_sessions--;
+            continue;
+        }
+
+        if ((mine = ssn_hash_get(table, &key, hash)) != NULL)
+        {
+            if (!mine->midstream)
+            {
+                free(it);
+                continue;
+            }
+
+            if (mine->timeout && timercmp(&mine->timeout->time, &last, >))
+                last = mine->timeout->time;
+
+            tcpssn_remove(&key, hash);
+            tcpstats.tcp_sessions--;
+        }
+
+        if (ssn_hash_insert(table, it, &key, hash) < 0)
+            free(it);
+        else
+            tcpssn_schedule(it, &key, hash, &last);
     }
+
+    tcpssn_closed_destroy();
+
+    ssn_hash_merge_stats(table, earlier);
+
+    tmq_destroy(tables->timeout_queue);
+    ssn_hash_destroy(earlier);
+    free(tables);
 }
 
-int track_tcp(Packet *p)
+TCP_SSN *tcpssn_get(TCP_KEY *key, uint32_t hash, bool *created)
 {
-    TCP_KEY key;
-    int dir;
-    tcp_key_from_packet(&key, p, &dir);
+    TCP_SSN **slot;
 
-    TCP_SSN *ssn = tcpssn_get(&key);
-    if (ssn == NULL)
+    /* Sessions are flows, they share FlowMaxMem */
+    ssn_hash_limit(table, options.flow_max_mem);
+
+    slot = ssn_hash_find_or_insert(table, key, hash, created);
+    if (slot == NULL)
+        return NULL;
+
+    if (!*created)
+        return *slot;
+
+    if ((*slot = calloc(1, sizeof(TCP_SSN))) == NULL) {
+        ssn_hash_remove(table, key, hash);
+        return NULL;
+    }
+
+    tcpstats.tcp_sessions++;
+
+    return *slot;
+}
+
+/* Start loading the session of a packet, ahead of track_tcp() */
+void tcpssn_table_prefetch(struct packet_context *ctx)
+{
+    if (packet_protocol(ctx->packet) != IPPROTO_TCP)
+        return;
+
+    ssn_hash_prefetch(table, ctx->hash);
+}
+
+int track_tcp(struct packet_context *ctx)
+{
+    Packet *p = ctx->packet;
+    int dir = ctx->reversed;
+    struct timeval now;
+    bool created, open;
+    int ret;
+
+    TCP_SSN *ssn;
+
+    if (ctx->merged)
+    {
+        if ((ssn = ssn_hash_get(table, &ctx->key, ctx->hash)) == NULL)
+            return 0;
+        created = false;
+    }
+    else if ((ssn = tcpssn_get(&ctx->key, ctx->hash, &created)) == NULL)
     {
         warn("could not get ssn");
         return -1;
@@ -151,17 +417,26 @@ int track_tcp(Packet *p)
         seg.len += 1;
     }
 
+#ifdef DEBUG
     print_tcb_seg(&seg);
+#endif
+
+    /* Only a SYN starts a session, anything else continues one */
+    if (created)
+        ssn->midstream = (seg.flags & (TCP_SYN | TCP_ACK)) != TCP_SYN;
+
+    open = ssn->a.state != CLOSED || ssn->b.state != CLOSED;
 
     if (dir)
     {
-        tcp_process(&ssn->a, &ssn->b, &seg);
+        ret = tcp_process(&ssn->a, &ssn->b, &seg);
     }
     else
     {
-        tcp_process(&ssn->b, &ssn->a, &seg);
+        ret = tcp_process(&ssn->b, &ssn->a, &seg);
     }
 
+#ifdef DEBUG
     printf("------------\nTCP A\n");
     print_tcb_pcb(&ssn->a);
 
@@ -170,6 +445,24 @@ int track_tcp(Packet *p)
     printf("\n\n");
 //    printf("A State = %d\n", ssn->a.state);
 //    printf("B State = %d\n\n", ssn->b.state);
+#endif /* DEBUG */
+
+    /* Closed by a RST or the last ACK of a FIN exchange, or a RST is all
+     * there is of it: nothing is left to track */
+    clock_now(&now);
+
+    if (ssn->a.state == CLOSED && ssn->b.state == CLOSED &&
+        (open || ((seg.flags & TCP_RST) && (ret == 0 || created))))
+    {
+        tcpssn_close(&ctx->key, ctx->hash, ssn, &now);
+    }
+    else
+    {
+        tcpssn_schedule(ssn, &ctx->key, ctx->hash, &now);
+    }
+
+    /* Check for timed out sessions, the table belongs to this thread */
+    tmq_timeout(timeout_queue);
 
     return 0;
 }
@@ -26,6 +26,13 @@
  */
 #include <packet.h>
 
+#include "stats.h"
+#include "packet-context.h"
+
 int tcpssn_table_init( );
 void tcpssn_table_finalize( );
-int track_tcp(Packet *p);
+void tcpssn_table_stats(struct tracker_stats *stats);
+void tcpssn_table_prefetch(struct packet_context *ctx);
+void *tcpssn_table_export( );
+void tcpssn_table_merge(void *tables);
+int track_tcp(struct packet_context *ctx);
@@ -48,20 +48,6 @@
 /* b <= a <= c */
 #define TCP_SEQ_BETWEEN(a,b,c) (TCP_SEQ_GEQ(a,b) && TCP_SEQ_LEQ(a,c))
 
-enum {
-    CLOSED,
-    SYN_SENT,
-    SYN_RCVD,
-    ESTABLISHED,
-    FIN_WAIT_1,
-    FIN_WAIT_2,
-    CLOSING,
-    TIME_WAIT,
-    CLOSE_WAIT,
-    LAST_ACK,
-    MAX_STATE
-};
-
 char *state_name[] =
 {
     "CLOSED",
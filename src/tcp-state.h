@@ -44,6 +44,21 @@ struct tcp_seg {
     uint32_t len;
 };
 
+/* connection states, the state of a new pcb is CLOSED */
+enum {
+    CLOSED,
+    SYN_SENT,
+    SYN_RCVD,
+    ESTABLISHED,
+    FIN_WAIT_1,
+    FIN_WAIT_2,
+    CLOSING,
+    TIME_WAIT,
+    CLOSE_WAIT,
+    LAST_ACK,
+    MAX_STATE
+};
+
 /* tcp protocol control block */
 struct tcp_pcb {
     uint8_t state;
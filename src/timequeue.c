@@ -27,6 +27,16 @@
  * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
  * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
+/* timequeue.c
+ *
+ * Hashed hierarchical timing wheel (Varghese & Lauck). Level 0 has a slot
+ * per tick, a slot of level n a slot per turn of level n - 1. An element
+ * goes in the lowest level whose turn reaches its deadline, in the slot
+ * its deadline falls in there. As a level comes around to a slot its
+ * elements are placed again, closer to the bottom, until level 0 expires
+ * them. Queueing, moving and cancelling an element are a few pointer
+ * writes; expiring skips straight to the next slot that holds anything.
+ */
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -39,8 +49,113 @@
 #endif
 
 #include "timequeue.h"
+#include "clock.h"
 #include "cdefs.h"
 
+#define TMQ_WHEEL_MASK (TMQ_WHEEL_SLOTS - 1)
+
+/* Ticks ahead the wheel can hold an element */
+#define TMQ_WHEEL_SPAN (1ULL << (TMQ_WHEEL_BITS * TMQ_WHEEL_LEVELS))
+
+static inline uint64_t
+tmq_ticks (const struct timeval *tv)
+{
+    return (uint64_t)tv->tv_sec * TMQ_TICKS_PER_SEC +
+        (uint64_t)tv->tv_usec / (1000000 / TMQ_TICKS_PER_SEC);
+}
+
+/** Link an element into the wheel by its deadline
+ */
+static void
+wheel_place (struct tmq *tmq, struct tmq_element *elem)
+{
+    struct tmq_element **slot;
+    uint64_t expires, delta;
+    unsigned level = 0, idx;
+
+    /* Late elements expire with the next tick */
+    expires = elem->deadline > tmq->now ? elem->deadline : tmq->now;
+    delta = expires - tmq->now;
+
+    /* Too far ahead, wait in the last level */
+    if (delta >= TMQ_WHEEL_SPAN)
+    {
+        delta = TMQ_WHEEL_SPAN - 1;
+        expires = tmq->now + delta;
+    }
+
+    if (delta)
+        level = (63 - __builtin_clzll (delta)) / TMQ_WHEEL_BITS;
+
+    idx = (expires >> (level * TMQ_WHEEL_BITS)) & TMQ_WHEEL_MASK;
+    slot = &tmq->wheel[level][idx];
+
+    elem->next = *slot;
+    elem->pprev = slot;
+    if (*slot)
+        (*slot)->pprev = &elem->next;
+    *slot = elem;
+
+    tmq->occupied[level] |= 1ULL << idx;
+}
+
+static void
+wheel_unlink (struct tmq_element *elem)
+{
+    *elem->pprev = elem->next;
+    if (elem->next)
+        elem->next->pprev = elem->pprev;
+
+    elem->next = NULL;
+    elem->pprev = NULL;
+}
+
+/** Tick at which the wheel next comes to a slot that may hold elements
+ */
+static uint64_t
+wheel_next (const struct tmq *tmq)
+{
+    uint64_t next = UINT64_MAX;
+
+    for (unsigned level = 0; level < TMQ_WHEEL_LEVELS; level++)
+    {
+        unsigned shift = level * TMQ_WHEEL_BITS;
+        uint64_t occupied = tmq->occupied[level], turn, ahead, at;
+
+        if (occupied == 0)
+            continue;
+
+        /* First slot of the level the wheel comes to, at or after now */
+        turn = (tmq->now + (1ULL << shift) - 1) >> shift;
+        ahead = occupied >> (turn & TMQ_WHEEL_MASK);
+
+        if (ahead)
+            at = turn + __builtin_ctzll (ahead);
+        else
+            at = (turn | TMQ_WHEEL_MASK) + 1 + __builtin_ctzll (occupied);
+
+        if ((at << shift) < next)
+            next = at << shift;
+    }
+
+    return next;
+}
+
+/** Detach the elements of a slot into list, they are taken off it one at a
+ * time so the task may delete any of them
+ */
+static void
+wheel_take (struct tmq *tmq, unsigned level, unsigned idx,
+            struct tmq_element **list)
+{
+    *list = tmq->wheel[level][idx];
+    tmq->wheel[level][idx] = NULL;
+    tmq->occupied[level] &= ~(1ULL << idx);
+
+    if (*list)
+        (*list)->pprev = list;
+}
+
 /** Timeout Queue Create
  * @return pointer to new tmq
  */
@@ -49,12 +164,11 @@ tmq_create (unsigned timeout)
 {
     struct tmq *tmq;
 
-    if ((tmq = malloc (sizeof (*tmq))) == NULL)
+    if ((tmq = calloc (1, sizeof (*tmq))) == NULL)
         return NULL;
 
     tmq->size = 0;
-    tmq->head = NULL;
-    tmq->tail = NULL;
+    tmq->now = 0;
     tmq->timeout = timeout ? timeout : TIMEOUT;
 
 #ifdef ENABLE_PTHREADS
@@ -144,9 +258,12 @@ tmq_element_create (const void *p_key, unsigned int i_key_size)
     }
     memcpy (elem->key, p_key, i_key_size);
 
-    elem->prev = NULL;
     elem->next = NULL;
-    gettimeofday (&elem->time, NULL);
+    elem->pprev = NULL;
+    elem->deadline = 0;
+    elem->hash = 0;
+    clock_now (&elem->time);
+    elem->created = elem->time;
 
     return elem;
 }
@@ -163,8 +280,10 @@ tmq_destroy (struct tmq *tmq)
     if (tmq->state == QUEUE_STARTED)
         return -1;
 
-    while (tmq->size > 0)
-        tmq_delete (tmq, tmq->head);
+    for (unsigned level = 0; level < TMQ_WHEEL_LEVELS; level++)
+        for (unsigned idx = 0; idx < TMQ_WHEEL_SLOTS; idx++)
+            while (tmq->wheel[level][idx])
+                tmq_delete (tmq, tmq->wheel[level][idx]);
 
     free (tmq);
 
@@ -174,41 +293,20 @@ tmq_destroy (struct tmq *tmq)
 }
 
 /** Timeout Queue Pop
- * Remove the element from the list
+ * Remove the element from the wheel
  * @return -1 on failure, 0 on success
  */
 int
 tmq_pop (struct tmq *tmq, struct tmq_element *elem)
 {
-    if (tmq == NULL || tmq->size == 0 || elem == NULL)
+    if (tmq == NULL || elem == NULL || elem->pprev == NULL)
         return -1;
 
 #ifdef ENABLE_PTHREADS
     pthread_mutex_lock (&tmq->lock);
 #endif
 
-    if (elem == tmq->head)
-    {
-        tmq->head = elem->next;
-
-        if (tmq->head == NULL)
-            tmq->tail = NULL;
-        else
-            tmq->head->prev = NULL;
-    }
-    else
-    {
-        elem->prev->next = elem->next;
-
-        if (elem->next == NULL)
-            tmq->tail = elem->prev;
-        else
-            elem->next->prev = elem->prev;
-    }
-
-    elem->prev = NULL;
-    elem->next = NULL;
-
+    wheel_unlink (elem);
     tmq->size--;
 
 #ifdef ENABLE_PTHREADS
@@ -237,36 +335,41 @@ tmq_delete (struct tmq *tmq, struct tmq_element *elem)
     return 0;
 }
 
-/** Timeout Queue Element Insert
+/** Timeout Queue Element Schedule
  * @return -1 on failure, 0 on success
  */
 int
-tmq_insert (struct tmq *tmq, struct tmq_element *elem)
+tmq_schedule (struct tmq *tmq, struct tmq_element *elem,
+              const struct timeval *now, int timeout)
 {
-    if (tmq == NULL || elem == NULL)
+    uint64_t ticks;
+
+    if (tmq == NULL || elem == NULL || now == NULL)
         return -1;
 
+    ticks = tmq_ticks (now);
+
 #ifdef ENABLE_PTHREADS
     pthread_mutex_lock (&tmq->lock);
 #endif
 
-    if (tmq->size == 0)
+    if (elem->pprev)
     {
-        tmq->head = elem;
-        tmq->tail = elem;
-        tmq->head->prev = NULL;
-        tmq->head->next = NULL;
+        wheel_unlink (elem);
+        tmq->size--;
     }
-    else
+
+    /* An empty wheel starts turning from the time it is first used */
+    if (tmq->size == 0 && ticks > tmq->now)
     {
-        elem->next = tmq->head;
-        elem->prev = NULL;
-        tmq->head->prev = elem;
-        tmq->head = elem;
+        memset (tmq->occupied, 0, sizeof (tmq->occupied));
+        tmq->now = ticks;
     }
 
+    elem->time = *now;
+    elem->deadline = ticks + (uint64_t)timeout * TMQ_TICKS_PER_SEC;
+    wheel_place (tmq, elem);
     tmq->size++;
-    gettimeofday (&elem->time, NULL);
 
 #ifdef ENABLE_PTHREADS
     pthread_mutex_unlock (&tmq->lock);
@@ -275,64 +378,80 @@ tmq_insert (struct tmq *tmq, struct tmq_element *elem)
     return 0;
 }
 
-/** Update the atime on the element and bump it up the tmq
- * @return -1 on failure, 0 on success 
+/** Timeout Queue Element Insert
+ * @return -1 on failure, 0 on success
  */
 int
-tmq_bump (struct tmq *tmq, struct tmq_element *elem)
+tmq_insert (struct tmq *tmq, struct tmq_element *elem)
 {
-    if (tmq == NULL || elem == NULL)
-        return -1;
+    struct timeval now;
 
-    if (tmq_pop (tmq, elem))
+    if (tmq == NULL || elem == NULL)
         return -1;
 
-    tmq_insert (tmq, elem);
+    clock_now (&now);
 
-    return 0;
+    return tmq_schedule (tmq, elem, &now, tmq->timeout);
 }
 
-/** Timeout Queue Find
- * @return pointer to matching element
+/** Update the atime on the element and restart its timeout
+ * @return -1 on failure, 0 on success 
  */
-struct tmq_element *
-tmq_find (struct tmq *tmq, const void *p_key)
+int
+tmq_bump (struct tmq *tmq, struct tmq_element *elem)
 {
-    struct tmq_element *it;
-
-    if (tmq == NULL || p_key == NULL)
-        return NULL;
-
-    for (it = tmq->head; it; it = it->next)
-        if (tmq->compare (p_key, it->key) == 0)
-            return it;
+    if (tmq == NULL || elem == NULL || elem->pprev == NULL)
+        return -1;
 
-    return NULL;
+    return tmq_insert (tmq, elem);
 }
 
-/** Timeout old elements in the tmq 
+/** Expire the elements due at tick, after bringing those of the higher
+ * levels whose slot comes around at tick down the wheel
  * @return number of elements timed out
  */
-int
-tmq_timeout (struct tmq *tmq)
+static int
+wheel_turn (struct tmq *tmq, uint64_t tick)
 {
-    struct tmq_element *it;
-    struct timeval timeout;
+    struct tmq_element *list, *it;
     int removed = 0;
 
-    if (tmq == NULL)
-        return -1;
+    tmq->now = tick;
+
+    for (unsigned level = TMQ_WHEEL_LEVELS - 1; level > 0; level--)
+    {
+        unsigned shift = level * TMQ_WHEEL_BITS;
+
+        if (tick & ((1ULL << shift) - 1))
+            continue;
+
+        wheel_take (tmq, level, (tick >> shift) & TMQ_WHEEL_MASK, &list);
+
+        while ((it = list) != NULL)
+        {
+            wheel_unlink (it);
+            wheel_place (tmq, it);
+        }
+    }
 
-    gettimeofday (&timeout, NULL);
-    timeout.tv_sec -= TIMEOUT;
+    wheel_take (tmq, 0, tick & TMQ_WHEEL_MASK, &list);
 
-    for (it = tmq->tail; it; it = tmq->tail)
+    /* The wheel is past tick for whatever the tasks queue */
+    tmq->now = tick + 1;
+
+    while ((it = list) != NULL)
     {
-        if (it->time.tv_sec > timeout.tv_sec)
-            break;
+        /* Keep it out of the way of the next timeout, keeping its age */
+        if (clock_held (&it->created, tmq->timeout))
+        {
+            wheel_unlink (it);
+            it->deadline = tick + TMQ_TICKS_PER_SEC;
+            wheel_place (tmq, it);
+            continue;
+        }
 
         if (tmq->task != NULL)
-            tmq->task (it->key);
+            tmq->task (it);
 
         tmq_delete (tmq, it);
         removed++;
@@ -341,6 +460,45 @@ tmq_timeout (struct tmq *tmq)
     return removed;
 }
 
+/** Expire the elements due by now
+ * @return number of elements timed out
+ */
+int
+tmq_expire (struct tmq *tmq, const struct timeval *now)
+{
+    uint64_t target, tick;
+    int removed = 0;
+
+    if (tmq == NULL || now == NULL)
+        return -1;
+
+    target = tmq_ticks (now);
+
+    while (tmq->size > 0 && (tick = wheel_next (tmq)) <= target)
+        removed += wheel_turn (tmq, tick);
+
+    if (target >= tmq->now)
+        tmq->now = target + 1;
+
+    return removed;
+}
+
+/** Timeout old elements in the tmq 
+ * @return number of elements timed out
+ */
+int
+tmq_timeout (struct tmq *tmq)
+{
+    struct timeval now;
+
+    if (tmq == NULL)
+        return -1;
+
+    clock_now (&now);
+
+    return tmq_expire (tmq, &now);
+}
+
 /** Timeout Thread
  * @return void *
  */
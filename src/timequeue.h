@@ -30,6 +30,7 @@
 #ifndef __TIMEOUT_QUEUE_H__
 #define __TIMEOUT_QUEUE_H__
 
+#include <stdint.h>
 #include <sys/time.h>
 #include <pthread.h>
 
@@ -50,6 +51,17 @@
 #   define TIMEOUT_INTERVAL DEFAULT_TIMEOUT_INTERVAL
 #endif
 
+/** Timing wheel geometry
+ * Deadlines are kept in ticks of a millisecond. Each level of the wheel
+ * has TMQ_WHEEL_SLOTS slots, a slot of one level spanning a whole turn of
+ * the level below, so five levels reach about 12 days ahead. Elements due
+ * later wait in the last level and are placed again as it turns.
+ */
+#define TMQ_TICKS_PER_SEC 1000
+#define TMQ_WHEEL_BITS 6
+#define TMQ_WHEEL_SLOTS (1 << TMQ_WHEEL_BITS)
+#define TMQ_WHEEL_LEVELS 5
+
 /** State of the tmq
  */
 typedef enum
@@ -59,22 +71,27 @@ typedef enum
 } QUEUE_STATE;
 
 /** Schedule Queue Element
+ * The entry it times out keeps a pointer to it, so bumping and deleting
+ * never search the queue
  */
 struct tmq_element
 {
-    struct tmq_element *prev;
     struct tmq_element *next;
+    struct tmq_element **pprev; /* link to this element, NULL if unqueued */
+    uint64_t deadline;          /* tick it expires at */
     struct timeval time;        /* access time */
+    struct timeval created;     /* creation time */
     void *key;
+    uint32_t hash;              /* table hash of key, set by the owner */
 };
 
 /** Schedule Queue Structure
  */
 struct tmq
 {
-    struct tmq_element *head;
-    struct tmq_element *tail;
-    int tmq;
+    struct tmq_element *wheel[TMQ_WHEEL_LEVELS][TMQ_WHEEL_SLOTS];
+    uint64_t occupied[TMQ_WHEEL_LEVELS];    /* slots that may hold elements */
+    uint64_t now;                           /* next tick to expire */
     int size;
     int timeout;
 
@@ -82,8 +99,7 @@ struct tmq
     pthread_mutex_t lock;
     QUEUE_STATE state;
 
-    int (*compare) (const void *p1, const void *p2);
-    int (*task) (const void *p);
+    int (*task) (const struct tmq_element *elem);
 };
 
 /** Timer routine
@@ -92,7 +108,7 @@ extern void *tmq_thread (void *args);
 
 /** Create a new tmq 
  */
-extern struct tmq *tmq_create ();
+extern struct tmq *tmq_create (unsigned timeout);
 
 /** Start the expiration thread for the tmq
  */
@@ -111,7 +127,7 @@ extern struct tmq_element *tmq_element_create (const void *p_key,
  */
 extern int tmq_destroy (struct tmq *tmq);
 
-/** Pop an element out of the tmq
+/** Pop an element out of the tmq, cancelling its timeout
  */
 extern int tmq_pop (struct tmq *tmq, struct tmq_element *elem);
 
@@ -119,20 +135,25 @@ extern int tmq_pop (struct tmq *tmq, struct tmq_element *elem);
  */
 extern int tmq_delete (struct tmq *tmq, struct tmq_element *elem);
 
-/** Insert an element into the tmq
+/** Insert an element into the tmq, to expire timeout seconds from now
  */
 extern int tmq_insert (struct tmq *tmq, struct tmq_element *elem);
 
-/** Push element to top of tmq and update access time
+/** Update the access time of the element and restart its timeout
  */
 extern int tmq_bump (struct tmq *tmq, struct tmq_element *elem);
 
-/** Find an element that matches the data
+/** Queue the element, or move it, to expire timeout seconds after now,
+ * its access time
+ */
+extern int tmq_schedule (struct tmq *tmq, struct tmq_element *elem,
+                         const struct timeval *now, int timeout);
+
+/** Expire every element due by now
  */
-extern struct tmq_element *tmq_find (struct tmq *tmq,
-                                         const void *p_key);
+extern int tmq_expire (struct tmq *tmq, const struct timeval *now);
 
-/** Timeout old elements in the tmq
+/** Expire every element due by the current time of the calling thread
  */
 extern int tmq_timeout (struct tmq *tmq);
 
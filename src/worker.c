@@ -0,0 +1,568 @@
+/* Copyright (c) Victor Roemer, 2013. All rights reserved.
+ * See LICENSE in the root source directory for details. */
+
+/* worker.c
+ *
+ * Sharded packet pipeline. The capture thread decodes every packet into a
+ * slot and hands it to one of N analysis threads based on the hash of its
+ * addresses and protocol, so both directions of a conversation and every
+ * fragment of its datagrams are always analyzed by the same thread. Each
+ * thread owns private frag, TCP, flow and host tables.
+ *
+ * Slots move between the capture thread and a worker over a pair of single
+ * producer, single consumer rings; no locks are taken on the packet path.
+ *
+ * In fanout mode there is no dispatcher at all, the kernel spreads flows
+ * over a group of sockets and every worker reads and decodes its own.
+ *
+ * In chunk mode every worker reads its own byte range of a mapped savefile.
+ * A flow can show up in several ranges, so when a worker is done it takes
+ * the tables of the range before it, merges them into its own and passes
+ * the result on to the range after it.
+ */
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "worker.h"
+#include "batch.h"
+#include "clock.h"
+#include "hashdigest.h"
+#include "mesg.h"
+#include "readconf.h"
+
+#define CACHELINE 64
+
+struct slot
+{
+    struct packet_context ctx;
+    struct timeval ts;
+    uint32_t size;
+    uint8_t *data;
+};
+
+struct ring
+{
+    struct slot **items;
+    unsigned mask;
+
+    unsigned head __attribute__((aligned(CACHELINE)));
+    unsigned tail __attribute__((aligned(CACHELINE)));
+};
+
+struct worker
+{
+    pthread_t thread;
+    unsigned id;
+
+    struct ring in;     /* capture thread -> worker */
+    struct ring done;   /* worker -> capture thread */
+
+    Tpacket *tpacket;   /* fanout socket */
+    struct batch batch;
+
+    size_t start;       /* savefile range */
+    size_t end;
+    void *tables;       /* handed to the next range */
+    bool handed_off;
+
+    struct tracker_stats stats;
+};
+
+static const struct worker_ops *worker_ops;
+static struct worker *workers;
+static unsigned nworkers;
+static unsigned batch_size;
+static int stopping;
+
+static Pcapmap *pcapmap;
+static pthread_mutex_t handoff_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t handoff_cond = PTHREAD_COND_INITIALIZER;
+static unsigned readers_finished;
+
+/* Slots owned by the capture thread */
+static struct slot *slots;
+static struct slot **freelist;
+static unsigned nslots;
+static unsigned nfree;
+
+static int
+ring_init(struct ring *ring, unsigned size)
+{
+    ring->items = calloc(size, sizeof *ring->items);
+    if (ring->items == NULL)
+        return -1;
+
+    ring->mask = size - 1;
+    ring->head = 0;
+    ring->tail = 0;
+
+    return 0;
+}
+
+static inline bool
+ring_push(struct ring *ring, struct slot *slot)
+{
+    unsigned head = ring->head;
+
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) > ring->mask)
+        return false;
+
+    ring->items[head & ring->mask] = slot;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+static inline struct slot *
+ring_pop(struct ring *ring)
+{
+    unsigned tail = ring->tail;
+
+    if (tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    struct slot *slot = ring->items[tail & ring->mask];
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+    return slot;
+}
+
+/* Take back every slot the workers are done with */
+static void
+slots_reclaim()
+{
+    struct slot *slot;
+
+    for (unsigned i = 0; i < nworkers; i++)
+        while ((slot = ring_pop(&workers[i].done)) != NULL)
+            freelist[nfree++] = slot;
+}
+
+static struct slot *
+slot_get()
+{
+    while (nfree == 0) {
+        slots_reclaim();
+        if (nfree == 0)
+            sched_yield();
+    }
+
+    return freelist[--nfree];
+}
+
+static inline void
+slot_put(struct slot *slot)
+{
+    freelist[nfree++] = slot;
+}
+
+static void *
+worker_main(void *arg)
+{
+    struct worker *worker = arg;
+    struct timespec idle = { 0, 10000 };
+    struct slot *batch[BATCH_MAX];
+    struct slot *slot;
+    sigset_t set;
+
+    /* Signals are handled by the capture thread */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    options_refresh();
+
+    if (worker_ops->init() < 0)
+        fatal("worker %u failed to initialize its tables", worker->id);
+
+    for (;;) {
+        bool stop = __atomic_load_n(&stopping, __ATOMIC_ACQUIRE);
+        unsigned count = 0;
+
+        while (count < batch_size && (slot = ring_pop(&worker->in)) != NULL)
+            batch[count++] = slot;
+
+        if (count == 0) {
+            /* Everything queued before stopping was set has been seen */
+            if (stop)
+                break;
+
+            nanosleep(&idle, NULL);
+            continue;
+        }
+
+        /* Pick up a configuration reloaded in the meantime */
+        options_refresh();
+
+        for (unsigned i = 0; i < count; i++)
+            worker_ops->prefetch(&batch[i]->ctx);
+
+        for (unsigned i = 0; i < count; i++) {
+            clock_advance(&batch[i]->ts);
+            worker_ops->process(&batch[i]->ctx);
+            worker->stats.packets++;
+
+            /* The done ring holds every slot, it can not fill up */
+            ring_push(&worker->done, batch[i]);
+        }
+    }
+
+    worker_ops->finalize(&worker->stats);
+
+    return NULL;
+}
+
+/* Worker Start
+ *
+ * @return  -1 on failure
+ *          0 on success
+ */
+int
+workers_start(unsigned count, unsigned batch, const struct worker_ops *ops)
+{
+    unsigned done_size = 1;
+
+    if (count == 0 || count > MAX_WORKERS || batch == 0 || batch > BATCH_MAX)
+        return -1;
+
+    worker_ops = ops;
+    batch_size = batch;
+    nworkers = count;
+    nslots = count * WORKER_RING_SIZE;
+
+    while (done_size < nslots)
+        done_size <<= 1;
+
+    workers = calloc(nworkers, sizeof *workers);
+    slots = calloc(nslots, sizeof *slots);
+    freelist = calloc(nslots, sizeof *freelist);
+    if (workers == NULL || slots == NULL || freelist == NULL)
+        return -1;
+
+    for (unsigned i = 0; i < nslots; i++) {
+        if ((slots[i].ctx.packet = packet_create()) == NULL)
+            return -1;
+        slot_put(&slots[i]);
+    }
+
+    for (unsigned i = 0; i < nworkers; i++) {
+        workers[i].id = i;
+
+        if (ring_init(&workers[i].in, WORKER_RING_SIZE) < 0 ||
+            ring_init(&workers[i].done, done_size) < 0)
+            return -1;
+
+        if (pthread_create(&workers[i].thread, NULL, worker_main,
+            &workers[i]))
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Worker Dispatch
+ *
+ * Copy the packet into a free slot, decode it there and queue it for the
+ * worker that owns the flow.
+ *
+ * @return  -1 if the packet failed to decode
+ *          0 on success
+ */
+int
+worker_dispatch(const struct pcap_pkthdr *pkthdr, const uint8_t *pkt)
+{
+    struct slot *slot = slot_get();
+
+    if (pkthdr->caplen > slot->size) {
+        uint8_t *data = realloc(slot->data, pkthdr->caplen);
+        if (data == NULL) {
+            warn("could not allocate packet slot");
+            slot_put(slot);
+            return -1;
+        }
+        slot->data = data;
+        slot->size = pkthdr->caplen;
+    }
+
+    memcpy(slot->data, pkt, pkthdr->caplen);
+    slot->ts = pkthdr->ts;
+
+    if (packet_decode(slot->ctx.packet, slot->data, pkthdr->caplen)) {
+        slot_put(slot);
+        return -1;
+    }
+
+    /* Workers are picked without ports, so every fragment of a datagram
+     * goes to the worker owning the session it belongs to */
+    packet_context_init(&slot->ctx);
+
+    struct worker *worker = &workers[slot->ctx.shard % nworkers];
+
+    while (!ring_push(&worker->in, slot)) {
+        slots_reclaim();
+        sched_yield();
+    }
+
+    return 0;
+}
+
+/* Worker Stop
+ *
+ * Let the workers finish whatever is queued, then join them.
+ */
+void
+workers_stop()
+{
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+
+    for (unsigned i = 0; i < nworkers; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    slots_reclaim();
+
+    for (unsigned i = 0; i < nslots; i++) {
+        packet_destroy(slots[i].ctx.packet);
+        free(slots[i].data);
+    }
+
+    for (unsigned i = 0; i < nworkers; i++) {
+        free(workers[i].in.items);
+        free(workers[i].done.items);
+    }
+
+    free(freelist);
+    free(slots);
+}
+
+static void
+reader_callback(uint8_t *user, const struct pcap_pkthdr *pkthdr,
+    const uint8_t *pkt)
+{
+    struct worker *worker = (struct worker *)user;
+
+    options_refresh();
+
+    if (!worker_ops->accept(pkthdr, pkt)) {
+        worker->stats.filtered++;
+        return;
+    }
+
+    int count = batch_add(&worker->batch, pkthdr, pkt);
+
+    if (count > 0)
+        worker->stats.packets += count;
+}
+
+static void
+reader_flush(uint8_t *user)
+{
+    struct worker *worker = (struct worker *)user;
+
+    worker->stats.packets += batch_flush(&worker->batch);
+}
+
+static void *
+fanout_main(void *arg)
+{
+    struct worker *worker = arg;
+    sigset_t set;
+
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    options_refresh();
+
+    if (worker_ops->init() < 0)
+        fatal("worker %u failed to initialize its tables", worker->id);
+
+    if (tpacket_loop(worker->tpacket, reader_callback, reader_flush,
+        (uint8_t *)worker) < 0)
+        warn("worker %u capture failed", worker->id);
+
+    reader_flush((uint8_t *)worker);
+
+    worker_ops->finalize(&worker->stats);
+
+    return NULL;
+}
+
+/* Fanout Start
+ *
+ * @return  -1 on failure
+ *          0 on success
+ */
+int
+fanout_start(Tpacket **sockets, unsigned count, unsigned batch,
+    const struct worker_ops *ops)
+{
+    if (count == 0 || count > MAX_WORKERS)
+        return -1;
+
+    worker_ops = ops;
+    nworkers = count;
+
+    if ((workers = calloc(nworkers, sizeof *workers)) == NULL)
+        return -1;
+
+    for (unsigned i = 0; i < nworkers; i++) {
+        workers[i].id = i;
+        workers[i].tpacket = sockets[i];
+
+        if (batch_init(&workers[i].batch, batch, ops) < 0)
+            return -1;
+
+        if (pthread_create(&workers[i].thread, NULL, fanout_main,
+            &workers[i]))
+            return -1;
+    }
+
+    return 0;
+}
+
+static void *
+chunk_main(void *arg)
+{
+    struct worker *worker = arg;
+    sigset_t set;
+
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    options_refresh();
+
+    if (worker_ops->init() < 0)
+        fatal("worker %u failed to initialize its tables", worker->id);
+
+    /* Early state may continue state of the previous range */
+    if (worker->id > 0)
+        clock_hold();
+
+    if (pcapmap_loop_range(pcapmap, worker->start, worker->end,
+        reader_callback, (uint8_t *)worker) < 0)
+        warn("worker %u stopped at a truncated record", worker->id);
+
+    /* The mapping outlives the loop, the last batch can wait until here */
+    reader_flush((uint8_t *)worker);
+
+    /* Wait for the previous range and take over its tables */
+    if (worker->id > 0) {
+        struct worker *prev = &workers[worker->id - 1];
+
+        pthread_mutex_lock(&handoff_lock);
+        while (!prev->handed_off)
+            pthread_cond_wait(&handoff_cond, &handoff_lock);
+        pthread_mutex_unlock(&handoff_lock);
+
+        options_refresh();
+        worker_ops->merge(prev->tables);
+        clock_release();
+    }
+
+    if (worker->id < nworkers - 1) {
+        worker->tables = worker_ops->export();
+
+        pthread_mutex_lock(&handoff_lock);
+        worker->handed_off = true;
+        pthread_cond_broadcast(&handoff_cond);
+        pthread_mutex_unlock(&handoff_lock);
+    }
+
+    worker_ops->finalize(&worker->stats);
+
+    __atomic_add_fetch(&readers_finished, 1, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+/* Chunks Start
+ *
+ * @return  -1 on failure
+ *          0 on success
+ */
+int
+chunks_start(Pcapmap *pm, unsigned count, unsigned batch,
+    const struct worker_ops *ops)
+{
+    size_t bounds[MAX_WORKERS + 1];
+
+    if (count == 0 || count > MAX_WORKERS)
+        return -1;
+
+    worker_ops = ops;
+    nworkers = count;
+    pcapmap = pm;
+
+    if ((workers = calloc(nworkers, sizeof *workers)) == NULL)
+        return -1;
+
+    pcapmap_split(pm, count, bounds);
+
+    for (unsigned i = 0; i < nworkers; i++) {
+        workers[i].id = i;
+        workers[i].start = bounds[i];
+        workers[i].end = bounds[i + 1];
+
+        if (batch_init(&workers[i].batch, batch, ops) < 0)
+            return -1;
+
+        /* The mapping outlives the readers */
+        workers[i].batch.mapped = true;
+
+        if (pthread_create(&workers[i].thread, NULL, chunk_main,
+            &workers[i]))
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Readers Done
+ *
+ * @return  true once every chunk thread is done with its range
+ */
+bool
+readers_done()
+{
+    return __atomic_load_n(&readers_finished, __ATOMIC_ACQUIRE) >= nworkers;
+}
+
+/* Readers Stop
+ *
+ * Join the fanout or chunk threads, once their sockets have been told to
+ * break or their ranges are done.
+ */
+void
+readers_stop()
+{
+    for (unsigned i = 0; i < nworkers; i++) {
+        pthread_join(workers[i].thread, NULL);
+        batch_destroy(&workers[i].batch);
+    }
+}
+
+int
+worker_capture_stats(unsigned id, uint64_t *received, uint64_t *dropped)
+{
+    if (id >= nworkers || workers[id].tpacket == NULL)
+        return -1;
+
+    return tpacket_stats(workers[id].tpacket, received, dropped);
+}
+
+int
+worker_stats(unsigned id, struct tracker_stats *stats)
+{
+    if (id >= nworkers)
+        return -1;
+
+    *stats = workers[id].stats;
+
+    return 0;
+}
@@ -0,0 +1,78 @@
+/* Copyright (c) Victor Roemer, 2013. All rights reserved.
+ * See LICENSE in the root source directory for details. */
+
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <pcap.h>
+#include <packet.h>
+
+#include "stats.h"
+#include "packet-context.h"
+#include "capture-tpacket.h"
+#include "capture-mmap.h"
+
+/* Maximum number of analysis threads */
+#define MAX_WORKERS 64
+
+/* Packets queued per worker, must be a power of two */
+#define WORKER_RING_SIZE 1024
+
+/* Callbacks run on each worker thread. Trackers keep their tables in
+ * thread local storage so everything done here is private to the worker.
+ */
+struct worker_ops
+{
+    int (*init)(void);
+
+    /* Readers only: false if the raw packet is to be dropped unseen */
+    bool (*accept)(const struct pcap_pkthdr *pkthdr, const uint8_t *pkt);
+
+    void (*prefetch)(struct packet_context *ctx);
+    void (*process)(struct packet_context *ctx);
+    void (*finalize)(struct tracker_stats *stats);
+
+    /* Chunked reads only: detach the tables of the calling thread, and
+     * fold the detached tables of the previous chunk into the calling
+     * thread's own */
+    void *(*export)(void);
+    void (*merge)(void *tables);
+};
+
+/* Spin up count workers, each analyzing up to batch packets at a time */
+int workers_start(unsigned count, unsigned batch,
+    const struct worker_ops *ops);
+
+/* Decode a packet and queue it on the worker owning its flow */
+int worker_dispatch(const struct pcap_pkthdr *pkthdr, const uint8_t *pkt);
+
+/* Drain the queues and join every worker */
+void workers_stop(void);
+
+/* Run one analysis thread per fanout socket, each decoding the frames of
+ * its own socket */
+int fanout_start(Tpacket **sockets, unsigned count, unsigned batch,
+    const struct worker_ops *ops);
+
+/* Cut a mapped savefile into count ranges and analyze each range in its
+ * own thread. Tables are merged in file order once every range is done. */
+int chunks_start(Pcapmap *pm, unsigned count, unsigned batch,
+    const struct worker_ops *ops);
+
+/* True once every chunk thread is done */
+bool readers_done(void);
+
+/* Join every fanout or chunk thread */
+void readers_stop(void);
+
+/* Counters of worker id, -1 if there is no such worker */
+int worker_stats(unsigned id, struct tracker_stats *stats);
+
+/* Kernel counters of the socket read by worker id, -1 if the worker does
+ * not own a socket */
+int worker_capture_stats(unsigned id, uint64_t *received, uint64_t *dropped);
+
+#endif /* WORKER_H */
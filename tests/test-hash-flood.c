@@ -0,0 +1,162 @@
+/* Copyright (c) Victor Roemer, 2013. All rights reserved.
+ * See LICENSE in the root source directory for details. */
+
+/* test-hash-flood.c
+ *
+ * Hash flooding regression test. CRC32C carries no secret: two keys whose
+ * words differ by d and by crc32c(d) folded into the next word digest the
+ * same under any seed, so an attacker can send a table nothing but keys
+ * of one bucket. Each digest mode runs in its own process, the digest is
+ * picked once per process.
+ *
+ * Under HashFunction keyed the flood must spread like any other keys, with
+ * every probe well short of MAX_PROBE. Under the fast mode the flood must
+ * actually collide where the CPU has CRC32C, or the keys prove nothing.
+ */
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "hashtable.h"
+#include "hashdigest.h"
+
+/* Keys of the flood */
+#define FLOOD 4096
+
+/* Longest probe a keyed table may take for them */
+#define MAX_PROBE 32
+
+struct flood_key
+{
+    uint64_t words[2];
+};
+
+/* CRC32C of a word from a zero register, what the crc32 instruction does
+ * with it. Linear in the word. */
+static uint32_t crc32c_word(uint64_t word)
+{
+    uint32_t crc = 0;
+
+    for (int i = 0; i < 64; i++) {
+        crc ^= (word >> i) & 1;
+        crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+    }
+
+    return crc;
+}
+
+/* Keys that all digest alike under CRC32C, whatever its seed */
+static void flood_keys(struct flood_key *keys, unsigned count)
+{
+    for (unsigned i = 0; i < count; i++) {
+        uint64_t d = (uint64_t)(i + 1) * 0x9e3779b97f4a7c15ULL;
+
+        keys[i].words[0] = 0x0a0000010a000002ULL ^ d;
+        keys[i].words[1] = 0x0050d43100000006ULL ^ crc32c_word(d);
+    }
+}
+
+/* Insert and look up every key of the flood, the longest probe taken.
+ * Exits 2 if a key goes missing. */
+static uint64_t flood(const struct flood_key *keys, unsigned count)
+{
+    struct hash_stats stats;
+    Hash *table;
+
+    if ((table = hash_create(count * 2, sizeof *keys)) == NULL)
+        exit(2);
+
+    for (unsigned i = 0; i < count; i++)
+        if (hash_insert(table, (void *)&keys[i], &keys[i]) < 0)
+            exit(2);
+
+    for (unsigned i = 0; i < count; i++)
+        if (hash_get(table, &keys[i]) != &keys[i])
+            exit(2);
+
+    memset(&stats, 0, sizeof stats);
+    hash_stats(table, &stats);
+
+    for (unsigned i = 0; i < count; i++)
+        hash_remove(table, &keys[i]);
+
+    hash_destroy(table);
+
+    return stats.max_probe;
+}
+
+/* Flood a table digested in mode, in a process of its own. The longest
+ * probe, or -1 if the run failed. */
+static long flood_in(DigestMode mode, const struct flood_key *keys,
+    unsigned count)
+{
+    int fds[2], status;
+    uint64_t probe;
+    pid_t pid;
+
+    if (pipe(fds) < 0 || (pid = fork()) < 0)
+        return -1;
+
+    if (pid == 0) {
+        close(fds[0]);
+        digest_init();
+        if (digest_set_mode(mode) < 0)
+            _exit(2);
+        probe = flood(keys, count);
+        _exit(write(fds[1], &probe, sizeof probe) == sizeof probe ? 0 : 2);
+    }
+
+    close(fds[1]);
+
+    ssize_t got = read(fds[0], &probe, sizeof probe);
+    close(fds[0]);
+
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0 || got != sizeof probe)
+        return -1;
+
+    return (long)probe;
+}
+
+int main(void)
+{
+    static struct flood_key keys[FLOOD];
+    long fast, keyed;
+    int ret = 0;
+
+    flood_keys(keys, FLOOD);
+
+    if ((fast = flood_in(DIGEST_FAST, keys, FLOOD)) < 0 ||
+        (keyed = flood_in(DIGEST_KEYED, keys, FLOOD)) < 0) {
+        fprintf(stderr, "FAIL: the flood did not run\n");
+        return 1;
+    }
+
+    printf("%u colliding keys, longest probe: fast %ld, keyed %ld\n",
+        FLOOD, fast, keyed);
+
+    if (keyed >= MAX_PROBE) {
+        fprintf(stderr, "FAIL: keyed probes are not bounded (%ld >= %d)\n",
+            keyed, MAX_PROBE);
+        ret = 1;
+    }
+
+#if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();
+
+    /* Otherwise the fast mode is the multiply mix, the keys are not made
+     * for it */
+    if (__builtin_cpu_supports("sse4.2") && fast < FLOOD / 2) {
+        fprintf(stderr, "FAIL: the keys do not collide under CRC32C\n");
+        ret = 1;
+    }
+#endif
+
+    return ret;
+}
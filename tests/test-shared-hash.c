@@ -0,0 +1,196 @@
+/* Copyright (c) Victor Roemer, 2013. All rights reserved.
+ * See LICENSE in the root source directory for details. */
+
+/* test-shared-hash.c
+ *
+ * Stress test of the shared hash table. THREADS threads count into a set
+ * of keys they all share, while each one churns through keys of its own:
+ * inserted, read back, removed and freed. Every value is a pair of
+ * counters bumped together under the lock of its stripe, so a snapshot
+ * must never see them apart, and once the threads are done the shared
+ * counters must add up to every bump made.
+ */
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "cdefs.h"
+#include "hashdigest.h"
+#include "shared-hash.h"
+
+#define THREADS 8
+#define ROUNDS 20480
+
+/* Keys every thread counts into, and keys each thread has at a time.
+ * ROUNDS is a multiple of twice OWN_KEYS, each thread ends with none. */
+#define SHARED_KEYS 256
+#define OWN_KEYS 64
+
+/* Rounds between the snapshots of a thread */
+#define SNAPSHOT_ROUNDS 2000
+
+#define SHARED_OWNER 0xffffffffu
+
+struct key
+{
+    uint32_t owner;
+    uint32_t id;
+};
+
+struct counter
+{
+    uint64_t a;
+    uint64_t b;
+};
+
+static SharedHash *table;
+
+static unsigned long torn, lost, snapshots;
+
+static int
+count(void **value, bool inserted, void *arg UNUSED)
+{
+    struct counter *counter = *value;
+
+    if (inserted && (counter = *value = calloc(1, sizeof *counter)) == NULL)
+        return -1;
+
+    counter->a++;
+    counter->b++;
+
+    return 0;
+}
+
+static uint32_t
+digest_of(const struct key *key)
+{
+    return key_digest(key, sizeof *key);
+}
+
+static void
+check_pair(const void *key UNUSED, void *value, void *arg)
+{
+    const struct counter *counter = value;
+    uint64_t *sum = arg;
+
+    if (counter->a != counter->b)
+        __atomic_add_fetch(&torn, 1, __ATOMIC_RELAXED);
+
+    if (sum && ((const struct key *)key)->owner == SHARED_OWNER)
+        *sum += counter->a;
+}
+
+static void *
+stress(void *arg)
+{
+    uint32_t self = (uint32_t)(uintptr_t)arg;
+
+    for (uint32_t round = 0; round < ROUNDS; round++) {
+        struct key shared = { SHARED_OWNER, round % SHARED_KEYS };
+        struct key own = { self, round % OWN_KEYS };
+        struct counter copy;
+
+        if (shared_hash_upsert(table, &shared, digest_of(&shared), count,
+            NULL) < 0)
+            __atomic_add_fetch(&lost, 1, __ATOMIC_RELAXED);
+
+        /* Inserted for OWN_KEYS rounds, read back and freed for the next */
+        if (round / OWN_KEYS % 2 == 0) {
+            if (shared_hash_upsert(table, &own, digest_of(&own), count,
+                NULL) < 0)
+                __atomic_add_fetch(&lost, 1, __ATOMIC_RELAXED);
+        }
+        else {
+            struct counter *counter;
+
+            if (shared_hash_get(table, &own, digest_of(&own), &copy,
+                sizeof copy) < 0 || copy.a != 1 || copy.b != 1)
+                __atomic_add_fetch(&lost, 1, __ATOMIC_RELAXED);
+
+            if ((counter = shared_hash_remove(table, &own,
+                digest_of(&own))) == NULL)
+                __atomic_add_fetch(&lost, 1, __ATOMIC_RELAXED);
+
+            free(counter);
+        }
+
+        if (round % SNAPSHOT_ROUNDS == 0) {
+            shared_hash_snapshot(table, check_pair, NULL);
+            __atomic_add_fetch(&snapshots, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    return NULL;
+}
+
+static void
+collect_key(const void *key, void *value UNUSED, void *arg)
+{
+    struct key **next = arg;
+
+    memcpy((*next)++, key, sizeof **next);
+}
+
+int main(void)
+{
+    static struct key keys[SHARED_KEYS + THREADS * OWN_KEYS];
+    pthread_t threads[THREADS];
+    struct key *next = keys;
+    uint64_t sum = 0;
+    size_t left;
+    int ret = 0;
+
+    digest_init();
+
+    if ((table = shared_hash_create(4096, sizeof(struct key))) == NULL) {
+        fprintf(stderr, "FAIL: could not create the table\n");
+        return 1;
+    }
+
+    for (uintptr_t i = 0; i < THREADS; i++)
+        if (pthread_create(&threads[i], NULL, stress, (void *)i)) {
+            fprintf(stderr, "FAIL: could not start thread %u\n",
+                (unsigned)i);
+            return 1;
+        }
+
+    for (unsigned i = 0; i < THREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    left = shared_hash_snapshot(table, check_pair, &sum);
+
+    printf("%d threads, %d rounds, %lu snapshots: %zu keys left, "
+        "%llu counted\n", THREADS, ROUNDS, snapshots, left,
+        (unsigned long long)sum);
+
+    if (torn) {
+        fprintf(stderr, "FAIL: %lu snapshots saw a value half updated\n",
+            torn);
+        ret = 1;
+    }
+
+    if (lost) {
+        fprintf(stderr, "FAIL: %lu operations lost their key\n", lost);
+        ret = 1;
+    }
+
+    if (sum != (uint64_t)THREADS * ROUNDS || left != SHARED_KEYS) {
+        fprintf(stderr, "FAIL: expected %d keys counting to %llu\n",
+            SHARED_KEYS, (unsigned long long)THREADS * ROUNDS);
+        ret = 1;
+    }
+
+    shared_hash_snapshot(table, collect_key, &next);
+
+    while (next-- > keys)
+        free(shared_hash_remove(table, next, digest_of(next)));
+
+    shared_hash_destroy(table);
+
+    return ret;
+}